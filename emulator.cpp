@@ -18,11 +18,40 @@
 #include <sstream>
 #include <iomanip>
 #include <map>
+#include <set>
 #include <fstream>
 #include <stdexcept>
 #include <cctype>
 #include <unordered_map>
+#include <unordered_set>
 #include <queue>
+#include <chrono>
+#include <random>
+#include <array>
+#include <functional>
+#include <filesystem>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <new>
+#include <cstring>
+#include <bitset>
+#include <algorithm>
+#include <deque>
+#include <condition_variable>
+#include <ctime>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
 
 using namespace std;
 
@@ -34,14 +63,20 @@ enum OpCode : uint8_t {
     LOAD_A = 0x03,
     LOAD_B = 0x04,
     STORE_A = 0x05,
+    LOAD_A_MEM = 0x06, // Load A from a 16-bit absolute address
+    LOAD_B_MEM = 0x07, // Load B from a 16-bit absolute address
+    STORE_A_MEM = 0x08, // Store A to a 16-bit absolute address
     // Arithmetic Instructions
     ADD_A_B = 0x10,
     SUB_A_B = 0x11,
     // Control Flow Instructions
     JMP = 0x20,
+    JZ = 0x21,  // Jump to an 8-bit address if A is zero
+    JNZ = 0x22, // Jump to an 8-bit address if A is not zero
     HALT = 0xFF,
     // System Call Instruction (for OS)
-    SYSCALL = 0x30
+    SYSCALL = 0x30,
+    IRET = 0x31 // Return from an interrupt handler
 };
 
 // Converter from string to OpCode
@@ -51,406 +86,7334 @@ const map<string, OpCode> opcodeMap = {
     {"LOAD_A", LOAD_A},
     {"LOAD_B", LOAD_B},
     {"STORE_A", STORE_A},
+    {"LOAD_A_MEM", LOAD_A_MEM},
+    {"LOAD_B_MEM", LOAD_B_MEM},
+    {"STORE_A_MEM", STORE_A_MEM},
     {"ADD_A_B", ADD_A_B},
     {"SUB_A_B", SUB_A_B},
     {"JMP", JMP},
+    {"JZ", JZ},
+    {"JNZ", JNZ},
     {"HALT", HALT},
-    {"SYSCALL", SYSCALL}
+    {"SYSCALL", SYSCALL},
+    {"IRET", IRET}
 };
 
+/**
+ * Name: operandSize
+ * Purpouse: Report how many operand bytes follow an opcode in the instruction stream.
+ * Inputs:
+ *   - opcode: The opcode to look up.
+ * Outputs: 0, 1 (8-bit immediate or address) or 2 (16-bit little-endian address).
+ * Effects: None
+ */
+int operandSize(OpCode opcode) {
+    switch (opcode) {
+        case LOAD_A:
+        case LOAD_B:
+        case STORE_A:
+        case JMP:
+        case JZ:
+        case JNZ:
+            return 1;
+        case LOAD_A_MEM:
+        case LOAD_B_MEM:
+        case STORE_A_MEM:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Name: opcodeCycles
+ * Purpouse: Report the nominal cost of an instruction for the compiler's cost model.
+ * Inputs:
+ *   - opcode: The opcode to look up.
+ * Outputs: Cycles: one per instruction byte fetched, one per data memory or stack access,
+ *          and one for a control transfer. A SYSCALL is charged a flat 10.
+ * Effects: None
+ */
+int opcodeCycles(OpCode opcode) {
+    switch (opcode) {
+        case LOAD_A:
+        case LOAD_B:
+        case PUSH_B:
+        case POP_B:
+            return 2;
+        case STORE_A:
+        case JMP:
+        case JZ:
+        case JNZ:
+            return 3;
+        case LOAD_A_MEM:
+        case LOAD_B_MEM:
+        case STORE_A_MEM:
+            return 4;
+        case IRET:
+            return 2;
+        case SYSCALL:
+            return 10;
+        default:
+            return 1;
+    }
+}
+
 // OS Kernel definitions
 const uint16_t KERNEL_START_ADDRESS = 0x1000;
 const uint16_t USER_PROGRAM_START_ADDRESS = 0x0000;
 enum class SyscallNumber : uint8_t {
     PRINT_CHAR = 1,
-    READ_CHAR = 2
+    READ_CHAR = 2,
+    SUBMIT_RING = 3,
+    FILE_OPEN = 4,
+    FILE_READ = 5,
+    FILE_WRITE = 6,
+    FILE_CLOSE = 7,
+    FILE_SEEK = 8,
+    SET_INTERRUPT_MASK = 9,
+    SET_INTERRUPT_VECTOR = 10,
+    SET_TIMER = 11,
+    DMA_START = 12,
+    DMA_STATUS = 13,
+    PRESENT_FRAME = 14,
+    NET_TRANSMIT = 15,
+    NET_RECEIVE = 16,
+    SET_BANK = 17
 };
 
-class CPU {
+// Syscall ring (io_uring-style). The program places the ring anywhere in the zero
+// page and passes its base address in reg_B with SUBMIT_RING. Layout:
+//   +0 sq_head (kernel)   +1 sq_tail (user)   +2 cq_head (user)   +3 cq_tail (kernel)
+//   +4                          submission entries {syscall number, argument}
+//   +4 + 2*SYSCALL_RING_ENTRIES completion entries {syscall number, result}
+// Heads and tails are free-running counters; the slot is counter % SYSCALL_RING_ENTRIES.
+const uint8_t SYSCALL_RING_ENTRIES = 8;
+const uint8_t SYSCALL_RING_HEADER_SIZE = 4;
+
+// vDSO page: a kernel-maintained, read-only page mapped at the same address in every
+// program. Programs read it with LOAD_A_MEM/LOAD_B_MEM instead of trapping. Multi-byte
+// fields are little-endian; the host refreshes the page when a load touches it.
+const uint16_t VDSO_ADDRESS = 0xF000;
+const uint16_t VDSO_INSTRUCTION_COUNT = VDSO_ADDRESS + 0x00; // 8 bytes, instructions retired
+const uint16_t VDSO_TIME_US = VDSO_ADDRESS + 0x08;           // 8 bytes, microseconds since boot
+const uint16_t VDSO_PID = VDSO_ADDRESS + 0x10;               // 1 byte, process ID
+const uint16_t VDSO_RANDOM = VDSO_ADDRESS + 0x20;            // 32 bytes, fresh on every read
+const uint16_t VDSO_RANDOM_SIZE = 32;
+const uint16_t VDSO_SIZE = 0x40;
+
+// Memory-mapped framebuffer: FRAMEBUFFER_WIDTH x FRAMEBUFFER_HEIGHT pixels, one RGB332
+// byte each, stored row by row.
+const uint16_t FRAMEBUFFER_ADDRESS = 0x8000;
+const int FRAMEBUFFER_WIDTH = 64;
+const int FRAMEBUFFER_HEIGHT = 64;
+const uint16_t FRAMEBUFFER_SIZE = FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT;
+
+// Symbols predefined by the assembler for reading the vDSO page and drawing.
+const map<string, uint16_t> vdsoSymbols = {
+    {"VDSO_INSTRUCTION_COUNT", VDSO_INSTRUCTION_COUNT},
+    {"VDSO_TIME_US", VDSO_TIME_US},
+    {"VDSO_PID", VDSO_PID},
+    {"VDSO_RANDOM", VDSO_RANDOM},
+    {"FRAMEBUFFER", FRAMEBUFFER_ADDRESS}
+};
+
+// Interrupt controller. Lines are prioritized by number (line 0 is highest) and a set bit
+// in the mask register blocks a line. Handler addresses live in a vector table at the
+// start of kernel memory, one little-endian word per line; a zero entry drops the
+// interrupt. Pending lines are only examined at block boundaries (after a jump, SYSCALL
+// or IRET), so running code pays nothing while nothing is pending.
+const int INTERRUPT_LINES = 8;
+const uint16_t INTERRUPT_VECTOR_TABLE = KERNEL_START_ADDRESS;
+const uint8_t IRQ_TIMER = 0;
+const uint8_t IRQ_DMA = 1;
+const uint8_t IRQ_NET = 2;
+
+// File syscalls take the zero-page address of a file control block (FCB) in reg_B and
+// return 0 in reg_B on success or SYSCALL_ERROR on failure. Multi-byte fields are
+// little-endian.
+const uint8_t SYSCALL_ERROR = 0xFF;
+const uint8_t FCB_FD = 0;      // 1 byte, descriptor (out for FILE_OPEN, in otherwise)
+const uint8_t FCB_MODE = 1;    // 1 byte, FileMode for FILE_OPEN, whence (0 set, 1 cur, 2 end) for FILE_SEEK
+const uint8_t FCB_BUFFER = 2;  // 2 bytes, data buffer, or NUL-terminated path for FILE_OPEN
+const uint8_t FCB_LENGTH = 4;  // 2 bytes, bytes to transfer
+const uint8_t FCB_COUNT = 6;   // 2 bytes, bytes actually transferred (out)
+const uint8_t FCB_OFFSET = 8;  // 4 bytes, signed seek offset (in), resulting position (out)
+const uint8_t FCB_SIZE = 12;
+enum class FileMode : uint8_t {
+    READ = 0,
+    WRITE = 1,      // Create or truncate
+    APPEND = 2,
+    READ_WRITE = 3  // Existing file
+};
+
+// Host files opened by a program, confined to a sandbox directory. Each file gets a large
+// host-side buffer so program reads and writes move whole blocks through the host.
+class FileSandbox {
 public:
-    uint8_t reg_A = 0;
-    uint8_t reg_B = 0;
-    uint16_t pc = 0;
-    uint16_t sp = 0;
-    bool privileged = false; // New: Privileged mode flag
+    static const int MAX_OPEN_FILES = 16;
+    static const size_t BUFFER_SIZE = 1 << 20;
 
-    vector<uint8_t> memory;
-    vector<uint8_t> stack;
+    struct OpenFile {
+        vector<char> buffer;
+        fstream stream;
+    };
 
-    // Constructor
-    CPU() {
-        memory.resize(65536, 0);
-        stack.resize(256, 0);
+    /**
+     * Name: setRoot
+     * Purpouse: Confine all file syscalls to a host directory.
+     * Inputs:
+     *   - directory: The host directory programs may access.
+     * Outputs: True if the directory exists and is now the sandbox root.
+     * Effects: Closes any files opened under the previous root.
+     */
+    bool setRoot(const string& directory) {
+        error_code ec;
+        filesystem::path canonical = filesystem::canonical(directory, ec);
+        if (ec || !filesystem::is_directory(canonical, ec)) {
+            return false;
+        }
+        closeAll();
+        root = canonical;
+        return true;
+    }
+
+    const filesystem::path& getRoot() const {
+        return root;
     }
 
     /**
-     * Name: loadProgram
-     * Purpouse: Load a program into memory at a specified start address.
+     * Name: resolve
+     * Purpouse: Map a program-supplied relative path to a host path inside the sandbox.
      * Inputs:
-     *   - program: A vector of bytes representing the program to load.
-     *  - startAddress: The memory address where the program should be loaded.
+     *   - relative: The path as the program spelled it.
+     * Outputs: The host path, or an empty path if it escapes the sandbox or none is set.
+     * Effects: None
+     */
+    filesystem::path resolve(const string& relative) const {
+        filesystem::path requested(relative);
+        if (root.empty() || relative.empty() || requested.is_absolute() || requested.has_root_name()) {
+            return {};
+        }
+        error_code ec;
+        filesystem::path resolved = filesystem::weakly_canonical(root / requested, ec);
+        if (ec) {
+            return {};
+        }
+        auto mismatch = std::mismatch(root.begin(), root.end(), resolved.begin(), resolved.end());
+        if (mismatch.first != root.end() || resolved == root) {
+            return {};
+        }
+        return resolved;
+    }
+
+    /**
+     * Name: open
+     * Purpouse: Open a sandboxed file and allocate a descriptor for it.
+     * Inputs:
+     *   - relative: The path relative to the sandbox root.
+     *   - mode: How to open the file.
+     * Outputs: The descriptor, or -1 on failure.
+     * Effects: Allocates the file's host-side buffer.
+     */
+    int open(const string& relative, FileMode mode) {
+        filesystem::path path = resolve(relative);
+        if (path.empty()) {
+            return -1;
+        }
+        int fd = 0;
+        while (fd < MAX_OPEN_FILES && files[fd]) {
+            fd++;
+        }
+        if (fd == MAX_OPEN_FILES) {
+            return -1;
+        }
+        ios::openmode flags = ios::binary;
+        switch (mode) {
+            case FileMode::READ: flags |= ios::in; break;
+            case FileMode::WRITE: flags |= ios::out | ios::trunc; break;
+            case FileMode::APPEND: flags |= ios::out | ios::app; break;
+            case FileMode::READ_WRITE: flags |= ios::in | ios::out; break;
+            default: return -1;
+        }
+        auto file = make_unique<OpenFile>();
+        file->buffer.resize(BUFFER_SIZE);
+        file->stream.rdbuf()->pubsetbuf(file->buffer.data(), file->buffer.size());
+        file->stream.open(path, flags);
+        if (!file->stream.is_open()) {
+            return -1;
+        }
+        files[fd] = move(file);
+        return fd;
+    }
+
+    fstream* get(uint8_t fd) {
+        return fd < MAX_OPEN_FILES && files[fd] ? &files[fd]->stream : nullptr;
+    }
+
+    bool close(uint8_t fd) {
+        if (!get(fd)) {
+            return false;
+        }
+        files[fd].reset();
+        return true;
+    }
+
+    void closeAll() {
+        for (auto& file : files) {
+            file.reset();
+        }
+    }
+
+private:
+    filesystem::path root;
+    array<unique_ptr<OpenFile>, MAX_OPEN_FILES> files;
+};
+
+// DMA controller. DMA_START takes the zero-page address of a DMA control block and copies
+// the data on the host side, optionally on a helper thread so the program keeps running.
+// The program must not touch the buffers until DMA_STATUS reports DMA_DONE or the
+// completion interrupt arrives.
+const uint8_t DMA_MODE = 0;    // 1 byte, DmaMode in the low bits plus DMA_FLAG_* bits
+const uint8_t DMA_FD = 1;      // 1 byte, sandbox file descriptor for file transfers
+const uint8_t DMA_SOURCE = 2;  // 2 bytes, source address (memory-to-memory and memory-to-file)
+const uint8_t DMA_DEST = 4;    // 2 bytes, destination address (memory-to-memory and file-to-memory)
+const uint8_t DMA_LENGTH = 6;  // 2 bytes, bytes to transfer
+const uint8_t DMA_BLOCK_SIZE = 8;
+const uint8_t DMA_FLAG_ASYNC = 0x80;     // Run the transfer on a helper thread
+const uint8_t DMA_FLAG_INTERRUPT = 0x40; // Raise IRQ_DMA on completion
+enum class DmaMode : uint8_t {
+    MEMORY_TO_MEMORY = 0,
+    FILE_TO_MEMORY = 1,
+    MEMORY_TO_FILE = 2
+};
+enum DmaStatus : uint8_t {
+    DMA_IDLE = 0,
+    DMA_BUSY = 1,
+    DMA_DONE = 2,
+    DMA_FAILED = 0xFF
+};
+
+struct DmaRequest {
+    DmaMode mode;
+    uint8_t flags;
+    uint8_t fd;
+    uint16_t source;
+    uint16_t dest;
+    uint16_t length;
+};
+
+// A DMA request with its memory resolved to host spans on the CPU thread. The helper thread
+// only copies through these pointers, so it never touches the page table, the bank store or
+// the dirty-page bits. The pages stay valid until the CPU waits for the transfer, which
+// everything that replaces pages (reset, restore, migration) does first.
+struct DmaTransfer {
+    DmaRequest request;
+    bool valid = false;
+    fstream* stream = nullptr;
+    vector<pair<const uint8_t*, uint32_t>> source;
+    vector<pair<uint8_t*, uint32_t>> dest;
+};
+
+// Host-side view of the framebuffer. Writes mark scanlines dirty; converting to RGB,
+// hashing and frame dumps only revisit dirty scanlines, so their cost follows what changed.
+class Framebuffer {
+public:
+    static_assert(FRAMEBUFFER_HEIGHT <= 64, "dirty scanlines are tracked in a 64-bit mask");
+
+    Framebuffer() {
+        lineHashes.fill(hashLine(nullptr));
+    }
+
+    /**
+     * Name: markDirty
+     * Purpouse: Record a write to framebuffer memory.
+     * Inputs:
+     *   - offset: The first byte written, relative to FRAMEBUFFER_ADDRESS.
+     *   - length: The number of bytes written (clipped to the framebuffer).
      * Outputs: None
-     * Effects: The program is copied into the CPU's memory starting at the specified address
-     *         and an error message is printed if the program exceeds memory bounds.
+     * Effects: Sets the dirty bit of every scanline touched. Safe to call from DMA threads.
      */
-    void loadProgram(const vector<uint8_t>& program, uint16_t startAddress) {
-        if (startAddress + program.size() > memory.size()) {
-            cerr << "Error: Program too large for memory at address 0x" << hex << startAddress << dec << endl;
+    void markDirty(uint32_t offset, uint32_t length) {
+        uint32_t end = min<uint32_t>(offset + length, FRAMEBUFFER_SIZE);
+        if (offset >= end) {
             return;
         }
-        copy(program.begin(), program.end(), memory.begin() + startAddress);
+        uint32_t first = offset / FRAMEBUFFER_WIDTH;
+        uint32_t last = (end - 1) / FRAMEBUFFER_WIDTH;
+        uint64_t lines = (last - first == 63) ? ~0ull : (((1ull << (last - first + 1)) - 1) << first);
+        dirty.fetch_or(lines, memory_order_relaxed);
     }
 
     /**
-     * Name: syscallHandler
-     * Purpouse: Handle system calls made by user programs.
-     * Inputs: None (uses CPU registers)
-     * Outputs: None (modifies CPU registers and may perform I/O)
-     * Effects: Executes the system call specified in reg_A, using reg_B as an argument or return value.
+     * Name: update
+     * Purpouse: Bring the RGB image and scanline hashes up to date with framebuffer memory.
+     * Inputs:
+     *   - pixels: The framebuffer contents in emulated memory.
+     * Outputs: True if any scanline changed since the last update.
+     * Effects: Converts and rehashes only the dirty scanlines, then clears their dirty bits.
      */
-    void syscallHandler() {
-        privileged = true;
-        SyscallNumber syscallNum = static_cast<SyscallNumber>(reg_A);
-        switch (syscallNum) {
-            case SyscallNumber::PRINT_CHAR: {
-                cout << static_cast<char>(reg_B) <<endl;
-                break;
-            }
-            case SyscallNumber::READ_CHAR: {
-                char inputChar;
-                cin >> inputChar;
-                reg_B = static_cast<uint8_t>(inputChar);
-                break;
+    bool update(const uint8_t* pixels) {
+        if (rgb.empty()) {
+            rgb.assign(FRAMEBUFFER_SIZE * 3, 0); // Allocated on first use so idle machines stay small
+        }
+        uint64_t lines = dirty.exchange(0, memory_order_acquire);
+        for (int y = 0; lines; y++, lines >>= 1) {
+            if (!(lines & 1)) {
+                continue;
             }
-            default: {
-                cerr << "Error: Unknown syscall number: " << (int)reg_A << endl;
-                break;
+            const uint8_t* row = pixels + y * FRAMEBUFFER_WIDTH;
+            uint8_t* out = &rgb[y * FRAMEBUFFER_WIDTH * 3];
+            for (int x = 0; x < FRAMEBUFFER_WIDTH; x++) {
+                out[3 * x] = static_cast<uint8_t>(((row[x] >> 5) & 7) * 255 / 7);
+                out[3 * x + 1] = static_cast<uint8_t>(((row[x] >> 2) & 7) * 255 / 7);
+                out[3 * x + 2] = static_cast<uint8_t>((row[x] & 3) * 255 / 3);
             }
+            uint64_t hash = hashLine(row);
+            changed |= hash != lineHashes[y];
+            lineHashes[y] = hash;
         }
-        privileged = false;
+        bool result = changed;
+        changed = false;
+        return result;
     }
 
     /**
-     * Name: step
-     * Purpouse: Execute a single instruction at the current program counter (pc).
-     * Inputs: None (uses CPU registers and memory)
-     * Outputs: Returns true if execution should continue, false if HALT is encountered or an error occurs.
-     * Effects: Modifies CPU registers and memory based on the executed instruction.
+     * Name: hash
+     * Purpouse: Fingerprint the current frame for golden tests.
+     * Inputs: None (call update() first)
+     * Outputs: A 64-bit FNV-1a hash over the cached scanline hashes.
+     * Effects: None
      */
-    bool step() {
-        if (pc >= memory.size()) {
-            cerr << "Error: Program Counter out of bounds. Halting." << endl;
-            return false;
+    uint64_t hash() const {
+        uint64_t result = 14695981039346656037ull;
+        for (uint64_t lineHash : lineHashes) {
+            result = (result ^ lineHash) * 1099511628211ull;
         }
-        
-        uint8_t instruction = memory[pc];
-        pc++;
-        cout << "[PC: 0x" << hex << (pc - 1) << "] ";
+        return result;
+    }
 
-        switch (instruction) {
-            case LOAD_A: {
-                uint8_t value = memory[pc++];
-                reg_A = value;
-                cout << "LOAD_A " << (int)value << endl;
-                break;
-            }
-            case LOAD_B: {
-                uint8_t value = memory[pc++];
-                reg_B = value;
-                cout << "LOAD_B " << (int)value << endl;
-                break;
-            }
-            case STORE_A: {
-                uint16_t address = memory[pc++];
-                memory[address] = reg_A;
-                cout << "STORE_A at 0x" << hex << address << dec << endl;
-                break;
-            }
-            case ADD_A_B: {
-                reg_A = reg_A + reg_B;
-                cout << "ADD_A_B -> A=" << (int)reg_A << endl;
-                break;
-            }
-            case SUB_A_B: {
-                reg_A = reg_A - reg_B;
-                cout << "SUB_A_B -> A=" << (int)reg_A << endl;
-                break;
-            }
-            case PUSH_B: {
-                if (sp < stack.size()) {
-                    stack[sp++] = reg_B;
-                    cout << "PUSH_B" << endl;
+    /**
+     * Name: writePpm
+     * Purpouse: Save the cached RGB image as a binary PPM file.
+     * Inputs: (call update() first)
+     *   - path: The output file.
+     * Outputs: True on success.
+     * Effects: Writes the file.
+     */
+    bool writePpm(const string& path) const {
+        ofstream out(path, ios::binary);
+        out << "P6\n" << FRAMEBUFFER_WIDTH << " " << FRAMEBUFFER_HEIGHT << "\n255\n";
+        out.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+        return out.good();
+    }
+
+    // Headless frame dumping at PRESENT_FRAME: frames are written as <prefix>_<n>.ppm.
+    string dumpPrefix;
+    uint64_t framesPresented = 0;
+    uint64_t framesWritten = 0;
+
+private:
+    static uint64_t hashLine(const uint8_t* row) {
+        uint64_t result = 14695981039346656037ull;
+        for (int x = 0; x < FRAMEBUFFER_WIDTH; x++) {
+            result = (result ^ (row ? row[x] : 0)) * 1099511628211ull;
+        }
+        return result;
+    }
+
+    atomic<uint64_t> dirty{0};
+    bool changed = false;
+    vector<uint8_t> rgb;
+    array<uint64_t, FRAMEBUFFER_HEIGHT> lineHashes;
+};
+
+// Virtual NIC rings. A program places its NIC rings in the zero page and passes the base
+// in reg_B to NET_TRANSMIT (send everything queued on the TX ring) and NET_RECEIVE (fill
+// free RX slots with packets that have arrived). Layout:
+//   +0 tx_head (kernel)   +1 tx_tail (user)   +2 rx_head (user)   +3 rx_tail (kernel)
+//   +4                                 TX descriptors {destination, length, buffer lo, hi}
+//   +4 + NET_RING_ENTRIES * descriptor RX descriptors {source, length, buffer lo, hi}
+// RX buffer addresses are supplied by the program; the kernel fills in source and length.
+// The destination/source is the peer machine's PID. IRQ_NET is raised when a packet is sent
+// to the machine and delivered once the packet's modeled latency has elapsed.
+const uint8_t NET_RING_ENTRIES = 4;
+const uint8_t NET_RING_HEADER_SIZE = 4;
+const uint8_t NET_DESCRIPTOR_SIZE = 4;
+const uint8_t NET_RING_SIZE = NET_RING_HEADER_SIZE + 2 * NET_RING_ENTRIES * NET_DESCRIPTOR_SIZE;
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov). Each cell carries a
+// sequence number that tells producers and consumers whose turn it is, so push and pop
+// only contend on a single compare-and-swap of the tail or head.
+template <typename T>
+class LockFreeQueue {
+public:
+    explicit LockFreeQueue(size_t capacity) : cells(capacity), mask(capacity - 1) {
+        for (size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    bool push(const T& value) {
+        size_t position = tail.load(memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    break;
                 }
-                break;
+            } else if (difference < 0) {
+                return false; // Full
+            } else {
+                position = tail.load(memory_order_relaxed);
             }
-            case POP_B: {
-                if (sp > 0) {
-                    reg_B = stack[--sp];
-                    cout << "POP_B" << endl;
+        }
+        cell->value = value;
+        cell->sequence.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value) {
+        size_t position = head.load(memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (difference == 0) {
+                if (head.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    break;
                 }
-                break;
-            }
-            case JMP: {
-                uint16_t address = memory[pc++];
-                pc = address;
-                cout << "JMP to 0x" << hex << address << dec << endl;
-                break;
-            }
-            case SYSCALL: {
-                cout << "SYSCALL" << endl;
-                syscallHandler();
-                break;
-            }
-            case HALT: {
-                cout << "HALT" << endl;
-                return false;
-            }
-            default: {
-                cerr << "Unknown instruction: 0x" << hex << (int)instruction << dec << endl;
-                return false;
+            } else if (difference < 0) {
+                return false; // Empty
+            } else {
+                position = head.load(memory_order_relaxed);
             }
         }
+        value = cell->value;
+        cell->sequence.store(position + mask + 1, memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+    vector<Cell> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0};
+    alignas(64) atomic<size_t> tail{0};
+};
+
+struct Packet {
+    uint8_t source;
+    uint8_t length;
+    int64_t deliverAt; // steady_clock nanoseconds
+    array<uint8_t, 255> payload;
+};
+
+// In-process network connecting emulated machines by PID. Every port has a lock-free
+// inbox that any sender may push to; only the owning machine pops it. Latency and
+// bandwidth are modeled by stamping each packet with its delivery time: a sender's link
+// is busy for length / bandwidth after each packet, and the packet lands latency later.
+class VirtualNetwork {
+public:
+    static const size_t INBOX_CAPACITY = 256;
+
+    VirtualNetwork(size_t portCount, uint64_t latencyMicroseconds, uint64_t bytesPerSecond)
+        : latencyNs(static_cast<int64_t>(latencyMicroseconds) * 1000), bandwidth(bytesPerSecond) {
+        for (size_t i = 0; i < portCount; i++) {
+            ports.push_back(make_unique<Port>());
+        }
+    }
+
+    static int64_t now() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    size_t portCount() const {
+        return ports.size();
+    }
+
+    /**
+     * Name: setArrivalCallback
+     * Purpouse: Register the function that notifies a port's machine of incoming packets.
+     * Inputs:
+     *   - port: The receiving port.
+     *   - callback: Called on the sender's thread after a packet is queued for the port.
+     * Outputs: None
+     * Effects: Replaces any previous callback. Call before machines start running.
+     */
+    void setArrivalCallback(uint8_t port, function<void()> callback) {
+        ports[port]->onArrival = move(callback);
+    }
+
+    /**
+     * Name: send
+     * Purpouse: Queue a packet from one port to another.
+     * Inputs:
+     *   - source: The sending port; must be called from that port's thread.
+     *   - dest: The receiving port.
+     *   - data: The payload.
+     *   - length: The payload length.
+     * Outputs: False if the destination does not exist or its inbox is full (packet dropped).
+     * Effects: Stamps the packet with its delivery time and notifies the receiver.
+     */
+    bool send(uint8_t source, uint8_t dest, const uint8_t* data, uint8_t length) {
+        if (dest >= ports.size() || source >= ports.size()) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        Port& sender = *ports[source];
+        int64_t start = max(now(), sender.linkFreeAt);
+        int64_t serialization = bandwidth ? static_cast<int64_t>(length * 1000000000ull / bandwidth) : 0;
+        sender.linkFreeAt = start + serialization;
+
+        Packet packet;
+        packet.source = source;
+        packet.length = length;
+        packet.deliverAt = start + serialization + latencyNs;
+        memcpy(packet.payload.data(), data, length);
+        Port& receiver = *ports[dest];
+        if (!receiver.inbox.push(packet)) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        sent.fetch_add(1, memory_order_relaxed);
+        if (receiver.onArrival) {
+            receiver.onArrival();
+        }
         return true;
     }
 
     /**
-     * Name: dumpState
-     * Purpouse: Print the current state of the CPU registers and flags.
-     * Inputs: None
-     * Outputs: None (prints to standard output)
-     * Effects: Displays the values of registers A, B, PC, SP, and privileged mode status.
+     * Name: receive
+     * Purpouse: Take the next packet that has reached a port.
+     * Inputs:
+     *   - port: The receiving port; must be called from that port's thread.
+     *   - packet: Receives the packet.
+     * Outputs: True if a packet whose delivery time has passed was returned.
+     * Effects: Moves queued packets into the port's private delivery-time heap.
      */
-    void dumpState() {
-        cout << "--- CPU State ---" << endl;
-        cout << "A: " << (int)reg_A << ", B: " << (int)reg_B << endl;
-        cout << "PC: 0x" << hex << pc << dec << ", SP: 0x" << hex << sp << dec << endl;
-        cout << "Privileged: " << (privileged ? "Yes" : "No") << endl;
-        cout << "-----------------" << endl;
+    bool receive(uint8_t port, Packet& packet) {
+        if (!hasDeliverable(port)) {
+            return false;
+        }
+        Port& receiver = *ports[port];
+        packet = receiver.inFlight.top();
+        receiver.inFlight.pop();
+        delivered.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * Name: hasDeliverable
+     * Purpouse: Check whether a packet has reached a port.
+     * Inputs:
+     *   - port: The receiving port; must be called from that port's thread.
+     * Outputs: True if a packet's delivery time has passed.
+     * Effects: Moves queued packets into the port's private delivery-time heap.
+     */
+    bool hasDeliverable(uint8_t port) {
+        Port& receiver = *ports[port];
+        Packet incoming;
+        while (receiver.inbox.pop(incoming)) {
+            receiver.inFlight.push(incoming);
+        }
+        return !receiver.inFlight.empty() && receiver.inFlight.top().deliverAt <= now();
     }
+
+    atomic<uint64_t> sent{0};
+    atomic<uint64_t> delivered{0};
+    atomic<uint64_t> dropped{0};
+
+private:
+    struct LaterDelivery {
+        bool operator()(const Packet& a, const Packet& b) const {
+            return a.deliverAt > b.deliverAt;
+        }
+    };
+
+    struct Port {
+        LockFreeQueue<Packet> inbox{INBOX_CAPACITY};
+        int64_t linkFreeAt = 0;                                             // Sender-owned
+        priority_queue<Packet, vector<Packet>, LaterDelivery> inFlight;     // Receiver-owned
+        function<void()> onArrival;
+    };
+
+    int64_t latencyNs;
+    uint64_t bandwidth;
+    vector<unique_ptr<Port>> ports;
 };
 
-// Simple assembler for the fictional CPU
-/**
- * Name: parseHexProgram
- * Purpouse: Convert a string of hex values into a vector of bytes.
- * Inputs:
- *   - hexString: A string containing hex values separated by spaces.
- * Outputs: A vector of uint8_t representing the bytecode.
- * Effects: Parses the input string and converts each hex value to a byte, printing errors for invalid values.
- */
-vector<uint8_t> parseHexProgram(const string& hexString) {
-    stringstream ss(hexString);
-    string hexByte;
-    vector<uint8_t> program;
-    while (ss >> hexByte) {
-        try {
-            int byteValue = stoi(hexByte, nullptr, 16);
-            if (byteValue >= 0 && byteValue <= 255) {
-                program.push_back(static_cast<uint8_t>(byteValue));
-            } else {
+// Paged memory. The 64KB address space is split into PAGE_SIZE pages reached through a
+// page table of host pointers. Every page starts out pointing at one shared, read-only
+// zero page and gets a private page of its own only when first written, so a new machine
+// costs a page table fill rather than a 64KB clear. The BANK_WINDOW_PAGES pages at
+// BANK_WINDOW_ADDRESS are a banked window: bank 0 is the ordinary memory behind the
+// window, and banks 1-255 live in a sparse store, allocated the same lazy way. Selecting a
+// bank just repoints the window's page table entries.
+// A page table entry may also be null ("not present"): such pages belong to a demand-paged
+// program image and are mapped in by faultIn() the first time they are touched.
+const uint32_t ADDRESS_SPACE_SIZE = 0x10000;
+const uint32_t PAGE_SHIFT = 12;
+const uint32_t PAGE_SIZE = 1u << PAGE_SHIFT;
+const uint32_t PAGE_MASK = PAGE_SIZE - 1;
+const uint32_t PAGE_COUNT = ADDRESS_SPACE_SIZE / PAGE_SIZE;
+const uint16_t BANK_WINDOW_ADDRESS = 0x4000;
+const uint32_t BANK_WINDOW_PAGES = 4;
+const uint32_t BANK_WINDOW_FIRST_PAGE = BANK_WINDOW_ADDRESS >> PAGE_SHIFT;
+const uint32_t BANK_COUNT = 256;
+// External backing storage: the address space followed by the window pages of banks 1-255.
+const size_t BACKING_SIZE = static_cast<size_t>(PAGE_COUNT + (BANK_COUNT - 1) * BANK_WINDOW_PAGES) * PAGE_SIZE;
+
+// A source of image pages for demand paging (see PagedMemory::mapImage).
+class PagedImage {
+public:
+    virtual ~PagedImage() = default;
+
+    size_t size() const {
+        return length;
+    }
+
+    /**
+     * Name: mappedPage
+     * Purpouse: Get the host mapping of an image page.
+     * Inputs:
+     *   - offset: The page-aligned offset into the image.
+     * Outputs: A private, writable pointer to the page, or nullptr if it is not mapped.
+     * Effects: None (the host faults the page in when it is touched)
+     */
+    virtual uint8_t* mappedPage(size_t offset) const = 0;
+
+    /**
+     * Name: readPage
+     * Purpouse: Copy one page of the image, zero-filling past its end.
+     * Inputs:
+     *   - offset: The page-aligned offset into the image.
+     *   - out: PAGE_SIZE bytes to fill.
+     * Outputs: None
+     * Effects: Reads the backing file.
+     */
+    virtual void readPage(size_t offset, uint8_t* out) = 0;
+
+protected:
+    size_t length = 0;
+};
+
+// A raw program image file used for demand paging. On POSIX hosts the file is mapped
+// privately, so the host MMU pages it in on first touch and copies a page on first write;
+// elsewhere pages are read from the file when they fault.
+class ProgramImage : public PagedImage {
+public:
+    /**
+     * Name: open
+     * Purpouse: Open an image file for demand paging.
+     * Inputs:
+     *   - path: The image file.
+     * Outputs: The image, or nullptr if the file cannot be opened or is empty.
+     * Effects: Maps the file on POSIX hosts.
+     */
+    static shared_ptr<ProgramImage> open(const string& path) {
+        auto image = shared_ptr<ProgramImage>(new ProgramImage());
+        image->file.open(path, ios::binary);
+        if (!image->file.is_open()) {
+            return nullptr;
+        }
+        image->file.seekg(0, ios::end);
+        image->length = static_cast<size_t>(image->file.tellg());
+        if (image->length == 0) {
+            return nullptr;
+        }
+#if !defined(_WIN32)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            void* mapped = mmap(nullptr, image->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (mapped != MAP_FAILED) {
+                image->mapping = static_cast<uint8_t*>(mapped);
+            }
+        }
+#endif
+        return image;
+    }
+
+    ~ProgramImage() {
+#if !defined(_WIN32)
+        if (mapping) {
+            munmap(mapping, length);
+        }
+#endif
+    }
+
+    uint8_t* mappedPage(size_t offset) const override {
+        return mapping ? mapping + offset : nullptr;
+    }
+
+    void readPage(size_t offset, uint8_t* out) override {
+        size_t available = min<size_t>(PAGE_SIZE, length - offset);
+        file.clear();
+        file.seekg(static_cast<streamoff>(offset));
+        file.read(reinterpret_cast<char*>(out), static_cast<streamsize>(available));
+        memset(out + available, 0, PAGE_SIZE - available);
+    }
+
+private:
+    ProgramImage() = default;
+
+    ifstream file;
+    uint8_t* mapping = nullptr;
+};
+
+// An image assembled from page-sized chunk files, such as the chunks of a content-addressed
+// store. Each chunk is mapped privately on its first fault, so pages are shared with the
+// store's files (and every machine using them) until written; a page without a chunk is
+// an anonymous zero mapping.
+class ChunkedImage : public PagedImage {
+public:
+    /**
+     * Name: ChunkedImage
+     * Purpouse: Describe an image by the files holding its pages.
+     * Inputs:
+     *   - chunkPaths: One file per page, in order; an empty path is an all-zero page.
+     *   - imageLength: The image length in bytes.
+     * Outputs: None
+     * Effects: Nothing is opened until a page faults.
+     */
+    ChunkedImage(vector<string> chunkPaths, size_t imageLength)
+        : paths(move(chunkPaths)), mappings(paths.size(), nullptr) {
+        length = imageLength;
+    }
+
+    ~ChunkedImage() {
+#if !defined(_WIN32)
+        for (uint8_t* mapping : mappings) {
+            if (mapping) {
+                munmap(mapping, PAGE_SIZE);
+            }
+        }
+#endif
+    }
+
+    uint8_t* mappedPage(size_t offset) const override {
+        size_t index = offset / PAGE_SIZE;
+#if !defined(_WIN32)
+        if (!mappings[index]) {
+            void* mapped = MAP_FAILED;
+            if (paths[index].empty()) {
+                mapped = mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            } else {
+                int fd = ::open(paths[index].c_str(), O_RDONLY);
+                if (fd >= 0) {
+                    mapped = mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                    ::close(fd);
+                }
+            }
+            mappings[index] = mapped != MAP_FAILED ? static_cast<uint8_t*>(mapped) : nullptr;
+        }
+#endif
+        return mappings[index];
+    }
+
+    void readPage(size_t offset, uint8_t* out) override {
+        memset(out, 0, PAGE_SIZE);
+        const string& path = paths[offset / PAGE_SIZE];
+        if (!path.empty()) {
+            ifstream chunk(path, ios::binary);
+            chunk.read(reinterpret_cast<char*>(out), PAGE_SIZE);
+        }
+    }
+
+private:
+    vector<string> paths;
+    mutable vector<uint8_t*> mappings; // Filled in as pages fault
+};
+
+/**
+ * Name: sha256
+ * Purpouse: Compute the SHA-256 digest of a buffer (FIPS 180-4).
+ * Inputs:
+ *   - data: The bytes to hash.
+ *   - length: Their count.
+ * Outputs: The 32-byte digest.
+ * Effects: None
+ */
+array<uint8_t, 32> sha256(const uint8_t* data, size_t length) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotate = [](uint32_t value, int bits) { return (value >> bits) | (value << (32 - bits)); };
+    auto compress = [&](const uint8_t* block) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    };
+    size_t whole = length / 64 * 64;
+    for (size_t offset = 0; offset < whole; offset += 64) {
+        compress(data + offset);
+    }
+    // Final block(s): the remaining bytes, 0x80, zero padding and the bit length.
+    uint8_t tail[128] = {};
+    size_t remaining = length - whole;
+    memcpy(tail, data + whole, remaining);
+    tail[remaining] = 0x80;
+    size_t tailLength = remaining < 56 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(length) * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tailLength - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+    }
+    for (size_t offset = 0; offset < tailLength; offset += 64) {
+        compress(tail + offset);
+    }
+    array<uint8_t, 32> digest;
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            digest[4 * i + j] = static_cast<uint8_t>(state[i] >> (24 - 8 * j));
+        }
+    }
+    return digest;
+}
+
+// Source of the 4KB pages that back emulated memory.
+class PageAllocator {
+public:
+    virtual ~PageAllocator() = default;
+    virtual uint8_t* allocatePage() = 0; // Returns a zero-filled page
+    virtual void releasePage(uint8_t* page) = 0;
+};
+
+// The default page source: the general-purpose heap.
+class HeapPageAllocator : public PageAllocator {
+public:
+    uint8_t* allocatePage() override {
+        return new uint8_t[PAGE_SIZE]();
+    }
+
+    void releasePage(uint8_t* page) override {
+        delete[] page;
+    }
+};
+
+PageAllocator& heapPageAllocator() {
+    static HeapPageAllocator allocator;
+    return allocator;
+}
+
+struct PageDeleter {
+    PageAllocator* allocator = nullptr;
+
+    void operator()(uint8_t* page) const {
+        allocator->releasePage(page);
+    }
+};
+
+using PagePtr = unique_ptr<uint8_t[], PageDeleter>;
+
+const size_t ARENA_CHUNK_SIZE = 2 * 1024 * 1024; // One x86-64 huge page
+
+// A region allocator for machine state. Memory is taken from the host in huge-page-sized
+// chunks, so many small machines share a few TLB entries, and is first touched by the
+// thread that allocates it, which places it on that thread's NUMA node. Pages released by
+// machines are kept on a free list; everything is returned to the host when the arena dies.
+class PageArena : public PageAllocator {
+public:
+    PageArena() = default;
+    PageArena(const PageArena&) = delete;
+    PageArena& operator=(const PageArena&) = delete;
+
+    ~PageArena() {
+        for (uint8_t* chunk : chunks) {
+#if !defined(_WIN32)
+            munmap(chunk, ARENA_CHUNK_SIZE);
+#else
+            ::operator delete(chunk, align_val_t(ARENA_CHUNK_SIZE));
+#endif
+        }
+    }
+
+    /**
+     * Name: allocate
+     * Purpouse: Carve a block out of the arena.
+     * Inputs:
+     *   - size: The number of bytes (at most ARENA_CHUNK_SIZE).
+     *   - alignment: A power of two no larger than PAGE_SIZE.
+     * Outputs: Uninitialized memory that lives as long as the arena.
+     * Effects: Maps a new chunk when the current one is full.
+     */
+    void* allocate(size_t size, size_t alignment) {
+        lock_guard<mutex> guard(lock);
+        size_t offset = (used + alignment - 1) & ~(alignment - 1);
+        if (chunks.empty() || offset + size > ARENA_CHUNK_SIZE) {
+            chunks.push_back(mapChunk());
+            offset = 0;
+        }
+        used = offset + size;
+        return chunks.back() + offset;
+    }
+
+    uint8_t* allocatePage() override {
+        {
+            lock_guard<mutex> guard(lock);
+            if (!freePages.empty()) {
+                uint8_t* page = freePages.back();
+                freePages.pop_back();
+                memset(page, 0, PAGE_SIZE);
+                return page;
+            }
+        }
+        uint8_t* page = static_cast<uint8_t*>(allocate(PAGE_SIZE, PAGE_SIZE));
+        memset(page, 0, PAGE_SIZE); // Also the first touch, which places the page on this thread's node
+        return page;
+    }
+
+    void releasePage(uint8_t* page) override {
+        lock_guard<mutex> guard(lock);
+        freePages.push_back(page);
+    }
+
+    size_t bytesReserved() const {
+        return chunks.size() * ARENA_CHUNK_SIZE;
+    }
+
+private:
+    /**
+     * Name: mapChunk
+     * Purpouse: Get one huge-page-aligned chunk from the host.
+     * Inputs: None
+     * Outputs: The chunk.
+     * Effects: On POSIX hosts the chunk is an anonymous mapping marked for transparent huge
+     *          pages where the host supports them; it is not touched here, so its frames are
+     *          placed by the first thread that writes to it.
+     */
+    static uint8_t* mapChunk() {
+#if !defined(_WIN32)
+        // Over-map and trim so the chunk starts on a huge page boundary.
+        size_t span = ARENA_CHUNK_SIZE * 2;
+        void* mapped = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            throw bad_alloc();
+        }
+        uintptr_t base = reinterpret_cast<uintptr_t>(mapped);
+        uintptr_t aligned = (base + ARENA_CHUNK_SIZE - 1) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1);
+        if (aligned > base) {
+            munmap(mapped, aligned - base);
+        }
+        if (aligned + ARENA_CHUNK_SIZE < base + span) {
+            munmap(reinterpret_cast<void*>(aligned + ARENA_CHUNK_SIZE), base + span - aligned - ARENA_CHUNK_SIZE);
+        }
+#if defined(MADV_HUGEPAGE)
+        madvise(reinterpret_cast<void*>(aligned), ARENA_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+        return reinterpret_cast<uint8_t*>(aligned);
+#else
+        return static_cast<uint8_t*>(::operator new(ARENA_CHUNK_SIZE, align_val_t(ARENA_CHUNK_SIZE)));
+#endif
+    }
+
+    mutex lock; // Pages may also be allocated by a machine's DMA thread
+    vector<uint8_t*> chunks;
+    size_t used = 0;
+    vector<uint8_t*> freePages;
+};
+
+static_assert(FRAMEBUFFER_ADDRESS % PAGE_SIZE == 0 && FRAMEBUFFER_SIZE <= PAGE_SIZE,
+              "the framebuffer is read through a single page pointer");
+
+class PagedMemory {
+public:
+    PagedMemory() {
+        pages.fill(zeroPage());
+        baselinePages.fill(zeroPage());
+    }
+
+    PagedMemory(const PagedMemory&) = delete;
+    PagedMemory& operator=(const PagedMemory&) = delete;
+
+    uint8_t operator[](uint16_t address) const {
+        return presentPage(address >> PAGE_SHIFT)[address & PAGE_MASK];
+    }
+
+    void write(uint16_t address, uint8_t value) {
+        writablePage(address >> PAGE_SHIFT)[address & PAGE_MASK] = value;
+    }
+
+    size_t size() const {
+        return ADDRESS_SPACE_SIZE;
+    }
+
+    /**
+     * Name: page
+     * Purpouse: Get direct read access to the page holding an address.
+     * Inputs:
+     *   - address: Any address in the page.
+     * Outputs: A pointer to the start of the page; valid until the next bank switch.
+     * Effects: None
+     */
+    const uint8_t* page(uint16_t address) const {
+        return presentPage(address >> PAGE_SHIFT);
+    }
+
+    /**
+     * Name: forEachSpan
+     * Purpouse: Visit a range of memory as host spans that never cross a page boundary.
+     * Inputs:
+     *   - address: The first address (the range must lie within the address space).
+     *   - length: The number of bytes.
+     *   - visit: Called as visit(const uint8_t* data, uint32_t length); return false to stop.
+     * Outputs: None
+     * Effects: None
+     */
+    template <typename Visitor>
+    void forEachSpan(uint32_t address, uint32_t length, Visitor visit) const {
+        while (length > 0) {
+            uint32_t chunk = min(length, PAGE_SIZE - (address & PAGE_MASK));
+            if (!visit(presentPage(address >> PAGE_SHIFT) + (address & PAGE_MASK), chunk)) {
+                return;
+            }
+            address += chunk;
+            length -= chunk;
+        }
+    }
+
+    /**
+     * Name: forEachWritableSpan
+     * Purpouse: Visit a range of memory as writable host spans, for bulk copies into memory.
+     * Inputs:
+     *   - address: The first address (the range must lie within the address space).
+     *   - length: The number of bytes.
+     *   - visit: Called as visit(uint8_t* data, uint32_t length); return false to stop.
+     * Outputs: None
+     * Effects: Allocates any page of the range that is still backed by the zero page.
+     */
+    template <typename Visitor>
+    void forEachWritableSpan(uint32_t address, uint32_t length, Visitor visit) {
+        while (length > 0) {
+            uint32_t chunk = min(length, PAGE_SIZE - (address & PAGE_MASK));
+            if (!visit(writablePage(address >> PAGE_SHIFT) + (address & PAGE_MASK), chunk)) {
+                return;
+            }
+            address += chunk;
+            length -= chunk;
+        }
+    }
+
+    void read(uint32_t address, uint8_t* out, uint32_t length) const {
+        forEachSpan(address, length, [&](const uint8_t* data, uint32_t chunk) {
+            memcpy(out, data, chunk);
+            out += chunk;
+            return true;
+        });
+    }
+
+    void write(uint32_t address, const uint8_t* in, uint32_t length) {
+        forEachWritableSpan(address, length, [&](uint8_t* data, uint32_t chunk) {
+            memcpy(data, in, chunk);
+            in += chunk;
+            return true;
+        });
+    }
+
+    /**
+     * Name: selectBank
+     * Purpouse: Switch the bank visible through the banked window.
+     * Inputs:
+     *   - bank: The bank number (0 is the memory behind the window).
+     * Outputs: The previously selected bank.
+     * Effects: Repoints BANK_WINDOW_PAGES page table entries; no data is copied.
+     */
+    uint8_t selectBank(uint8_t bank) {
+        uint8_t previous = currentBank;
+        if (bank == previous) {
+            return previous;
+        }
+        if (previous == 0) {
+            copy(pages.begin() + BANK_WINDOW_FIRST_PAGE, pages.begin() + BANK_WINDOW_FIRST_PAGE + BANK_WINDOW_PAGES, bankZeroWindow.begin());
+        }
+        currentBank = bank;
+        if (backing && bank != 0) {
+            backingBanks[bank / 8] |= static_cast<uint8_t>(1u << (bank % 8));
+        }
+        for (uint32_t i = 0; i < BANK_WINDOW_PAGES; i++) {
+            uint32_t index = BANK_WINDOW_FIRST_PAGE + i;
+            if (bank == 0) {
+                pages[index] = bankZeroWindow[i];
+            } else if (backing) {
+                pages[index] = backingBankPage(bank, i);
+            } else {
+                auto stored = bankStore.find(bankKey(bank, i));
+                pages[index] = stored != bankStore.end() ? stored->second.get() : zeroPage();
+            }
+        }
+        return previous;
+    }
+
+    uint8_t bank() const {
+        return currentBank;
+    }
+
+    size_t bankPagesAllocated() const {
+        return bankStore.size();
+    }
+
+    /**
+     * Name: mapImage
+     * Purpouse: Demand-page a program image into the address space.
+     * Inputs:
+     *   - newImage: The image to map.
+     *   - startAddress: The page-aligned address of the image's first byte.
+     * Outputs: False if the start is not page-aligned or the image does not fit.
+     * Effects: Marks the covered pages not present so they fault in from the image on first
+     *          access. Pages of a previously mapped image are copied back into ordinary memory.
+     */
+    bool mapImage(shared_ptr<PagedImage> newImage, uint16_t startAddress) {
+        if (startAddress % PAGE_SIZE != 0 || startAddress + newImage->size() > ADDRESS_SPACE_SIZE) {
+            return false;
+        }
+        selectBank(0);
+        releaseImage();
+        forgetBaseline();
+        if (backing) {
+            // Backed memory must hold its own contents, so the image is read in eagerly.
+            for (size_t offset = 0; offset < newImage->size(); offset += PAGE_SIZE) {
+                newImage->readPage(offset, pages[(startAddress + offset) >> PAGE_SHIFT]);
+            }
+            return true;
+        }
+        image = move(newImage);
+        imageFirstPage = startAddress >> PAGE_SHIFT;
+        imagePageCount = static_cast<uint32_t>((image->size() + PAGE_SIZE - 1) / PAGE_SIZE);
+        imagePagesFaulted = 0;
+        for (uint32_t i = imageFirstPage; i < imageFirstPage + imagePageCount; i++) {
+            pages[i] = nullptr;
+        }
+        return true;
+    }
+
+    uint32_t imagePages() const {
+        return imagePageCount;
+    }
+
+    uint32_t imagePagesResident() const {
+        return imagePagesFaulted;
+    }
+
+    /**
+     * Name: pagesAllocated
+     * Purpouse: Report how many private pages back this address space and its banks.
+     * Inputs: None
+     * Outputs: The number of pages that have been written (or faulted in from a file).
+     * Effects: None
+     */
+    size_t pagesAllocated() const {
+        size_t count = bankStore.size();
+        for (const auto& page : owned) {
+            count += page != nullptr;
+        }
+        return count;
+    }
+
+    /**
+     * Name: clear
+     * Purpouse: Return memory to its all-zero power-on state.
+     * Inputs: None
+     * Outputs: None
+     * Effects: Only pages that were actually written are touched: they are unmapped and kept
+     *          for reuse, and the page table points back at the zero page. Any image and
+     *          bank selection are dropped.
+     */
+    void clear() {
+        forgetBaseline();
+        image.reset();
+        imagePageCount = 0;
+        if (backing) {
+            selectBank(0);
+            memset(backing, 0, static_cast<size_t>(PAGE_COUNT) * PAGE_SIZE);
+            for (uint32_t bank = 1; bank < BANK_COUNT; bank++) {
+                if (backingBankUsed(bank)) {
+                    memset(backingBankPage(bank, 0), 0, BANK_WINDOW_PAGES * PAGE_SIZE);
+                }
+            }
+            memset(backingBanks, 0, BANK_COUNT / 8);
+            return;
+        }
+        currentBank = 0;
+        pages.fill(zeroPage());
+        for (auto& page : owned) {
+            if (page) {
+                sparePages.push_back(move(page));
+            }
+        }
+        for (auto& entry : bankStore) {
+            sparePages.push_back(move(entry.second));
+        }
+        bankStore.clear();
+    }
+
+    /**
+     * Name: markBaseline
+     * Purpouse: Record the current contents as the state restoreBaseline() returns to.
+     * Inputs: None
+     * Outputs: None
+     * Effects: Copies every written page and bank page, and clears the dirty-page record.
+     *          Image pages that have not faulted in are not copied; they are read again from
+     *          the image on restore.
+     */
+    void markBaseline() {
+        uint8_t bank = selectBank(0);
+        forgetBaseline();
+        for (uint32_t i = 0; i < PAGE_COUNT; i++) {
+            baselinePages[i] = pages[i];
+            if (pages[i] && pages[i] != zeroPage()) {
+                baselineCopies[i] = allocatePage();
+                memcpy(baselineCopies[i].get(), pages[i], PAGE_SIZE);
+            }
+        }
+        for (const auto& entry : bankStore) {
+            PagePtr copy = allocatePage();
+            memcpy(copy.get(), entry.second.get(), PAGE_SIZE);
+            bankBaseline.emplace(entry.first, move(copy));
+        }
+        for (uint32_t usedBank = 1; backing && usedBank < BANK_COUNT; usedBank++) {
+            for (uint32_t windowPage = 0; backingBankUsed(usedBank) && windowPage < BANK_WINDOW_PAGES; windowPage++) {
+                PagePtr copy = allocatePage();
+                memcpy(copy.get(), backingBankPage(usedBank, windowPage), PAGE_SIZE);
+                bankBaseline.emplace(bankKey(static_cast<uint8_t>(usedBank), windowPage), move(copy));
+            }
+        }
+        baselineBank = bank;
+        dirtyPages = 0;
+        dirtyBanks.reset();
+        selectBank(bank);
+    }
+
+    /**
+     * Name: restoreBaseline
+     * Purpouse: Return memory to the state recorded by the last markBaseline().
+     * Inputs: None
+     * Outputs: The number of pages that had to be restored.
+     * Effects: Only pages written since the baseline are touched. Pages that were zero are
+     *          handed back for reuse; without a baseline this is the all-zero state.
+     */
+    uint32_t restoreBaseline() {
+        selectBank(0);
+        uint32_t restored = 0;
+        for (uint32_t i = 0; i < PAGE_COUNT; i++) {
+            if (!(dirtyPages & (1u << i))) {
+                continue;
+            }
+            restored++;
+            if (baselineCopies[i]) {
+                memcpy(pages[i], baselineCopies[i].get(), PAGE_SIZE);
+            } else if (baselinePages[i] == nullptr) {
+                image->readPage(static_cast<size_t>(i - imageFirstPage) * PAGE_SIZE, pages[i]);
+            } else if (backing) {
+                memset(pages[i], 0, PAGE_SIZE);
+            } else {
+                if (owned[i]) {
+                    sparePages.push_back(move(owned[i]));
+                }
+                pages[i] = zeroPage();
+            }
+        }
+        for (uint32_t bank = 1; bank < dirtyBanks.size(); bank++) {
+            if (!dirtyBanks.test(bank)) {
+                continue;
+            }
+            for (uint32_t windowPage = 0; windowPage < BANK_WINDOW_PAGES; windowPage++) {
+                uint32_t key = bankKey(static_cast<uint8_t>(bank), windowPage);
+                auto stored = bankStore.find(key);
+                auto saved = bankBaseline.find(key);
+                if (backing) {
+                    uint8_t* page = backingBankPage(bank, windowPage);
+                    if (saved != bankBaseline.end()) {
+                        memcpy(page, saved->second.get(), PAGE_SIZE);
+                    } else {
+                        memset(page, 0, PAGE_SIZE);
+                    }
+                    restored++;
+                } else if (saved != bankBaseline.end()) {
+                    if (stored == bankStore.end()) {
+                        stored = bankStore.emplace(key, allocatePage()).first;
+                    }
+                    memcpy(stored->second.get(), saved->second.get(), PAGE_SIZE);
+                    restored++;
+                } else if (stored != bankStore.end()) {
+                    sparePages.push_back(move(stored->second));
+                    bankStore.erase(stored);
+                    restored++;
+                }
+            }
+        }
+        dirtyPages = 0;
+        dirtyBanks.reset();
+        selectBank(baselineBank);
+        return restored;
+    }
+
+    /**
+     * Name: attachBacking
+     * Purpouse: Move the address space and every bank into external storage, such as a
+     *           shared file mapping.
+     * Inputs:
+     *   - storage: BACKING_SIZE bytes laid out as the address space followed by the window
+     *              pages of banks 1-255.
+     *   - usedBanks: A BANK_COUNT-bit set, kept alongside the storage, of banks that have
+     *                been selected and so may hold data.
+     *   - adopt: True to take the storage's contents as memory (resuming); false to copy
+     *            the current contents into it.
+     * Outputs: None
+     * Effects: From then on all memory lives in the storage and no private pages are used.
+     *          Any image is dropped and the current contents become the reset baseline.
+     */
+    void attachBacking(uint8_t* storage, uint8_t* usedBanks, bool adopt) {
+        uint8_t bank = selectBank(0);
+        if (!adopt) {
+            for (uint32_t i = 0; i < PAGE_COUNT; i++) {
+                const uint8_t* page = presentPage(i);
+                if (page != zeroPage()) {
+                    memcpy(storage + static_cast<size_t>(i) * PAGE_SIZE, page, PAGE_SIZE);
+                }
+            }
+            for (const auto& entry : bankStore) {
+                uint32_t stored = entry.first / BANK_WINDOW_PAGES;
+                usedBanks[stored / 8] |= static_cast<uint8_t>(1u << (stored % 8));
+                memcpy(storage + backingBankOffset(stored, entry.first % BANK_WINDOW_PAGES), entry.second.get(), PAGE_SIZE);
+            }
+        }
+        forgetBaseline();
+        image.reset();
+        imagePageCount = 0;
+        clear();
+        backing = storage;
+        backingBanks = usedBanks;
+        for (uint32_t i = 0; i < PAGE_COUNT; i++) {
+            pages[i] = backing + static_cast<size_t>(i) * PAGE_SIZE;
+        }
+        selectBank(bank);
+        markBaseline();
+    }
+
+    /**
+     * Name: detachBacking
+     * Purpouse: Copy memory out of external storage back into private pages.
+     * Inputs: None
+     * Outputs: None
+     * Effects: The storage is no longer referenced afterwards and may be unmapped.
+     */
+    void detachBacking() {
+        if (!backing) {
+            return;
+        }
+        uint8_t bank = selectBank(0);
+        forgetBaseline();
+        for (uint32_t i = 0; i < PAGE_COUNT; i++) {
+            memcpy(ownPage(i), pages[i], PAGE_SIZE);
+            pages[i] = owned[i].get();
+        }
+        for (uint32_t usedBank = 1; usedBank < BANK_COUNT; usedBank++) {
+            for (uint32_t windowPage = 0; backingBankUsed(usedBank) && windowPage < BANK_WINDOW_PAGES; windowPage++) {
+                PagePtr copy = allocatePage();
+                memcpy(copy.get(), backingBankPage(usedBank, windowPage), PAGE_SIZE);
+                bankStore[bankKey(static_cast<uint8_t>(usedBank), windowPage)] = move(copy);
+            }
+        }
+        backing = nullptr;
+        backingBanks = nullptr;
+        selectBank(bank);
+        markBaseline();
+    }
+
+    bool isBacked() const {
+        return backing != nullptr;
+    }
+
+    /**
+     * Name: setPageAllocator
+     * Purpouse: Choose where new pages come from.
+     * Inputs:
+     *   - allocator: The page source; it must outlive this memory.
+     * Outputs: None
+     * Effects: Only affects later allocations; existing pages go back to their own allocator.
+     */
+    void setPageAllocator(PageAllocator* allocator) {
+        pageAllocator = allocator;
+    }
+
+    /**
+     * Name: dirtyPageCount
+     * Purpouse: Report how many pages have been written since the baseline.
+     * Inputs: None
+     * Outputs: Dirty address space pages plus dirty banks.
+     * Effects: None
+     */
+    uint32_t dirtyPageCount() const {
+        return static_cast<uint32_t>(bitset<PAGE_COUNT>(dirtyPages).count() + dirtyBanks.count());
+    }
+
+    /**
+     * Name: forEachCopyPage
+     * Purpouse: Visit the pages a copy of this memory needs, for snapshots and migration.
+     * Inputs:
+     *   - all: True for every page holding data; false for only the pages written since the
+     *          previous call.
+     *   - visit: Called as visit(uint8_t bank, uint32_t page, const uint8_t* data), where
+     *            page is the page number in the address space. Bank 0 covers the whole
+     *            address space; other banks only the window pages.
+     * Outputs: None
+     * Effects: Clears the copy-dirty record. Image pages are faulted in when all is set.
+     */
+    template <typename Visitor>
+    void forEachCopyPage(bool all, Visitor visit) {
+        uint8_t bank = selectBank(0);
+        for (uint32_t i = 0; i < PAGE_COUNT; i++) {
+            if (all ? presentPage(i) != zeroPage() : (copyDirtyPages & (1u << i)) != 0) {
+                visit(static_cast<uint8_t>(0), i, presentPage(i));
+            }
+        }
+        for (uint32_t copied = 1; copied < BANK_COUNT; copied++) {
+            for (uint32_t windowPage = 0; windowPage < BANK_WINDOW_PAGES; windowPage++) {
+                if (!all && !copyDirtyBankPages.test(bankKey(static_cast<uint8_t>(copied), windowPage))) {
+                    continue;
+                }
+                const uint8_t* page = nullptr;
+                if (backing) {
+                    page = backingBankUsed(copied) ? backingBankPage(copied, windowPage) : nullptr;
+                } else {
+                    auto stored = bankStore.find(bankKey(static_cast<uint8_t>(copied), windowPage));
+                    page = stored != bankStore.end() ? stored->second.get() : nullptr;
+                }
+                if (page) {
+                    visit(static_cast<uint8_t>(copied), BANK_WINDOW_FIRST_PAGE + windowPage, page);
+                }
+            }
+        }
+        copyDirtyPages = 0;
+        copyDirtyBankPages.reset();
+        selectBank(bank);
+    }
+
+    /**
+     * Name: copyDirtyCount
+     * Purpouse: Report how many pages forEachCopyPage(false, ...) would visit.
+     * Inputs: None
+     * Outputs: Dirty address space pages plus dirty bank pages.
+     * Effects: None
+     */
+    uint32_t copyDirtyCount() const {
+        return static_cast<uint32_t>(bitset<PAGE_COUNT>(copyDirtyPages).count() + copyDirtyBankPages.count());
+    }
+
+    /**
+     * Name: forEachSnapshotPage
+     * Purpouse: Visit every page that holds data now or in the reset baseline.
+     * Inputs:
+     *   - visit: Called as visit(uint8_t bank, uint32_t page, const uint8_t* current,
+     *            const uint8_t* base), with nullptr standing for an all-zero page. Page numbers
+     *            are as in forEachCopyPage().
+     * Outputs: None
+     * Effects: Faults in image pages.
+     */
+    template <typename Visitor>
+    void forEachSnapshotPage(Visitor visit) {
+        uint8_t bank = selectBank(0);
+        vector<uint8_t> scratch(PAGE_SIZE);
+        for (uint32_t i = 0; i < PAGE_COUNT; i++) {
+            const uint8_t* current = presentPage(i);
+            const uint8_t* base = baselineContent(0, i, scratch.data());
+            current = current != zeroPage() ? current : nullptr;
+            if (current || base) {
+                visit(static_cast<uint8_t>(0), i, current, base);
+            }
+        }
+        for (uint32_t visited = 1; visited < BANK_COUNT; visited++) {
+            for (uint32_t windowPage = 0; windowPage < BANK_WINDOW_PAGES; windowPage++) {
+                uint32_t key = bankKey(static_cast<uint8_t>(visited), windowPage);
+                const uint8_t* current = nullptr;
+                if (backing) {
+                    current = backingBankUsed(visited) ? backingBankPage(visited, windowPage) : nullptr;
+                } else {
+                    auto stored = bankStore.find(key);
+                    current = stored != bankStore.end() ? stored->second.get() : nullptr;
+                }
+                const uint8_t* base = baselineContent(static_cast<uint8_t>(visited), BANK_WINDOW_FIRST_PAGE + windowPage, scratch.data());
+                if (current || base) {
+                    visit(static_cast<uint8_t>(visited), BANK_WINDOW_FIRST_PAGE + windowPage, current, base);
+                }
+            }
+        }
+        selectBank(bank);
+    }
+
+    /**
+     * Name: baselineContent
+     * Purpouse: Get the reset-baseline contents of a page.
+     * Inputs:
+     *   - bank: The bank (only meaningful for window pages).
+     *   - page: The page number in the address space.
+     *   - scratch: PAGE_SIZE bytes, used when the page has to be read from the image.
+     * Outputs: The contents, or nullptr if the page was all zero.
+     * Effects: May read the image file.
+     */
+    const uint8_t* baselineContent(uint8_t bank, uint32_t page, uint8_t* scratch) const {
+        bool window = page >= BANK_WINDOW_FIRST_PAGE && page < BANK_WINDOW_FIRST_PAGE + BANK_WINDOW_PAGES;
+        if (window && bank != 0) {
+            auto saved = bankBaseline.find(bankKey(bank, page - BANK_WINDOW_FIRST_PAGE));
+            return saved != bankBaseline.end() ? saved->second.get() : nullptr;
+        }
+        if (baselineCopies[page]) {
+            return baselineCopies[page].get();
+        }
+        if (baselinePages[page] == nullptr) {
+            image->readPage(static_cast<size_t>(page - imageFirstPage) * PAGE_SIZE, scratch);
+            return scratch;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Name: baselineHash
+     * Purpouse: Identify the reset baseline, so deltas against it are only applied to it.
+     * Inputs: None
+     * Outputs: The sum of 64-bit FNV-1a hashes of the baseline's non-zero pages and their
+     *          positions (a sum, so bank store order does not matter).
+     * Effects: May read the image file.
+     */
+    uint64_t baselineHash() const {
+        uint64_t result = 0;
+        vector<uint8_t> scratch(PAGE_SIZE);
+        auto mix = [&](uint32_t key, const uint8_t* page) {
+            if (!page) {
+                return;
+            }
+            uint64_t pageHash = (14695981039346656037ull ^ key) * 1099511628211ull;
+            for (uint32_t offset = 0; offset < PAGE_SIZE; offset += 8) {
+                uint64_t word;
+                memcpy(&word, page + offset, sizeof(word));
+                pageHash = (pageHash ^ word) * 1099511628211ull;
+            }
+            result += pageHash;
+        };
+        for (uint32_t i = 0; i < PAGE_COUNT; i++) {
+            mix(i, baselineContent(0, i, scratch.data()));
+        }
+        for (const auto& entry : bankBaseline) {
+            mix(PAGE_COUNT + entry.first, entry.second.get());
+        }
+        return result;
+    }
+
+    /**
+     * Name: installPage
+     * Purpouse: Overwrite one page with copied contents.
+     * Inputs:
+     *   - bank: The bank the page belongs to (only meaningful for window pages).
+     *   - page: The page number in the address space.
+     *   - data: PAGE_SIZE bytes.
+     * Outputs: None
+     * Effects: Allocates the page if needed; the selected bank is unchanged.
+     */
+    void installPage(uint8_t bank, uint32_t page, const uint8_t* data) {
+        bool window = page >= BANK_WINDOW_FIRST_PAGE && page < BANK_WINDOW_FIRST_PAGE + BANK_WINDOW_PAGES;
+        uint8_t previous = selectBank(window ? bank : currentBank);
+        write(page * PAGE_SIZE, data, PAGE_SIZE);
+        selectBank(previous);
+    }
+
+private:
+    uint8_t* presentPage(uint32_t index) const {
+        uint8_t* page = pages[index];
+        return page ? page : faultIn(index);
+    }
+
+    /**
+     * Name: faultIn
+     * Purpouse: Service a fault on a not-present image page.
+     * Inputs:
+     *   - index: The page number.
+     * Outputs: The now-present page.
+     * Effects: Points the page at the image mapping, or reads the page from the image file
+     *          into ordinary memory when the image is not mapped.
+     */
+    uint8_t* faultIn(uint32_t index) const {
+        size_t offset = static_cast<size_t>(index - imageFirstPage) * PAGE_SIZE;
+        uint8_t* page = image->mappedPage(offset);
+        if (!page) {
+            page = ownPage(index);
+            image->readPage(offset, page);
+        }
+        pages[index] = page;
+        imagePagesFaulted++;
+        return page;
+    }
+
+    /**
+     * Name: releaseImage
+     * Purpouse: Detach the current image so it can be unmapped.
+     * Inputs: None
+     * Outputs: None
+     * Effects: Copies resident image pages into ordinary memory and reads in any that never
+     *          faulted, so memory contents are unchanged.
+     */
+    void releaseImage() {
+        if (!image) {
+            return;
+        }
+        for (uint32_t i = imageFirstPage; i < imageFirstPage + imagePageCount; i++) {
+            uint8_t* page = presentPage(i);
+            if (page != owned[i].get()) {
+                memcpy(ownPage(i), page, PAGE_SIZE);
+            }
+            pages[i] = owned[i].get();
+        }
+        image.reset();
+        imagePageCount = 0;
+    }
+
+    /**
+     * Name: ownPage
+     * Purpouse: Give a page of the address space private, zero-filled backing.
+     * Inputs:
+     *   - index: The page number.
+     * Outputs: The private page (not yet installed in the page table).
+     * Effects: Reuses a page released by clear() when one is available.
+     */
+    uint8_t* ownPage(uint32_t index) const {
+        if (!owned[index]) {
+            owned[index] = allocatePage();
+        }
+        return owned[index].get();
+    }
+
+    PagePtr allocatePage() const {
+        if (sparePages.empty()) {
+            return PagePtr(pageAllocator->allocatePage(), PageDeleter{pageAllocator});
+        }
+        PagePtr page = move(sparePages.back());
+        sparePages.pop_back();
+        memset(page.get(), 0, PAGE_SIZE);
+        return page;
+    }
+
+    static uint8_t* zeroPage() {
+        alignas(64) static uint8_t zeros[PAGE_SIZE] = {};
+        return zeros;
+    }
+
+    static size_t backingBankOffset(uint32_t bank, uint32_t windowPage) {
+        return static_cast<size_t>(PAGE_COUNT + (bank - 1) * BANK_WINDOW_PAGES + windowPage) * PAGE_SIZE;
+    }
+
+    uint8_t* backingBankPage(uint32_t bank, uint32_t windowPage) const {
+        return backing + backingBankOffset(bank, windowPage);
+    }
+
+    bool backingBankUsed(uint32_t bank) const {
+        return backingBanks[bank / 8] & (1u << (bank % 8));
+    }
+
+    void forgetBaseline() {
+        for (auto& copy : baselineCopies) {
+            if (copy) {
+                sparePages.push_back(move(copy));
+            }
+        }
+        for (auto& entry : bankBaseline) {
+            sparePages.push_back(move(entry.second));
+        }
+        bankBaseline.clear();
+        baselinePages.fill(zeroPage());
+        baselineBank = 0;
+        dirtyPages = 0;
+        dirtyBanks.reset();
+    }
+
+    static uint32_t bankKey(uint8_t bank, uint32_t windowPage) {
+        return static_cast<uint32_t>(bank) * BANK_WINDOW_PAGES + windowPage;
+    }
+
+    uint8_t* writablePage(uint32_t index) {
+        bool banked = currentBank != 0 && index >= BANK_WINDOW_FIRST_PAGE && index < BANK_WINDOW_FIRST_PAGE + BANK_WINDOW_PAGES;
+        if (banked) {
+            dirtyBanks.set(currentBank);
+            copyDirtyBankPages.set(bankKey(currentBank, index - BANK_WINDOW_FIRST_PAGE));
+        } else {
+            dirtyPages |= 1u << index;
+            copyDirtyPages |= 1u << index;
+        }
+        uint8_t* page = presentPage(index);
+        if (page != zeroPage()) {
+            return page;
+        }
+        if (banked) {
+            auto& stored = bankStore[bankKey(currentBank, index - BANK_WINDOW_FIRST_PAGE)];
+            stored = allocatePage();
+            pages[index] = stored.get();
+        } else {
+            pages[index] = ownPage(index);
+        }
+        return pages[index];
+    }
+
+    // Faulting pages in does not change what memory holds, so the page table may be
+    // updated from const readers.
+    mutable array<uint8_t*, PAGE_COUNT> pages;
+    mutable array<PagePtr, PAGE_COUNT> owned; // Private pages of the address space
+    mutable vector<PagePtr> sparePages;       // Released by clear(), kept for reuse
+    PageAllocator* pageAllocator = &heapPageAllocator();
+    array<uint8_t*, BANK_WINDOW_PAGES> bankZeroWindow;
+    unordered_map<uint32_t, PagePtr> bankStore;
+    uint8_t currentBank = 0;
+    shared_ptr<PagedImage> image;
+    uint32_t imageFirstPage = 0;
+    uint32_t imagePageCount = 0;
+    mutable uint32_t imagePagesFaulted = 0;
+    // Dirty-page tracking against the state recorded by markBaseline(), and separately since
+    // the last forEachCopyPage()
+    uint32_t dirtyPages = 0;
+    bitset<BANK_COUNT> dirtyBanks;
+    uint32_t copyDirtyPages = 0;
+    bitset<BANK_COUNT * BANK_WINDOW_PAGES> copyDirtyBankPages;
+    array<uint8_t*, PAGE_COUNT> baselinePages;
+    array<PagePtr, PAGE_COUNT> baselineCopies;
+    unordered_map<uint32_t, PagePtr> bankBaseline;
+    uint8_t baselineBank = 0;
+    // External storage for all memory, when attached (see attachBacking)
+    uint8_t* backing = nullptr;
+    uint8_t* backingBanks = nullptr;
+};
+
+/**
+ * Name: splitmix64
+ * Purpouse: Map a counter to a well-mixed 64-bit value (the splitmix64 generator's output
+ *           for state x).
+ * Inputs:
+ *   - x: The generator state, typically seed + index * 0x9E3779B97F4A7C15.
+ * Outputs: The mixed value.
+ * Effects: None
+ */
+uint64_t splitmix64(uint64_t x) {
+    uint64_t z = x + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Name: nextRandomSeed
+ * Purpouse: Hand out distinct non-zero seeds for per-machine random number generators.
+ * Inputs: None
+ * Outputs: A 64-bit seed.
+ * Effects: Advances a process-wide splitmix64 sequence seeded once from random_device.
+ */
+uint64_t nextRandomSeed() {
+    static atomic<uint64_t> sequence{(static_cast<uint64_t>(random_device{}()) << 32) | random_device{}()};
+    return splitmix64(sequence.fetch_add(0x9E3779B97F4A7C15ull, memory_order_relaxed)) | 1;
+}
+
+// Persistent machine state. The file's first page holds the register file; the rest is
+// external backing for PagedMemory (BACKING_SIZE bytes). The file is mapped shared and
+// sparse, so untouched memory costs no disk space, stores reach the page cache directly,
+// and a restarted emulator resumes by mapping the file again. The layout is host-specific.
+const char PERSISTENT_MAGIC[8] = {'E', 'M', 'U', 'S', 'T', 'A', 'T', 'E'};
+const uint32_t PERSISTENT_VERSION = 1;
+
+struct PersistentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pageSize;
+    uint64_t instructionCount;
+    uint64_t timerInterval;
+    uint64_t timerDeadline; // Instruction count, so it survives restarts
+    uint64_t checkpoints;
+    uint16_t pc;
+    uint16_t sp;
+    uint16_t savedPc;
+    uint8_t reg_A;
+    uint8_t reg_B;
+    uint8_t privileged;
+    uint8_t halted;
+    uint8_t bank;
+    uint8_t interruptMask;
+    uint8_t interruptPending;
+    uint8_t inInterrupt;
+    uint8_t savedA;
+    uint8_t savedB;
+    uint8_t savedPrivileged;
+    uint8_t usedBanks[BANK_COUNT / 8];
+    uint8_t stack[256];
+};
+
+static_assert(sizeof(PersistentHeader) <= PAGE_SIZE, "the register file fits in the first page");
+
+/**
+ * Name: validPersistentHeader
+ * Purpouse: Check a register file read from outside the process (a state file, the migration
+ *           socket, a snapshot or the content store) before it is loaded.
+ * Inputs:
+ *   - header: The header.
+ * Outputs: True if this emulator wrote it and every field is in range. Every pc and bank
+ *          value is valid, but the stack pointer must stay within the stack.
+ * Effects: None
+ */
+bool validPersistentHeader(const PersistentHeader& header) {
+    return memcmp(header.magic, PERSISTENT_MAGIC, sizeof(PERSISTENT_MAGIC)) == 0 && header.version == PERSISTENT_VERSION &&
+           header.pageSize == PAGE_SIZE && header.sp <= sizeof(header.stack);
+}
+
+class MachineStateFile {
+public:
+    /**
+     * Name: open
+     * Purpouse: Map a persistent state file, creating it if needed.
+     * Inputs:
+     *   - path: The state file.
+     * Outputs: The mapped file, or nullptr on failure or if an existing file is not a valid
+     *          state file of the right size (an error message is printed).
+     * Effects: Creates a missing or empty file at its full sparse size. Never resizes an
+     *          existing one.
+     */
+    static unique_ptr<MachineStateFile> open(const string& path) {
+#if !defined(_WIN32)
+        size_t length = PAGE_SIZE + BACKING_SIZE;
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            cerr << "Error: Could not open state file " << path << endl;
+            return nullptr;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            cerr << "Error: Could not size state file " << path << endl;
+            ::close(fd);
+            return nullptr;
+        }
+        bool created = info.st_size == 0;
+        PersistentHeader existingHeader{};
+        if (!created && (static_cast<size_t>(info.st_size) != length ||
+                         pread(fd, &existingHeader, sizeof(existingHeader), 0) != static_cast<ssize_t>(sizeof(existingHeader)) ||
+                         !validPersistentHeader(existingHeader))) {
+            // Never truncate or overwrite a file this emulator did not write.
+            cerr << "Error: " << path << " is not a state file from this emulator; refusing to overwrite it" << endl;
+            ::close(fd);
+            return nullptr;
+        }
+        if (created && ftruncate(fd, static_cast<off_t>(length)) != 0) {
+            cerr << "Error: Could not size state file " << path << endl;
+            ::close(fd);
+            return nullptr;
+        }
+        void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            cerr << "Error: Could not map state file " << path << endl;
+            return nullptr;
+        }
+        auto file = unique_ptr<MachineStateFile>(new MachineStateFile());
+        file->mapping = static_cast<uint8_t*>(mapped);
+        file->length = length;
+        file->path = path;
+        file->existing = !created;
+        return file;
+#else
+        cerr << "Error: Persistent state files need a POSIX host (" << path << ")" << endl;
+        return nullptr;
+#endif
+    }
+
+    ~MachineStateFile() {
+#if !defined(_WIN32)
+        munmap(mapping, length);
+#endif
+    }
+
+    PersistentHeader& header() {
+        return *reinterpret_cast<PersistentHeader*>(mapping);
+    }
+
+    uint8_t* storage() {
+        return mapping + PAGE_SIZE;
+    }
+
+    // True if the file held a machine when it was opened
+    bool holdsMachine() const {
+        return existing;
+    }
+
+    const string& getPath() const {
+        return path;
+    }
+
+    /**
+     * Name: sync
+     * Purpouse: Make the mapped state durable.
+     * Inputs: None
+     * Outputs: True on success.
+     * Effects: Blocks until the host has written every dirty page of the file.
+     */
+    bool sync() {
+#if !defined(_WIN32)
+        return msync(mapping, length, MS_SYNC) == 0;
+#else
+        return false;
+#endif
+    }
+
+private:
+    MachineStateFile() = default;
+
+    uint8_t* mapping = nullptr;
+    size_t length = 0;
+    string path;
+    bool existing = false;
+};
+
+// Live migration. A running machine is streamed to another emulator process over a Unix
+// socket as a sequence of records: pages while the source keeps running (pre-copy), then
+// the register file (a PersistentHeader) and a done marker, after which the target
+// acknowledges and takes over.
+const uint8_t MIGRATE_PAGE = 1;  // Followed by PAGE_SIZE bytes
+const uint8_t MIGRATE_STATE = 2; // Followed by a PersistentHeader
+const uint8_t MIGRATE_DONE = 3;
+const uint64_t MIGRATION_ROUND_INSTRUCTIONS = 20000; // The source runs this long between rounds
+const uint32_t MIGRATION_MAX_ROUNDS = 8;
+const uint32_t MIGRATION_STOP_PAGES = 2; // Stop and copy once a round leaves this few dirty pages
+
+struct MigrationRecord {
+    uint8_t type;
+    uint8_t bank;
+    uint8_t page;
+    uint8_t reserved;
+};
+
+struct MigrationStats {
+    uint32_t rounds = 0;
+    uint32_t pagesSent = 0;
+    uint32_t finalPages = 0;      // Pages copied while the machine was stopped
+    uint64_t pauseMicroseconds = 0;
+};
+
+/**
+ * Name: connectUnixSocket
+ * Purpouse: Connect to, or listen on and accept one connection from, a Unix socket.
+ * Inputs:
+ *   - path: The socket path.
+ *   - listen: True to wait for a peer (replacing any stale socket file); false to connect.
+ * Outputs: The connected descriptor, or -1 on failure.
+ * Effects: A listening socket file is removed again once the peer has connected.
+ */
+int connectUnixSocket(const string& path, bool listen) {
+#if !defined(_WIN32)
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!listen) {
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 1) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    int peer = accept(fd, nullptr, nullptr);
+    ::close(fd);
+    unlink(path.c_str());
+    return peer;
+#else
+    (void)path;
+    (void)listen;
+    return -1;
+#endif
+}
+
+bool sendAll(int fd, const uint8_t* data, size_t length) {
+#if !defined(_WIN32)
+    while (length > 0) {
+        ssize_t written = ::send(fd, data, length, MSG_NOSIGNAL);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+#else
+    (void)fd;
+    (void)data;
+    return length == 0;
+#endif
+}
+
+bool receiveAll(int fd, uint8_t* data, size_t length) {
+#if !defined(_WIN32)
+    while (length > 0) {
+        ssize_t received = ::recv(fd, data, length, 0);
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        length -= static_cast<size_t>(received);
+    }
+    return true;
+#else
+    (void)fd;
+    (void)data;
+    return length == 0;
+#endif
+}
+
+// LZ block codec for snapshot pages, in the style of LZ4: a sequence is a token byte (literal
+// count in the high nibble, match length - LZ_MIN_MATCH in the low nibble, 15 meaning more
+// length bytes follow), the literals, then a 16-bit little-endian match offset. The last
+// sequence has literals only. Matches are found through a single-entry hash table of 4-byte
+// prefixes, and the search skips ahead faster the longer it goes without a match.
+const uint32_t LZ_MIN_MATCH = 4;
+const uint32_t LZ_HASH_BITS = 12;
+
+void lzWriteLength(vector<uint8_t>& out, size_t length) {
+    while (length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(static_cast<uint8_t>(length));
+}
+
+/**
+ * Name: lzCompress
+ * Purpouse: Compress a block (up to 64KB).
+ * Inputs:
+ *   - input: The data.
+ *   - length: Its length.
+ *   - out: Receives the compressed block (appended).
+ * Outputs: None
+ * Effects: None
+ */
+void lzCompress(const uint8_t* input, size_t length, vector<uint8_t>& out) {
+    uint32_t table[1u << LZ_HASH_BITS] = {};
+    size_t anchor = 0;
+    size_t position = 1; // Position 0 can only start literals; the table's zeros mean "none"
+    uint32_t misses = 0;
+    auto emit = [&](size_t literalEnd, size_t matchLength, size_t offset) {
+        size_t literals = literalEnd - anchor;
+        size_t matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+        out.push_back(static_cast<uint8_t>((min<size_t>(literals, 15) << 4) | min<size_t>(matchCode, 15)));
+        if (literals >= 15) {
+            lzWriteLength(out, literals - 15);
+        }
+        out.insert(out.end(), input + anchor, input + literalEnd);
+        if (matchLength) {
+            out.push_back(static_cast<uint8_t>(offset));
+            out.push_back(static_cast<uint8_t>(offset >> 8));
+            if (matchCode >= 15) {
+                lzWriteLength(out, matchCode - 15);
+            }
+        }
+    };
+    while (length >= LZ_MIN_MATCH && position <= length - LZ_MIN_MATCH) {
+        uint32_t word;
+        memcpy(&word, input + position, sizeof(word));
+        uint32_t slot = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[slot];
+        table[slot] = static_cast<uint32_t>(position);
+        uint32_t candidateWord;
+        memcpy(&candidateWord, input + candidate, sizeof(candidateWord));
+        if (candidate == 0 || position - candidate > 0xFFFF || candidateWord != word) {
+            position += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+        // Extend the match eight bytes at a time; the lowest differing byte ends it
+        // (little-endian hosts), and the tail is finished bytewise.
+        size_t limit = length - position;
+        size_t matchLength = LZ_MIN_MATCH;
+        while (matchLength + 8 <= limit) {
+            uint64_t a;
+            uint64_t b;
+            memcpy(&a, input + candidate + matchLength, sizeof(a));
+            memcpy(&b, input + position + matchLength, sizeof(b));
+            if (a != b) {
+                matchLength += __builtin_ctzll(a ^ b) / 8;
+                break;
+            }
+            matchLength += 8;
+        }
+        while (matchLength < limit && input[candidate + matchLength] == input[position + matchLength]) {
+            matchLength++;
+        }
+        emit(position, matchLength, position - candidate);
+        position += matchLength;
+        anchor = position;
+    }
+    emit(length, 0, 0);
+}
+
+/**
+ * Name: lzDecompress
+ * Purpouse: Decompress a block produced by lzCompress.
+ * Inputs:
+ *   - input: The compressed block.
+ *   - length: Its length.
+ *   - out: The destination.
+ *   - outLength: The exact decompressed length expected.
+ * Outputs: False if the block is malformed or does not decompress to outLength bytes.
+ * Effects: Writes out.
+ */
+bool lzDecompress(const uint8_t* input, size_t length, uint8_t* out, size_t outLength) {
+    size_t in = 0;
+    size_t produced = 0;
+    auto readLength = [&](size_t& value) {
+        uint8_t extra;
+        do {
+            if (in >= length) {
+                return false;
+            }
+            extra = input[in++];
+            value += extra;
+        } while (extra == 255);
+        return true;
+    };
+    while (in < length) {
+        uint8_t token = input[in++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(literals)) {
+            return false;
+        }
+        if (literals > length - in || literals > outLength - produced) {
+            return false;
+        }
+        memcpy(out + produced, input + in, literals);
+        in += literals;
+        produced += literals;
+        if (in == length) {
+            break;
+        }
+        if (length - in < 2) {
+            return false;
+        }
+        size_t offset = input[in] | (input[in + 1] << 8);
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(matchLength)) {
+            return false;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > produced || matchLength > outLength - produced) {
+            return false;
+        }
+        uint8_t* destination = out + produced;
+        const uint8_t* source = destination - offset;
+        if (offset >= matchLength) {
+            memcpy(destination, source, matchLength);
+        } else if (offset == 1) {
+            memset(destination, *source, matchLength);
+        } else {
+            for (size_t i = 0; i < matchLength; i++) {
+                destination[i] = source[i];
+            }
+        }
+        produced += matchLength;
+    }
+    return produced == outLength;
+}
+
+// Snapshot files: a header with the register file and the identity of the reset baseline
+// the snapshot was taken against, then one record per page that differs from it. A page
+// is stored XORed with its baseline page when it has one (so unchanged bytes become zero
+// runs), then LZ-compressed unless that does not help. Pages equal to the baseline are
+// skipped, which covers every untouched zero page.
+const char SNAPSHOT_MAGIC[8] = {'E', 'M', 'U', 'S', 'N', 'A', 'P', '1'};
+const uint8_t SNAPSHOT_DELTA = 0x01; // XORed with the baseline page
+const uint8_t SNAPSHOT_LZ = 0x02;    // LZ-compressed, otherwise PAGE_SIZE raw bytes
+const uint8_t SNAPSHOT_ZERO = 0x04;  // All zero; no data follows
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pages;
+    uint64_t baselineHash;
+    PersistentHeader state;
+};
+
+struct SnapshotPage {
+    uint8_t bank;
+    uint8_t page;
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t length; // Bytes of data that follow
+};
+
+// Content-addressed store: a directory holding program images and snapshots as manifests
+// of page-sized chunks. Each chunk is a file named by the SHA-256 of its contents, written
+// once and never modified, so a page shared by any number of images and snapshots (a common
+// runtime, an unmodified program page in a snapshot of that program) is stored once. Loading
+// maps the chunk files directly instead of copying them.
+//
+//   <root>/chunks/<first two hex digits>/<64 hex digits>   PAGE_SIZE bytes
+//   <root>/objects/<name>                                  StoreManifest, then (snapshots
+//                                                          only) a PersistentHeader, then
+//                                                          one StoreChunk per stored page
+const char STORE_MAGIC[8] = {'E', 'M', 'U', 'S', 'T', 'O', 'R', 'E'};
+const uint32_t STORE_IMAGE = 1;    // A program image mapped at USER_PROGRAM_START_ADDRESS
+const uint32_t STORE_SNAPSHOT = 2; // A whole machine: every page holding data, plus state
+
+struct StoreManifest {
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;
+    uint64_t length; // Image bytes; ADDRESS_SPACE_SIZE for snapshots
+    uint32_t chunks;
+    uint32_t reserved;
+};
+
+struct StoreChunk {
+    uint8_t bank; // Always 0 for images
+    uint8_t page; // Page number in the image, or as in PagedMemory::forEachSnapshotPage()
+    uint8_t reserved[2];
+    uint8_t hash[32];
+};
+
+struct StoreUsage {
+    size_t objects = 0;
+    size_t chunks = 0;        // Distinct chunk files
+    size_t chunkRefs = 0;     // Chunks referenced by all objects together
+};
+
+class ContentStore {
+public:
+    /**
+     * Name: open
+     * Purpouse: Use a directory as the store, creating it if needed.
+     * Inputs:
+     *   - directory: The store root.
+     * Outputs: True on success.
+     * Effects: Creates the chunks and objects subdirectories.
+     */
+    bool open(const string& directory) {
+        error_code error;
+        filesystem::create_directories(filesystem::path(directory) / "chunks", error);
+        filesystem::create_directories(filesystem::path(directory) / "objects", error);
+        if (error) {
+            cerr << "Error: Could not create store '" << directory << "': " << error.message() << endl;
+            return false;
+        }
+        root = directory;
+        return true;
+    }
+
+    bool isOpen() const {
+        return !root.empty();
+    }
+
+    const string& getRoot() const {
+        return root;
+    }
+
+    /**
+     * Name: validName
+     * Purpouse: Check that an object name stays inside the objects directory.
+     * Inputs:
+     *   - name: The proposed name.
+     * Outputs: True if the name is non-empty, does not start with '.', and only uses letters,
+     *          digits, '.', '-' and '_'.
+     * Effects: None
+     */
+    static bool validName(const string& name) {
+        if (name.empty() || name[0] == '.') {
+            return false;
+        }
+        for (char c : name) {
+            if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-' && c != '_') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    string chunkPath(const uint8_t* hash) const {
+        static const char digits[] = "0123456789abcdef";
+        string name;
+        for (int i = 0; i < 32; i++) {
+            name += digits[hash[i] >> 4];
+            name += digits[hash[i] & 0xF];
+        }
+        return root + "/chunks/" + name.substr(0, 2) + "/" + name;
+    }
+
+    /**
+     * Name: putChunk
+     * Purpouse: Add one page to the store unless an identical page is already there.
+     * Inputs:
+     *   - page: PAGE_SIZE bytes.
+     *   - chunk: Receives the page's hash.
+     * Outputs: True on success.
+     * Effects: Writes the chunk file through a temporary name and a rename, so a chunk that
+     *          exists is always complete. Counts the chunk as written or deduplicated.
+     */
+    bool putChunk(const uint8_t* page, StoreChunk& chunk) {
+        array<uint8_t, 32> hash = sha256(page, PAGE_SIZE);
+        memcpy(chunk.hash, hash.data(), hash.size());
+        string path = chunkPath(chunk.hash);
+        error_code error;
+        if (filesystem::exists(path, error)) {
+            chunksShared++;
+            return true;
+        }
+        filesystem::create_directories(filesystem::path(path).parent_path(), error);
+        string temporary = path + ".tmp" + to_string(getpid());
+        ofstream file(temporary, ios::binary);
+        file.write(reinterpret_cast<const char*>(page), PAGE_SIZE);
+        file.close();
+        if (!file || (filesystem::rename(temporary, path, error), error)) {
+            cerr << "Error: Could not write chunk " << path << endl;
+            filesystem::remove(temporary, error);
+            return false;
+        }
+        chunksWritten++;
+        return true;
+    }
+
+    /**
+     * Name: putObject
+     * Purpouse: Record an object as a manifest of chunks already in the store.
+     * Inputs:
+     *   - name: The object name (see validName).
+     *   - kind: STORE_IMAGE or STORE_SNAPSHOT.
+     *   - length: The object length in bytes.
+     *   - state: The machine state for snapshots, otherwise nullptr.
+     *   - chunks: The pages that hold data; missing pages are zero.
+     * Outputs: True on success.
+     * Effects: Replaces any object of the same name. Its chunks stay for other objects.
+     */
+    bool putObject(const string& name, uint32_t kind, uint64_t length, const PersistentHeader* state, const vector<StoreChunk>& chunks) {
+        StoreManifest manifest{};
+        memcpy(manifest.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+        manifest.version = PERSISTENT_VERSION;
+        manifest.kind = kind;
+        manifest.length = length;
+        manifest.chunks = static_cast<uint32_t>(chunks.size());
+        string path = root + "/objects/" + name;
+        string temporary = path + ".tmp" + to_string(getpid());
+        ofstream file(temporary, ios::binary);
+        file.write(reinterpret_cast<const char*>(&manifest), sizeof(manifest));
+        if (state) {
+            file.write(reinterpret_cast<const char*>(state), sizeof(*state));
+        }
+        file.write(reinterpret_cast<const char*>(chunks.data()), static_cast<streamsize>(chunks.size() * sizeof(StoreChunk)));
+        file.close();
+        error_code error;
+        if (!file || (filesystem::rename(temporary, path, error), error)) {
+            cerr << "Error: Could not write object " << path << endl;
+            filesystem::remove(temporary, error);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Name: getObject
+     * Purpouse: Read an object's manifest.
+     * Inputs:
+     *   - name: The object name.
+     *   - manifest: Receives the manifest header.
+     *   - state: Receives the machine state of a snapshot.
+     *   - chunks: Receives the chunk list.
+     * Outputs: False if the object is missing or malformed, or a chunk it names is not in the
+     *          store (an error message is printed).
+     * Effects: None
+     */
+    bool getObject(const string& name, StoreManifest& manifest, PersistentHeader& state, vector<StoreChunk>& chunks) const {
+        ifstream file(root + "/objects/" + name, ios::binary);
+        if (!file.read(reinterpret_cast<char*>(&manifest), sizeof(manifest))) {
+            cerr << "Error: No object '" << name << "' in store " << root << endl;
+            return false;
+        }
+        bool ok = memcmp(manifest.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) == 0 && manifest.version == PERSISTENT_VERSION &&
+                  manifest.length <= ADDRESS_SPACE_SIZE && manifest.chunks <= PAGE_COUNT + (BANK_COUNT - 1) * BANK_WINDOW_PAGES;
+        if (ok && manifest.kind == STORE_SNAPSHOT) {
+            ok = file.read(reinterpret_cast<char*>(&state), sizeof(state)) && validPersistentHeader(state);
+        } else {
+            ok = ok && manifest.kind == STORE_IMAGE;
+        }
+        chunks.resize(ok ? manifest.chunks : 0);
+        ok = ok && file.read(reinterpret_cast<char*>(chunks.data()), static_cast<streamsize>(chunks.size() * sizeof(StoreChunk)));
+        for (size_t i = 0; ok && i < chunks.size(); i++) {
+            bool window = chunks[i].page >= BANK_WINDOW_FIRST_PAGE && chunks[i].page < BANK_WINDOW_FIRST_PAGE + BANK_WINDOW_PAGES;
+            ok = chunks[i].page < PAGE_COUNT && (chunks[i].bank == 0 || (window && manifest.kind == STORE_SNAPSHOT));
+        }
+        if (!ok) {
+            cerr << "Error: Object '" << name << "' is corrupt" << endl;
+            return false;
+        }
+        error_code error;
+        for (const StoreChunk& chunk : chunks) {
+            if (filesystem::file_size(chunkPath(chunk.hash), error) != PAGE_SIZE || error) {
+                cerr << "Error: Object '" << name << "' is missing chunk " << chunkPath(chunk.hash) << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Name: putImage
+     * Purpouse: Store a program image.
+     * Inputs:
+     *   - name: The object name.
+     *   - program: The image bytes (at most ADDRESS_SPACE_SIZE).
+     * Outputs: True on success.
+     * Effects: Adds the image's pages that are not already stored. All-zero pages are left
+     *          out of the manifest.
+     */
+    bool putImage(const string& name, const vector<uint8_t>& program) {
+        vector<StoreChunk> chunks;
+        vector<uint8_t> page(PAGE_SIZE);
+        for (size_t offset = 0; offset < program.size(); offset += PAGE_SIZE) {
+            size_t count = min(static_cast<size_t>(PAGE_SIZE), program.size() - offset);
+            memset(page.data(), 0, PAGE_SIZE);
+            memcpy(page.data(), program.data() + offset, count);
+            if (all_of(page.begin(), page.end(), [](uint8_t value) { return value == 0; })) {
+                continue;
+            }
+            StoreChunk chunk{0, static_cast<uint8_t>(offset / PAGE_SIZE), {0, 0}, {}};
+            if (!putChunk(page.data(), chunk)) {
+                return false;
+            }
+            chunks.push_back(chunk);
+        }
+        return putObject(name, STORE_IMAGE, program.size(), nullptr, chunks);
+    }
+
+    /**
+     * Name: openImage
+     * Purpouse: Build a demand-paged image over an object's bank-0 chunks.
+     * Inputs:
+     *   - manifest: The object's manifest.
+     *   - chunks: Its chunk list.
+     * Outputs: An image whose pages are mapped from the chunk files on first touch.
+     * Effects: None
+     */
+    shared_ptr<PagedImage> openImage(const StoreManifest& manifest, const vector<StoreChunk>& chunks) const {
+        vector<string> paths((manifest.length + PAGE_SIZE - 1) / PAGE_SIZE);
+        for (const StoreChunk& chunk : chunks) {
+            if (chunk.bank == 0 && chunk.page < paths.size()) {
+                paths[chunk.page] = chunkPath(chunk.hash);
+            }
+        }
+        return make_shared<ChunkedImage>(move(paths), manifest.length);
+    }
+
+    /**
+     * Name: usage
+     * Purpouse: Measure the store on disk.
+     * Inputs: None
+     * Outputs: The object and chunk counts, and how many chunk references the objects make.
+     * Effects: Reads every manifest.
+     */
+    StoreUsage usage() const {
+        StoreUsage result;
+        error_code error;
+        for (filesystem::recursive_directory_iterator it(root + "/chunks", error), end; !error && it != end; it.increment(error)) {
+            result.chunks += it->is_regular_file() && it->path().filename().string().size() == 64;
+        }
+        for (filesystem::directory_iterator it(root + "/objects", error), end; !error && it != end; it.increment(error)) {
+            ifstream file(it->path(), ios::binary);
+            StoreManifest manifest;
+            if (validName(it->path().filename().string()) && file.read(reinterpret_cast<char*>(&manifest), sizeof(manifest)) &&
+                memcmp(manifest.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) == 0) {
+                result.objects++;
+                result.chunkRefs += manifest.chunks;
+            }
+        }
+        return result;
+    }
+
+    uint64_t chunksWritten = 0; // By this process
+    uint64_t chunksShared = 0;  // Found already stored
+
+private:
+    string root;
+};
+
+class CPU;
+
+// Host function interface. Every syscall number dispatches through a flat 256-entry table
+// of native callbacks. A handler receives the calling CPU and the syscall argument, and
+// returns the result that lands in reg_B (or the completion ring). Numbers from
+// HOST_SYSCALL_BASE upward are left free for embedders to offload work to native code.
+using SyscallFunction = function<uint8_t(CPU&, uint8_t)>;
+const uint8_t HOST_SYSCALL_BASE = 0x80;
+
+class SyscallTable {
+public:
+    /**
+     * Name: registerHandler
+     * Purpouse: Install a native callback for a syscall number.
+     * Inputs:
+     *   - number: The syscall number to handle.
+     *   - handler: The callback, or an empty function to unregister the number.
+     * Outputs: None
+     * Effects: Replaces any previous handler. Not synchronized; register before running.
+     */
+    void registerHandler(uint8_t number, SyscallFunction handler) {
+        handlers[number] = move(handler);
+    }
+
+    const SyscallFunction& lookup(uint8_t number) const {
+        return handlers[number];
+    }
+
+private:
+    array<SyscallFunction, 256> handlers;
+};
+
+SyscallTable& defaultSyscallTable();
+
+class CPU {
+public:
+    uint8_t reg_A = 0;
+    uint8_t reg_B = 0;
+    uint16_t pc = 0;
+    uint16_t sp = 0;
+    bool privileged = false; // New: Privileged mode flag
+    uint8_t pid = 0;
+    uint64_t instructionCount = 0;
+    SyscallTable* syscalls = &defaultSyscallTable();
+    FileSandbox files;
+    Framebuffer framebuffer;
+    VirtualNetwork* network = nullptr; // NIC attachment; the port is the PID
+    bool trace = true;                 // Log every executed instruction
+    vector<uint64_t> profile;          // Executions per PC while profiling; empty when off
+    bool halted = false;
+
+    // Interrupt controller state. interruptPending may be set from device threads.
+    atomic<uint8_t> interruptPending{0};
+    uint8_t interruptMask = 0xFF;
+    bool inInterrupt = false;
+    uint64_t timerInterval = 0;
+    uint64_t timerDeadline = UINT64_MAX;
+
+    // DMA controller state. The destructor joins the helper thread before memory and files
+    // are released.
+    atomic<uint8_t> dmaStatus{DMA_IDLE};
+    thread dmaThread;
+    uint32_t dmaFrameAddress = 0; // Destination of the last transfer into memory, rechecked by
+    uint32_t dmaFrameLength = 0;  // presentFrame() until it has landed
+
+    PagedMemory memory;
+    array<uint8_t, 256> stack{};
+
+    // Persistent backing, when attached. Declared after memory so it is unmapped first.
+    unique_ptr<MachineStateFile> stateFile;
+    uint64_t checkpointInterval = 0; // Instructions between automatic checkpoints; 0 = manual only
+
+    // Constructor
+    CPU() : bootTime(chrono::steady_clock::now()), rngState(nextRandomSeed()) {}
+
+    ~CPU() {
+        waitForDma();
+    }
+
+    /**
+     * Name: readMemory
+     * Purpouse: Read a byte of memory on behalf of the running program.
+     * Inputs:
+     *   - address: The address to read.
+     * Outputs: The byte at the address.
+     * Effects: Refreshes the vDSO page first if the address falls inside it.
+     */
+    uint8_t readMemory(uint16_t address) {
+        if (address >= VDSO_ADDRESS && address < VDSO_ADDRESS + VDSO_SIZE) {
+            refreshVdso(address);
+        }
+        return memory[address];
+    }
+
+    /**
+     * Name: writeMemory
+     * Purpouse: Write a byte of memory on behalf of the running program.
+     * Inputs:
+     *   - address: The address to write.
+     *   - value: The byte to store.
+     * Outputs: False if the address is in the read-only vDSO page.
+     * Effects: Marks the framebuffer scanline dirty when the address falls inside it.
+     */
+    bool writeMemory(uint16_t address, uint8_t value) {
+        if (address >= VDSO_ADDRESS && address < VDSO_ADDRESS + VDSO_SIZE) {
+            return false;
+        }
+        memory.write(address, value);
+        noteWritten(address, 1);
+        return true;
+    }
+
+    /**
+     * Name: noteWritten
+     * Purpouse: Tell memory-mapped devices that a range of memory was written.
+     * Inputs:
+     *   - address: The first address written.
+     *   - length: The number of bytes written.
+     * Outputs: None
+     * Effects: Marks overlapping framebuffer scanlines dirty. Called by every path that
+     *          writes memory other than the zero page (stores, DMA, file reads).
+     */
+    void noteWritten(uint32_t address, uint32_t length) {
+        if (address < FRAMEBUFFER_ADDRESS + FRAMEBUFFER_SIZE && address + length > FRAMEBUFFER_ADDRESS) {
+            uint32_t offset = address > FRAMEBUFFER_ADDRESS ? address - FRAMEBUFFER_ADDRESS : 0;
+            framebuffer.markDirty(offset, address + length - FRAMEBUFFER_ADDRESS - offset);
+        }
+    }
+
+    /**
+     * Name: presentFrame
+     * Purpouse: Mark the end of a frame drawn by the program.
+     * Inputs: None
+     * Outputs: None
+     * Effects: Refreshes the framebuffer's dirty scanlines and, when headless dumping is on,
+     *          writes the frame if anything changed since the last one.
+     */
+    void presentFrame() {
+        if (dmaFrameLength > 0) { // A DMA transfer may have written the framebuffer since it started
+            noteWritten(dmaFrameAddress, dmaFrameLength);
+            if (dmaStatus.load(memory_order_acquire) != DMA_BUSY) {
+                dmaFrameLength = 0;
+            }
+        }
+        bool changed = framebuffer.update(memory.page(FRAMEBUFFER_ADDRESS));
+        framebuffer.framesPresented++;
+        if (!framebuffer.dumpPrefix.empty() && (changed || framebuffer.framesWritten == 0)) {
+            stringstream path;
+            path << framebuffer.dumpPrefix << "_" << setw(5) << setfill('0') << framebuffer.framesPresented << ".ppm";
+            if (framebuffer.writePpm(path.str())) {
+                framebuffer.framesWritten++;
+            }
+        }
+    }
+
+    /**
+     * Name: readStream
+     * Purpouse: Read from a host stream straight into a range of memory.
+     * Inputs:
+     *   - stream: The source stream.
+     *   - address: The first address to fill (the range must be writable).
+     *   - length: The maximum number of bytes.
+     * Outputs: The number of bytes read.
+     * Effects: Fills memory page by page without an intermediate buffer.
+     */
+    uint32_t readStream(istream& stream, uint32_t address, uint32_t length) {
+        uint32_t total = 0;
+        stream.clear();
+        memory.forEachWritableSpan(address, length, [&](uint8_t* data, uint32_t chunk) {
+            stream.read(reinterpret_cast<char*>(data), chunk);
+            total += static_cast<uint32_t>(stream.gcount());
+            return stream.gcount() == static_cast<streamsize>(chunk);
+        });
+        return total;
+    }
+
+    /**
+     * Name: writeStream
+     * Purpouse: Write a range of memory straight to a host stream.
+     * Inputs:
+     *   - stream: The destination stream.
+     *   - address: The first address to write out.
+     *   - length: The number of bytes.
+     * Outputs: True on success.
+     * Effects: Writes memory page by page without an intermediate buffer.
+     */
+    bool writeStream(ostream& stream, uint32_t address, uint32_t length) {
+        stream.clear();
+        memory.forEachSpan(address, length, [&](const uint8_t* data, uint32_t chunk) {
+            stream.write(reinterpret_cast<const char*>(data), chunk);
+            return stream.good();
+        });
+        return stream.good();
+    }
+
+    /**
+     * Name: readWord
+     * Purpouse: Read a little-endian 16-bit value from memory.
+     * Inputs:
+     *   - address: The address of the low byte.
+     * Outputs: The 16-bit value.
+     * Effects: None
+     */
+    uint16_t readWord(uint16_t address) const {
+        return memory[address] | (memory[static_cast<uint16_t>(address + 1)] << 8);
+    }
+
+    /**
+     * Name: writeWord
+     * Purpouse: Write a little-endian 16-bit value to memory.
+     * Inputs:
+     *   - address: The address of the low byte.
+     *   - value: The value to store.
+     * Outputs: None
+     * Effects: Modifies two bytes of memory.
+     */
+    void writeWord(uint16_t address, uint16_t value) {
+        memory.write(address, static_cast<uint8_t>(value));
+        memory.write(static_cast<uint16_t>(address + 1), static_cast<uint8_t>(value >> 8));
+    }
+
+    /**
+     * Name: isWritableRange
+     * Purpouse: Check whether the kernel may write a range of memory for the program.
+     * Inputs:
+     *   - address: The first address of the range.
+     *   - length: The number of bytes.
+     * Outputs: True if the range lies in memory and does not touch the read-only vDSO page.
+     * Effects: None
+     */
+    bool isWritableRange(uint32_t address, uint32_t length) const {
+        if (address + length > memory.size()) {
+            return false;
+        }
+        return address + length <= VDSO_ADDRESS || address >= VDSO_ADDRESS + VDSO_SIZE;
+    }
+
+    /**
+     * Name: refreshVdso
+     * Purpouse: Bring the vDSO page up to date before a program reads it.
+     * Inputs:
+     *   - address: The vDSO address about to be read.
+     * Outputs: None
+     * Effects: Rewrites the counter, time and PID fields, and a new random byte when the
+     *          read falls in the random field.
+     */
+    void refreshVdso(uint16_t address) {
+        uint64_t elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - bootTime).count();
+        for (int i = 0; i < 8; i++) {
+            memory.write(VDSO_INSTRUCTION_COUNT + i, static_cast<uint8_t>(instructionCount >> (8 * i)));
+            memory.write(VDSO_TIME_US + i, static_cast<uint8_t>(elapsed >> (8 * i)));
+        }
+        memory.write(VDSO_PID, pid);
+        if (address >= VDSO_RANDOM && address < VDSO_RANDOM + VDSO_RANDOM_SIZE) {
+            rngState ^= rngState << 13;
+            rngState ^= rngState >> 7;
+            rngState ^= rngState << 17;
+            memory.write(address, static_cast<uint8_t>(rngState));
+        }
+    }
+
+    /**
+     * Name: loadProgram
+     * Purpouse: Load a program into memory at a specified start address.
+     * Inputs:
+     *   - program: A vector of bytes representing the program to load.
+     *  - startAddress: The memory address where the program should be loaded.
+     * Outputs: None
+     * Effects: The program is copied into the CPU's memory starting at the specified address
+     *         and an error message is printed if the program exceeds memory bounds.
+     */
+    void loadProgram(const vector<uint8_t>& program, uint16_t startAddress) {
+        if (startAddress + program.size() > memory.size()) {
+            cerr << "Error: Program too large for memory at address 0x" << hex << startAddress << dec << endl;
+            return;
+        }
+        memory.write(startAddress, program.data(), static_cast<uint32_t>(program.size()));
+        memory.markBaseline();
+        halted = false;
+    }
+
+    /**
+     * Name: loadImage
+     * Purpouse: Load a raw program image file lazily.
+     * Inputs:
+     *   - path: The image file.
+     *   - startAddress: The page-aligned address to load it at.
+     * Outputs: True on success.
+     * Effects: Pages of the image are mapped in on first access instead of being copied up
+     *          front; an error message is printed on failure.
+     */
+    bool loadImage(const string& path, uint16_t startAddress) {
+        shared_ptr<ProgramImage> image = ProgramImage::open(path);
+        if (!image) {
+            cerr << "Error: Could not open image file " << path << endl;
+            return false;
+        }
+        return loadImage(image, startAddress);
+    }
+
+    bool loadImage(shared_ptr<PagedImage> image, uint16_t startAddress) {
+        if (!memory.mapImage(image, startAddress)) {
+            cerr << "Error: Image does not fit at page-aligned address 0x" << hex << startAddress << dec << endl;
+            return false;
+        }
+        memory.markBaseline();
+        halted = false;
+        return true;
+    }
+
+    /**
+     * Name: storeSnapshot
+     * Purpouse: Save the whole machine into a content-addressed store.
+     * Inputs:
+     *   - store: The open store.
+     *   - name: The object name.
+     * Outputs: True on success.
+     * Effects: Adds every page holding data that the store does not already have. Unlike
+     *          encodeSnapshot, pages are stored whole, so the snapshot does not depend on the
+     *          loaded program and shares chunks with it and with other snapshots.
+     */
+    bool storeSnapshot(ContentStore& store, const string& name) {
+        waitForDma();
+        PersistentHeader state{};
+        memcpy(state.magic, PERSISTENT_MAGIC, sizeof(PERSISTENT_MAGIC));
+        state.version = PERSISTENT_VERSION;
+        state.pageSize = PAGE_SIZE;
+        saveState(state);
+        vector<StoreChunk> chunks;
+        bool ok = true;
+        memory.forEachSnapshotPage([&](uint8_t bank, uint32_t page, const uint8_t* current, const uint8_t*) {
+            StoreChunk chunk{bank, static_cast<uint8_t>(page), {0, 0}, {}};
+            if (ok && current) {
+                ok = store.putChunk(current, chunk);
+                chunks.push_back(chunk);
+            }
+        });
+        return ok && store.putObject(name, STORE_SNAPSHOT, ADDRESS_SPACE_SIZE, &state, chunks);
+    }
+
+    /**
+     * Name: loadFromStore
+     * Purpouse: Load an image or snapshot from a content-addressed store.
+     * Inputs:
+     *   - store: The open store.
+     *   - name: The object name.
+     * Outputs: False if the object is missing or corrupt (an error message is printed).
+     * Effects: An image is loaded like loadImage(). A snapshot resets the machine, maps its
+     *          address space from the chunk files, copies in its bank pages and takes its
+     *          register file. Either way the loaded memory becomes the baseline restart()
+     *          returns to.
+     */
+    bool loadFromStore(ContentStore& store, const string& name) {
+        StoreManifest manifest;
+        PersistentHeader state;
+        vector<StoreChunk> chunks;
+        if (!store.getObject(name, manifest, state, chunks)) {
+            return false;
+        }
+        if (manifest.kind == STORE_IMAGE) {
+            return loadImage(store.openImage(manifest, chunks), USER_PROGRAM_START_ADDRESS);
+        }
+        reset();
+        memory.mapImage(store.openImage(manifest, chunks), 0);
+        // Bank pages live outside the address space, so they are the one part that is copied.
+        vector<uint8_t> page(PAGE_SIZE);
+        for (const StoreChunk& chunk : chunks) {
+            if (chunk.bank != 0) {
+                ifstream file(store.chunkPath(chunk.hash), ios::binary);
+                file.read(reinterpret_cast<char*>(page.data()), PAGE_SIZE);
+                memory.installPage(chunk.bank, chunk.page, page.data());
+            }
+        }
+        memory.markBaseline();
+        loadState(state);
+        return true;
+    }
+
+    /**
+     * Name: persistTo
+     * Purpouse: Back this machine's memory, stack and registers with a state file.
+     * Inputs:
+     *   - path: The state file.
+     *   - interval: Instructions between automatic checkpoints (0 for manual only).
+     * Outputs: True on success.
+     * Effects: If the file already holds a machine, that machine is resumed in place: its
+     *          pages are used directly from the mapping and nothing is parsed or copied.
+     *          Otherwise the current machine is written to the file. Open files are closed
+     *          either way, since host file handles cannot outlive the process.
+     */
+    bool persistTo(const string& path, uint64_t interval) {
+        unique_ptr<MachineStateFile> file = MachineStateFile::open(path);
+        if (!file) {
+            return false;
+        }
+        waitForDma();
+        dmaStatus.store(DMA_IDLE);
+        files.closeAll();
+        if (stateFile) {
+            stopPersisting();
+        }
+        PersistentHeader& header = file->header();
+        if (file->holdsMachine()) {
+            memory.attachBacking(file->storage(), header.usedBanks, true);
+            loadState(header);
+        } else {
+            memcpy(header.magic, PERSISTENT_MAGIC, sizeof(PERSISTENT_MAGIC));
+            header.version = PERSISTENT_VERSION;
+            header.pageSize = PAGE_SIZE;
+            header.checkpoints = 0;
+            memory.attachBacking(file->storage(), header.usedBanks, false);
+        }
+        stateFile = move(file);
+        checkpointInterval = interval;
+        nextCheckpoint = instructionCount + interval;
+        framebuffer.markDirty(0, FRAMEBUFFER_SIZE);
+        return checkpoint();
+    }
+
+    /**
+     * Name: checkpoint
+     * Purpouse: Make the persistent state durable at the current instruction.
+     * Inputs: None
+     * Outputs: True on success (and trivially true when not persisting).
+     * Effects: Writes the register file and msyncs the state file.
+     */
+    bool checkpoint() {
+        if (!stateFile) {
+            return true;
+        }
+        PersistentHeader& header = stateFile->header();
+        saveState(header);
+        header.checkpoints++;
+        nextCheckpoint = instructionCount + checkpointInterval;
+        if (!stateFile->sync()) {
+            cerr << "Error: Checkpoint of " << stateFile->getPath() << " failed" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Name: stopPersisting
+     * Purpouse: Detach the state file and continue with private memory.
+     * Inputs: None
+     * Outputs: None
+     * Effects: Takes a final checkpoint, then copies memory out of the file and unmaps it.
+     */
+    void stopPersisting() {
+        if (!stateFile) {
+            return;
+        }
+        waitForDma();
+        checkpoint();
+        memory.detachBacking();
+        stateFile.reset();
+    }
+
+    /**
+     * Name: migrateTo
+     * Purpouse: Move this running machine to another emulator process.
+     * Inputs:
+     *   - socketPath: The Unix socket the target is listening on (see migrateFrom).
+     *   - stats: Receives round, page and pause figures.
+     * Outputs: True if the target took over; the machine is then halted here.
+     * Effects: Iterative pre-copy: every page holding data is sent while the machine keeps
+     *          running, then for up to MIGRATION_MAX_ROUNDS rounds the machine runs
+     *          MIGRATION_ROUND_INSTRUCTIONS more instructions and only the pages it dirtied are
+     *          resent. Once a round leaves few dirty pages (or the machine halts) it is
+     *          stopped, and the last dirty pages and the register file are sent in one write.
+     *          Open files are not carried over.
+     */
+    bool migrateTo(const string& socketPath, MigrationStats& stats) {
+        int fd = connectUnixSocket(socketPath, false);
+        if (fd < 0) {
+            cerr << "Error: Could not connect to migration socket " << socketPath << endl;
+            return false;
+        }
+        vector<uint8_t> batch;
+        batch.reserve((sizeof(MigrationRecord) + PAGE_SIZE) * (PAGE_COUNT + 1));
+        auto appendPage = [&](uint8_t bank, uint32_t page, const uint8_t* data) {
+            MigrationRecord record{MIGRATE_PAGE, bank, static_cast<uint8_t>(page), 0};
+            batch.insert(batch.end(), reinterpret_cast<uint8_t*>(&record), reinterpret_cast<uint8_t*>(&record) + sizeof(record));
+            batch.insert(batch.end(), data, data + PAGE_SIZE);
+            stats.pagesSent++;
+        };
+        bool ok = true;
+        bool all = true;
+        bool savedTrace = trace;
+        trace = false;
+        while (ok) {
+            // A transfer the machine started must land before its pages are sent, or its
+            // later writes would be lost along with the cleared copy-dirty bits.
+            waitForDma();
+            batch.clear();
+            memory.forEachCopyPage(all, appendPage);
+            all = false;
+            stats.rounds++;
+            ok = sendAll(fd, batch.data(), batch.size());
+            if (!ok) {
+                break;
+            }
+            run(MIGRATION_ROUND_INSTRUCTIONS);
+            if (halted || stats.rounds >= MIGRATION_MAX_ROUNDS || memory.copyDirtyCount() <= MIGRATION_STOP_PAGES) {
+                break;
+            }
+        }
+        trace = savedTrace;
+
+        // Stop and copy: the machine does not run again here.
+        auto pauseStart = chrono::steady_clock::now();
+        waitForDma(); // Also settles dmaStatus, which is sent with the registers
+        batch.clear();
+        uint32_t sentBefore = stats.pagesSent;
+        memory.forEachCopyPage(false, appendPage);
+        stats.finalPages = stats.pagesSent - sentBefore;
+        PersistentHeader header{};
+        memcpy(header.magic, PERSISTENT_MAGIC, sizeof(PERSISTENT_MAGIC));
+        header.version = PERSISTENT_VERSION;
+        header.pageSize = PAGE_SIZE;
+        saveState(header);
+        MigrationRecord state{MIGRATE_STATE, 0, 0, 0};
+        MigrationRecord done{MIGRATE_DONE, 0, 0, 0};
+        batch.insert(batch.end(), reinterpret_cast<uint8_t*>(&state), reinterpret_cast<uint8_t*>(&state) + sizeof(state));
+        batch.insert(batch.end(), reinterpret_cast<uint8_t*>(&header), reinterpret_cast<uint8_t*>(&header) + sizeof(header));
+        batch.insert(batch.end(), reinterpret_cast<uint8_t*>(&done), reinterpret_cast<uint8_t*>(&done) + sizeof(done));
+        uint8_t acknowledged = 0;
+        ok = ok && sendAll(fd, batch.data(), batch.size()) && receiveAll(fd, &acknowledged, 1) && acknowledged == MIGRATE_DONE;
+        stats.pauseMicroseconds = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - pauseStart).count();
+#if !defined(_WIN32)
+        ::close(fd);
+#endif
+        if (!ok) {
+            cerr << "Error: Migration over " << socketPath << " failed; the machine stays here" << endl;
+            return false;
+        }
+        halted = true;
+        return true;
+    }
+
+    /**
+     * Name: migrateFrom
+     * Purpouse: Take over a machine migrated from another emulator process.
+     * Inputs:
+     *   - socketPath: The Unix socket to listen on; blocks until the source connects.
+     * Outputs: True if a complete machine arrived.
+     * Effects: The machine is powered on fresh, then pages are installed as they stream in
+     *          and the register file is loaded at the end. The arrival state becomes the
+     *          reset baseline.
+     */
+    bool migrateFrom(const string& socketPath) {
+        int fd = connectUnixSocket(socketPath, true);
+        if (fd < 0) {
+            cerr << "Error: Could not listen on migration socket " << socketPath << endl;
+            return false;
+        }
+        reset();
+        vector<uint8_t> page(PAGE_SIZE);
+        PersistentHeader header{};
+        bool haveState = false;
+        bool ok = false;
+        MigrationRecord record;
+        while (receiveAll(fd, reinterpret_cast<uint8_t*>(&record), sizeof(record))) {
+            if (record.type == MIGRATE_PAGE && record.page < PAGE_COUNT && receiveAll(fd, page.data(), PAGE_SIZE)) {
+                memory.installPage(record.bank, record.page, page.data());
+            } else if (record.type == MIGRATE_STATE && receiveAll(fd, reinterpret_cast<uint8_t*>(&header), sizeof(header))) {
+                haveState = validPersistentHeader(header);
+            } else if (record.type == MIGRATE_DONE && haveState) {
+                loadState(header);
+                memory.markBaseline();
+                framebuffer.markDirty(0, FRAMEBUFFER_SIZE);
+                uint8_t acknowledge = MIGRATE_DONE;
+                ok = sendAll(fd, &acknowledge, 1);
+                break;
+            } else {
+                break;
+            }
+        }
+#if !defined(_WIN32)
+        ::close(fd);
+#endif
+        if (!ok) {
+            cerr << "Error: Incomplete migration stream on " << socketPath << endl;
+        }
+        return ok;
+    }
+
+    /**
+     * Name: encodeSnapshot
+     * Purpouse: Serialize the machine as a compressed snapshot.
+     * Inputs:
+     *   - out: Receives the snapshot (replaced).
+     * Outputs: None
+     * Effects: None on the machine (waits for DMA).
+     */
+    void encodeSnapshot(vector<uint8_t>& out) {
+        waitForDma();
+        out.assign(sizeof(SnapshotHeader), 0);
+        SnapshotHeader header{};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = PERSISTENT_VERSION;
+        header.baselineHash = memory.baselineHash();
+        memcpy(header.state.magic, PERSISTENT_MAGIC, sizeof(PERSISTENT_MAGIC));
+        header.state.version = PERSISTENT_VERSION;
+        header.state.pageSize = PAGE_SIZE;
+        saveState(header.state);
+        vector<uint8_t> delta(PAGE_SIZE);
+        memory.forEachSnapshotPage([&](uint8_t bank, uint32_t page, const uint8_t* current, const uint8_t* base) {
+            if (current && base && memcmp(current, base, PAGE_SIZE) == 0) {
+                return;
+            }
+            SnapshotPage record{bank, static_cast<uint8_t>(page), 0, 0, 0};
+            const uint8_t* data = current;
+            if (!current) {
+                record.flags = SNAPSHOT_ZERO;
+            } else if (base) {
+                for (uint32_t i = 0; i < PAGE_SIZE; i += 8) {
+                    uint64_t a;
+                    uint64_t b;
+                    memcpy(&a, current + i, sizeof(a));
+                    memcpy(&b, base + i, sizeof(b));
+                    a ^= b;
+                    memcpy(delta.data() + i, &a, sizeof(a));
+                }
+                data = delta.data();
+                record.flags = SNAPSHOT_DELTA;
+            }
+            size_t recordAt = out.size();
+            out.resize(recordAt + sizeof(record));
+            if (data) {
+                lzCompress(data, PAGE_SIZE, out);
+                record.length = static_cast<uint32_t>(out.size() - recordAt - sizeof(record));
+                if (record.length >= PAGE_SIZE) {
+                    out.resize(recordAt + sizeof(record));
+                    out.insert(out.end(), data, data + PAGE_SIZE);
+                    record.length = PAGE_SIZE;
+                } else {
+                    record.flags |= SNAPSHOT_LZ;
+                }
+            }
+            memcpy(out.data() + recordAt, &record, sizeof(record));
+            header.pages++;
+        });
+        memcpy(out.data(), &header, sizeof(header));
+    }
+
+    /**
+     * Name: decodeSnapshot
+     * Purpouse: Restore the machine from a snapshot made by encodeSnapshot.
+     * Inputs:
+     *   - data: The snapshot.
+     *   - length: Its length.
+     * Outputs: False if the snapshot is malformed or was taken against a different loaded
+     *          program (an error message is printed).
+     * Effects: Every page is decoded and checked first, so a malformed snapshot leaves the
+     *          machine untouched. Memory is then returned to the reset baseline, the stored
+     *          pages are applied and the register file loaded. Open files are closed.
+     */
+    bool decodeSnapshot(const uint8_t* data, size_t length) {
+        SnapshotHeader header;
+        if (length < sizeof(header)) {
+            cerr << "Error: Snapshot is truncated" << endl;
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header.version != PERSISTENT_VERSION ||
+            !validPersistentHeader(header.state)) {
+            cerr << "Error: Not a snapshot from this emulator" << endl;
+            return false;
+        }
+        if (header.baselineHash != memory.baselineHash()) {
+            cerr << "Error: Snapshot was taken against a different program; load that program first" << endl;
+            return false;
+        }
+        size_t offset = sizeof(header);
+        vector<SnapshotPage> records;   // Staged pages, applied once all have decoded
+        vector<uint8_t> staged;         // PAGE_SIZE bytes per record
+        vector<uint8_t> scratch(PAGE_SIZE);
+        for (uint32_t i = 0; i < header.pages; i++) {
+            SnapshotPage record;
+            if (length - offset < sizeof(record)) {
+                cerr << "Error: Snapshot is truncated" << endl;
+                return false;
+            }
+            memcpy(&record, data + offset, sizeof(record));
+            offset += sizeof(record);
+            bool window = record.page >= BANK_WINDOW_FIRST_PAGE && record.page < BANK_WINDOW_FIRST_PAGE + BANK_WINDOW_PAGES;
+            bool ok = record.page < PAGE_COUNT && (record.bank == 0 || window) && record.length <= length - offset;
+            staged.resize(staged.size() + PAGE_SIZE);
+            uint8_t* page = staged.data() + staged.size() - PAGE_SIZE;
+            if (ok && (record.flags & SNAPSHOT_ZERO)) {
+                memset(page, 0, PAGE_SIZE);
+            } else if (ok && (record.flags & SNAPSHOT_LZ)) {
+                ok = lzDecompress(data + offset, record.length, page, PAGE_SIZE);
+            } else if (ok) {
+                ok = record.length == PAGE_SIZE;
+                memcpy(page, data + offset, ok ? PAGE_SIZE : 0);
+            }
+            if (ok && (record.flags & SNAPSHOT_DELTA)) {
+                const uint8_t* base = memory.baselineContent(record.bank, record.page, scratch.data());
+                for (uint32_t j = 0; base && j < PAGE_SIZE; j++) {
+                    page[j] ^= base[j];
+                }
+            }
+            if (!ok) {
+                cerr << "Error: Snapshot page " << i << " is corrupt" << endl;
+                return false;
+            }
+            records.push_back(record);
+            offset += record.length;
+        }
+        restart();
+        for (size_t i = 0; i < records.size(); i++) {
+            memory.installPage(records[i].bank, records[i].page, staged.data() + i * PAGE_SIZE);
+        }
+        loadState(header.state);
+        return true;
+    }
+
+    /**
+     * Name: reset
+     * Purpouse: Return the machine to its power-on state.
+     * Inputs: None
+     * Outputs: None
+     * Effects: Clears registers, stack, interrupt, timer, DMA, bank and file state. Memory is
+     *          cleared by unmapping only the pages that were written. Configuration (PID,
+     *          syscall table, sandbox root, network attachment, tracing) is kept.
+     */
+    void reset() {
+        waitForDma();
+        memory.clear();
+        restart();
+    }
+
+    /**
+     * Name: restart
+     * Purpouse: Return the machine to the state right after the last program load.
+     * Inputs: None
+     * Outputs: The number of memory pages that had to be restored.
+     * Effects: Resets registers, stack, interrupt, timer, DMA and file state like reset(), but
+     *          memory goes back to its post-load contents. Only pages written since the load
+     *          are copied, so rerunning a program costs about as much as the pages it dirtied.
+     */
+    uint32_t restart() {
+        waitForDma();
+        dmaStatus.store(DMA_IDLE);
+        reg_A = 0;
+        reg_B = 0;
+        pc = USER_PROGRAM_START_ADDRESS;
+        sp = 0;
+        stack.fill(0);
+        privileged = false;
+        instructionCount = 0;
+        interruptPending.store(0);
+        interruptMask = 0xFF;
+        inInterrupt = false;
+        timerInterval = 0;
+        timerDeadline = UINT64_MAX;
+        halted = false;
+        files.closeAll();
+        uint32_t restored = memory.restoreBaseline();
+        framebuffer.markDirty(0, FRAMEBUFFER_SIZE);
+        return restored;
+    }
+
+    /**
+     * Name: run
+     * Purpouse: Execute up to a fixed budget of instructions.
+     * Inputs:
+     *   - budget: The maximum number of instructions to execute.
+     * Outputs: The number of instructions executed.
+     * Effects: Sets halted when the program stops, so schedulers can run machines in slices.
+     */
+    uint64_t run(uint64_t budget) {
+        uint64_t executed = 0;
+        while (!halted && executed < budget) {
+            if (!step()) {
+                halted = true;
+            }
+            executed++;
+        }
+        return executed;
+    }
+
+    /**
+     * Name: raiseInterrupt
+     * Purpouse: Mark an interrupt line as pending.
+     * Inputs:
+     *   - line: The interrupt line to raise.
+     * Outputs: None
+     * Effects: The interrupt is delivered at the next block boundary where it is unmasked.
+     *          Safe to call from device threads.
+     */
+    void raiseInterrupt(uint8_t line) {
+        interruptPending.fetch_or(static_cast<uint8_t>(1u << line), memory_order_release);
+    }
+
+    /**
+     * Name: setInterruptVector
+     * Purpouse: Install a handler address in the kernel's interrupt vector table.
+     * Inputs:
+     *   - line: The interrupt line.
+     *   - handler: The handler address, or 0 to drop interrupts on the line.
+     * Outputs: None
+     * Effects: Writes the vector table entry in kernel memory.
+     */
+    void setInterruptVector(uint8_t line, uint16_t handler) {
+        writeWord(INTERRUPT_VECTOR_TABLE + 2 * line, handler);
+    }
+
+    /**
+     * Name: serviceInterrupts
+     * Purpouse: Deliver the highest-priority pending interrupt at a block boundary.
+     * Inputs: None
+     * Outputs: None
+     * Effects: Fires the interval timer if it has expired, then, unless a handler is already
+     *          running, saves the register context and jumps to the vector in privileged mode.
+     *          IRQ_NET is skipped while its packets are still in flight, so it never holds
+     *          back a lower-priority line.
+     */
+    void serviceInterrupts() {
+        if (instructionCount >= timerDeadline) {
+            timerDeadline = instructionCount + timerInterval;
+            raiseInterrupt(IRQ_TIMER);
+        }
+        uint8_t deliverable = interruptPending.load(memory_order_acquire) & ~interruptMask;
+        if ((deliverable & (1u << IRQ_NET)) && network && !network->hasDeliverable(pid)) {
+            deliverable &= ~(1u << IRQ_NET); // Packets are still in flight; stay pending until one lands
+        }
+        if (deliverable == 0 || inInterrupt) {
+            return;
+        }
+        uint8_t line = 0;
+        while (!(deliverable & (1u << line))) {
+            line++;
+        }
+        interruptPending.fetch_and(static_cast<uint8_t>(~(1u << line)), memory_order_acq_rel);
+        uint16_t handler = readWord(INTERRUPT_VECTOR_TABLE + 2 * line);
+        if (handler == 0) {
+            return;
+        }
+        savedPc = pc;
+        savedA = reg_A;
+        savedB = reg_B;
+        savedPrivileged = privileged;
+        inInterrupt = true;
+        privileged = true;
+        pc = handler;
+        if (trace) cout << "[IRQ " << (int)line << " -> 0x" << hex << handler << dec << "]" << endl;
+    }
+
+    /**
+     * Name: startDma
+     * Purpouse: Begin a DMA transfer.
+     * Inputs:
+     *   - request: The decoded DMA control block.
+     * Outputs: True if the transfer was accepted (it may still fail later).
+     * Effects: Performs the copy immediately, or on a helper thread when DMA_FLAG_ASYNC is
+     *          set. On completion dmaStatus becomes DMA_DONE or DMA_FAILED and IRQ_DMA is
+     *          raised if requested.
+     */
+    bool startDma(const DmaRequest& request) {
+        if (dmaStatus.load(memory_order_acquire) == DMA_BUSY) {
+            return false;
+        }
+        waitForDma();
+        DmaTransfer transfer = resolveDma(request);
+        dmaStatus.store(DMA_BUSY, memory_order_release);
+        if (request.flags & DMA_FLAG_ASYNC) {
+            dmaThread = thread([this, transfer = move(transfer)] { completeDma(transfer); });
+        } else {
+            completeDma(transfer);
+        }
+        return true;
+    }
+
+    /**
+     * Name: waitForDma
+     * Purpouse: Block until any in-flight DMA transfer has finished.
+     * Inputs: None
+     * Outputs: None
+     * Effects: Joins the DMA helper thread.
+     */
+    void waitForDma() {
+        if (dmaThread.joinable()) {
+            dmaThread.join();
+        }
+    }
+
+    /**
+     * Name: dispatchSyscall
+     * Purpouse: Perform the work of a single system call through the syscall table.
+     * Inputs:
+     *   - number: The syscall number.
+     *   - argument: The syscall argument (reg_B for a direct SYSCALL).
+     * Outputs: The syscall result, which is written back to reg_B or to the completion ring.
+     * Effects: May perform I/O. Output is not flushed here so batches can flush once.
+     */
+    uint8_t dispatchSyscall(uint8_t number, uint8_t argument) {
+        const SyscallFunction& handler = syscalls->lookup(number);
+        if (!handler) {
+            cerr << "Error: Unknown syscall number: " << (int)number << endl;
+            return argument;
+        }
+        return handler(*this, argument);
+    }
+
+    /**
+     * Name: processSyscallRing
+     * Purpouse: Service every pending request in a syscall submission ring.
+     * Inputs:
+     *   - base: The zero-page address of the ring header.
+     * Outputs: The number of requests completed.
+     * Effects: Consumes submission entries, posts one completion per request and advances
+     *          sq_head/cq_tail. Stops early if the completion ring is full.
+     */
+    uint8_t processSyscallRing(uint8_t base) {
+        if (base + SYSCALL_RING_HEADER_SIZE + 4 * SYSCALL_RING_ENTRIES > 0x100) {
+            cerr << "Error: Syscall ring at 0x" << hex << (int)base << dec << " does not fit in the zero page." << endl;
+            return 0;
+        }
+        uint8_t sqHead = memory[base];
+        uint8_t sqTail = memory[base + 1];
+        uint8_t cqHead = memory[base + 2];
+        uint8_t cqTail = memory[base + 3];
+        uint16_t sqEntries = base + SYSCALL_RING_HEADER_SIZE;
+        uint16_t cqEntries = sqEntries + 2 * SYSCALL_RING_ENTRIES;
+
+        uint8_t completed = 0;
+        while (sqHead != sqTail && static_cast<uint8_t>(cqTail - cqHead) < SYSCALL_RING_ENTRIES) {
+            uint16_t sqe = sqEntries + 2 * (sqHead % SYSCALL_RING_ENTRIES);
+            uint8_t number = memory[sqe];
+            uint8_t argument = memory[sqe + 1];
+            uint8_t result;
+            if (static_cast<SyscallNumber>(number) == SyscallNumber::SUBMIT_RING) {
+                cerr << "Error: SUBMIT_RING cannot be queued on a syscall ring." << endl;
+                result = 0xFF;
+            } else {
+                result = dispatchSyscall(number, argument);
+            }
+            uint16_t cqe = cqEntries + 2 * (cqTail % SYSCALL_RING_ENTRIES);
+            memory.write(cqe, number);
+            memory.write(cqe + 1, result);
+            sqHead++;
+            cqTail++;
+            completed++;
+        }
+        memory.write(base, sqHead);
+        memory.write(base + 3, cqTail);
+        return completed;
+    }
+
+    /**
+     * Name: syscallHandler
+     * Purpouse: Handle system calls made by user programs.
+     * Inputs: None (uses CPU registers)
+     * Outputs: None (modifies CPU registers and may perform I/O)
+     * Effects: Executes the system call specified in reg_A, using reg_B as an argument or return value.
+     *          A SUBMIT_RING doorbell services a whole batch under a single privileged transition.
+     */
+    void syscallHandler() {
+        bool wasPrivileged = privileged; // Interrupt handlers already run privileged
+        privileged = true;
+        reg_B = dispatchSyscall(reg_A, reg_B);
+        cout.flush();
+        privileged = wasPrivileged;
+    }
+
+    /**
+     * Name: step
+     * Purpouse: Execute a single instruction at the current program counter (pc).
+     * Inputs: None (uses CPU registers and memory)
+     * Outputs: Returns true if execution should continue, false if HALT is encountered or an error occurs.
+     * Effects: Modifies CPU registers and memory based on the executed instruction. With a
+     *          state file attached, the register file in the file is updated as well, so a
+     *          restart resumes after the last completed instruction.
+     */
+    bool step() {
+        bool continuing = execute();
+        if (!continuing) {
+            halted = true;
+        }
+        if (stateFile) {
+            saveState(stateFile->header());
+            if (checkpointInterval != 0 && instructionCount >= nextCheckpoint) {
+                checkpoint();
+            }
+        }
+        return continuing;
+    }
+
+private:
+    /**
+     * Name: execute
+     * Purpouse: Fetch, decode and execute one instruction (the body of step()).
+     * Inputs: None
+     * Outputs: True if execution should continue.
+     * Effects: See step().
+     */
+    bool execute() {
+        if (pc >= memory.size()) {
+            cerr << "Error: Program Counter out of bounds. Halting." << endl;
+            return false;
+        }
+        
+        uint8_t instruction = memory[pc];
+        if (!profile.empty()) {
+            profile[pc]++;
+        }
+        pc++;
+        instructionCount++;
+        if (trace) cout << "[PC: 0x" << hex << (pc - 1) << "] ";
+
+        switch (instruction) {
+            case LOAD_A: {
+                uint8_t value = memory[pc++];
+                reg_A = value;
+                if (trace) cout << "LOAD_A " << (int)value << endl;
+                break;
+            }
+            case LOAD_B: {
+                uint8_t value = memory[pc++];
+                reg_B = value;
+                if (trace) cout << "LOAD_B " << (int)value << endl;
+                break;
+            }
+            case STORE_A: {
+                uint16_t address = memory[pc++];
+                memory.write(address, reg_A);
+                if (trace) cout << "STORE_A at 0x" << hex << address << dec << endl;
+                break;
+            }
+            case STORE_A_MEM: {
+                uint16_t address = memory[pc] | (memory[static_cast<uint16_t>(pc + 1)] << 8);
+                pc += 2;
+                if (!writeMemory(address, reg_A)) {
+                    cerr << "Error: Write to read-only vDSO page at 0x" << hex << address << dec << ". Halting." << endl;
+                    return false;
+                }
+                if (trace) cout << "STORE_A_MEM at 0x" << hex << address << dec << endl;
+                break;
+            }
+            case LOAD_A_MEM: {
+                uint16_t address = memory[pc] | (memory[static_cast<uint16_t>(pc + 1)] << 8);
+                pc += 2;
+                reg_A = readMemory(address);
+                if (trace) cout << "LOAD_A_MEM from 0x" << hex << address << dec << " -> A=" << (int)reg_A << endl;
+                break;
+            }
+            case LOAD_B_MEM: {
+                uint16_t address = memory[pc] | (memory[static_cast<uint16_t>(pc + 1)] << 8);
+                pc += 2;
+                reg_B = readMemory(address);
+                if (trace) cout << "LOAD_B_MEM from 0x" << hex << address << dec << " -> B=" << (int)reg_B << endl;
+                break;
+            }
+            case ADD_A_B: {
+                reg_A = reg_A + reg_B;
+                if (trace) cout << "ADD_A_B -> A=" << (int)reg_A << endl;
+                break;
+            }
+            case SUB_A_B: {
+                reg_A = reg_A - reg_B;
+                if (trace) cout << "SUB_A_B -> A=" << (int)reg_A << endl;
+                break;
+            }
+            case PUSH_B: {
+                if (sp < stack.size()) {
+                    stack[sp++] = reg_B;
+                    if (trace) cout << "PUSH_B" << endl;
+                }
+                break;
+            }
+            case POP_B: {
+                if (sp > 0) {
+                    reg_B = stack[--sp];
+                    if (trace) cout << "POP_B" << endl;
+                }
+                break;
+            }
+            case JMP: {
+                uint16_t address = memory[pc++];
+                pc = address;
+                if (trace) cout << "JMP to 0x" << hex << address << dec << endl;
+                serviceInterrupts();
+                break;
+            }
+            case JZ:
+            case JNZ: {
+                uint16_t address = memory[pc++];
+                bool taken = (reg_A == 0) == (instruction == JZ);
+                if (taken) {
+                    pc = address;
+                }
+                if (trace) cout << (instruction == JZ ? "JZ" : "JNZ") << " to 0x" << hex << address << dec << (taken ? " (taken)" : "") << endl;
+                serviceInterrupts();
+                break;
+            }
+            case SYSCALL: {
+                if (trace) cout << "SYSCALL" << endl;
+                syscallHandler();
+                serviceInterrupts();
+                break;
+            }
+            case IRET: {
+                if (!inInterrupt) {
+                    cerr << "Error: IRET outside of an interrupt handler." << endl;
+                    return false;
+                }
+                pc = savedPc;
+                reg_A = savedA;
+                reg_B = savedB;
+                privileged = savedPrivileged;
+                inInterrupt = false;
+                if (trace) cout << "IRET to 0x" << hex << pc << dec << endl;
+                serviceInterrupts();
+                break;
+            }
+            case HALT: {
+                if (trace) cout << "HALT" << endl;
+                return false;
+            }
+            default: {
+                cerr << "Unknown instruction: 0x" << hex << (int)instruction << dec << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    /**
+     * Name: dumpState
+     * Purpouse: Print the current state of the CPU registers and flags.
+     * Inputs: None
+     * Outputs: None (prints to standard output)
+     * Effects: Displays the values of registers A, B, PC, SP, and privileged mode status.
+     */
+    void dumpState() {
+        cout << "--- CPU State ---" << endl;
+        cout << "A: " << (int)reg_A << ", B: " << (int)reg_B << endl;
+        cout << "PC: 0x" << hex << pc << dec << ", SP: 0x" << hex << sp << dec << endl;
+        cout << "Privileged: " << (privileged ? "Yes" : "No") << endl;
+        cout << "Instructions: " << instructionCount << ", Bank: " << (int)memory.bank()
+             << ", Pages allocated: " << memory.pagesAllocated() << " (" << memory.bankPagesAllocated() << " banked), " << memory.dirtyPageCount() << " dirty since load" << endl;
+        if (memory.imagePages()) {
+            cout << "Image pages resident: " << memory.imagePagesResident() << "/" << memory.imagePages() << endl;
+        }
+        cout << "Interrupts: pending 0x" << hex << (int)interruptPending.load() << ", mask 0x" << (int)interruptMask
+             << dec << (inInterrupt ? " (in handler)" : "") << endl;
+        cout << "-----------------" << endl;
+    }
+
+private:
+    /**
+     * Name: resolveDma
+     * Purpouse: Check a DMA request and resolve its memory to host spans, on the CPU thread.
+     * Inputs:
+     *   - request: The decoded DMA control block.
+     * Outputs: The transfer; not valid if a range or the file descriptor is bad.
+     * Effects: Allocates the destination pages in the current bank and marks them dirty, and
+     *          marks the destination in the framebuffer as changed.
+     */
+    DmaTransfer resolveDma(const DmaRequest& request) {
+        DmaTransfer transfer;
+        transfer.request = request;
+        bool fromMemory = request.mode != DmaMode::FILE_TO_MEMORY;
+        bool toMemory = request.mode != DmaMode::MEMORY_TO_FILE;
+        if ((fromMemory && request.source + request.length > memory.size()) ||
+            (toMemory && !isWritableRange(request.dest, request.length))) {
+            return transfer;
+        }
+        if (request.mode != DmaMode::MEMORY_TO_MEMORY) {
+            transfer.stream = files.get(request.fd);
+            if (!transfer.stream) {
+                return transfer;
+            }
+        }
+        if (fromMemory) {
+            memory.forEachSpan(request.source, request.length, [&](const uint8_t* data, uint32_t chunk) {
+                transfer.source.emplace_back(data, chunk);
+                return true;
+            });
+        }
+        if (toMemory) {
+            memory.forEachWritableSpan(request.dest, request.length, [&](uint8_t* data, uint32_t chunk) {
+                transfer.dest.emplace_back(data, chunk);
+                return true;
+            });
+            noteWritten(request.dest, request.length);
+            dmaFrameAddress = request.dest;
+            dmaFrameLength = request.length;
+        }
+        transfer.valid = true;
+        return transfer;
+    }
+
+    /**
+     * Name: completeDma
+     * Purpouse: Carry out a DMA transfer and publish its completion.
+     * Inputs:
+     *   - transfer: The transfer to perform, resolved by resolveDma().
+     * Outputs: None
+     * Effects: Copies between memory and memory or a sandboxed file through the transfer's
+     *          host spans only, then updates dmaStatus and optionally raises IRQ_DMA. Safe to
+     *          run on the helper thread.
+     */
+    void completeDma(const DmaTransfer& transfer) {
+        bool ok = transfer.valid;
+        const DmaRequest& request = transfer.request;
+        if (ok && request.mode == DmaMode::MEMORY_TO_MEMORY) {
+            vector<uint8_t> staging; // Source and destination may overlap
+            staging.reserve(request.length);
+            for (const auto& span : transfer.source) {
+                staging.insert(staging.end(), span.first, span.first + span.second);
+            }
+            const uint8_t* in = staging.data();
+            for (const auto& span : transfer.dest) {
+                memcpy(span.first, in, span.second);
+                in += span.second;
+            }
+        } else if (ok && request.mode == DmaMode::FILE_TO_MEMORY) {
+            transfer.stream->clear();
+            for (const auto& span : transfer.dest) {
+                transfer.stream->read(reinterpret_cast<char*>(span.first), span.second);
+                if (transfer.stream->gcount() != static_cast<streamsize>(span.second)) {
+                    break;
+                }
+            }
+            ok = !transfer.stream->bad();
+        } else if (ok) {
+            transfer.stream->clear();
+            for (const auto& span : transfer.source) {
+                if (!transfer.stream->write(reinterpret_cast<const char*>(span.first), span.second)) {
+                    break;
+                }
+            }
+            ok = transfer.stream->good();
+        }
+        dmaStatus.store(ok ? DMA_DONE : DMA_FAILED, memory_order_release);
+        if (request.flags & DMA_FLAG_INTERRUPT) {
+            raiseInterrupt(IRQ_DMA);
+        }
+    }
+
+    /**
+     * Name: saveState
+     * Purpouse: Copy the register file, stack and interrupt state into a state file header.
+     * Inputs:
+     *   - header: The header to fill.
+     * Outputs: None
+     * Effects: None on the CPU.
+     */
+    void saveState(PersistentHeader& header) const {
+        header.instructionCount = instructionCount;
+        header.timerInterval = timerInterval;
+        header.timerDeadline = timerDeadline;
+        header.pc = pc;
+        header.sp = sp;
+        header.savedPc = savedPc;
+        header.reg_A = reg_A;
+        header.reg_B = reg_B;
+        header.privileged = privileged;
+        header.halted = halted;
+        header.bank = memory.bank();
+        header.interruptMask = interruptMask;
+        header.interruptPending = interruptPending.load(memory_order_relaxed);
+        header.inInterrupt = inInterrupt;
+        header.savedA = savedA;
+        header.savedB = savedB;
+        header.savedPrivileged = savedPrivileged;
+        memcpy(header.stack, stack.data(), stack.size());
+    }
+
+    /**
+     * Name: loadState
+     * Purpouse: Take the register file, stack and interrupt state from a state file header.
+     * Inputs:
+     *   - header: The header to read.
+     * Outputs: None
+     * Effects: Replaces the CPU state and selects the saved bank.
+     */
+    void loadState(const PersistentHeader& header) {
+        instructionCount = header.instructionCount;
+        timerInterval = header.timerInterval;
+        timerDeadline = header.timerDeadline;
+        pc = header.pc;
+        sp = header.sp;
+        savedPc = header.savedPc;
+        reg_A = header.reg_A;
+        reg_B = header.reg_B;
+        privileged = header.privileged != 0;
+        halted = header.halted != 0;
+        memory.selectBank(header.bank);
+        interruptMask = header.interruptMask;
+        interruptPending.store(header.interruptPending);
+        inInterrupt = header.inInterrupt != 0;
+        savedA = header.savedA;
+        savedB = header.savedB;
+        savedPrivileged = header.savedPrivileged != 0;
+        memcpy(stack.data(), header.stack, stack.size());
+    }
+
+    uint64_t nextCheckpoint = 0;
+    uint16_t savedPc = 0;
+    uint8_t savedA = 0;
+    uint8_t savedB = 0;
+    bool savedPrivileged = false;
+    chrono::steady_clock::time_point bootTime;
+    uint64_t rngState;
+};
+
+/**
+ * Name: fileControlBlock
+ * Purpouse: Validate the zero-page address of a file control block.
+ * Inputs:
+ *   - base: The FCB address passed in reg_B.
+ * Outputs: True if the whole FCB fits in the zero page.
+ * Effects: None
+ */
+bool fileControlBlock(uint8_t base) {
+    return base + FCB_SIZE <= 0x100;
+}
+
+/**
+ * Name: fileOpenSyscall
+ * Purpouse: FILE_OPEN - open the NUL-terminated path at FCB_BUFFER with FCB_MODE.
+ * Inputs:
+ *   - cpu: The calling CPU.
+ *   - fcb: The zero-page address of the file control block.
+ * Outputs: 0 on success with the descriptor in FCB_FD, SYSCALL_ERROR otherwise.
+ * Effects: Opens a host file inside the sandbox.
+ */
+uint8_t fileOpenSyscall(CPU& cpu, uint8_t fcb) {
+    if (!fileControlBlock(fcb)) {
+        return SYSCALL_ERROR;
+    }
+    string path;
+    for (uint32_t address = cpu.readWord(fcb + FCB_BUFFER); address < cpu.memory.size() && cpu.memory[address]; address++) {
+        path.push_back(static_cast<char>(cpu.memory[address]));
+    }
+    int fd = cpu.files.open(path, static_cast<FileMode>(cpu.memory[fcb + FCB_MODE]));
+    if (fd < 0) {
+        cerr << "Error: Could not open '" << path << "' in the file sandbox." << endl;
+        return SYSCALL_ERROR;
+    }
+    cpu.memory.write(fcb + FCB_FD, static_cast<uint8_t>(fd));
+    return 0;
+}
+
+/**
+ * Name: fileReadSyscall
+ * Purpouse: FILE_READ - read up to FCB_LENGTH bytes straight into memory at FCB_BUFFER.
+ * Inputs:
+ *   - cpu: The calling CPU.
+ *   - fcb: The zero-page address of the file control block.
+ * Outputs: 0 on success with the byte count in FCB_COUNT, SYSCALL_ERROR otherwise.
+ * Effects: Copies file data directly into the program's memory range.
+ */
+uint8_t fileReadSyscall(CPU& cpu, uint8_t fcb) {
+    cpu.waitForDma(); // A transfer in flight may be using the same stream
+    fstream* stream = fileControlBlock(fcb) ? cpu.files.get(cpu.memory[fcb + FCB_FD]) : nullptr;
+    uint16_t buffer = cpu.readWord(fcb + FCB_BUFFER);
+    uint16_t length = cpu.readWord(fcb + FCB_LENGTH);
+    if (!stream || !cpu.isWritableRange(buffer, length)) {
+        return SYSCALL_ERROR;
+    }
+    uint32_t count = cpu.readStream(*stream, buffer, length);
+    cpu.noteWritten(buffer, count);
+    cpu.writeWord(fcb + FCB_COUNT, static_cast<uint16_t>(count));
+    return stream->bad() ? SYSCALL_ERROR : 0;
+}
+
+/**
+ * Name: fileWriteSyscall
+ * Purpouse: FILE_WRITE - write FCB_LENGTH bytes from memory at FCB_BUFFER.
+ * Inputs:
+ *   - cpu: The calling CPU.
+ *   - fcb: The zero-page address of the file control block.
+ * Outputs: 0 on success with the byte count in FCB_COUNT, SYSCALL_ERROR otherwise.
+ * Effects: Writes into the file's host-side buffer, which is flushed in large blocks.
+ */
+uint8_t fileWriteSyscall(CPU& cpu, uint8_t fcb) {
+    cpu.waitForDma(); // A transfer in flight may be using the same stream
+    fstream* stream = fileControlBlock(fcb) ? cpu.files.get(cpu.memory[fcb + FCB_FD]) : nullptr;
+    uint16_t buffer = cpu.readWord(fcb + FCB_BUFFER);
+    uint16_t length = cpu.readWord(fcb + FCB_LENGTH);
+    if (!stream || buffer + length > cpu.memory.size()) {
+        return SYSCALL_ERROR;
+    }
+    bool ok = cpu.writeStream(*stream, buffer, length);
+    cpu.writeWord(fcb + FCB_COUNT, ok ? length : 0);
+    return ok ? 0 : SYSCALL_ERROR;
+}
+
+/**
+ * Name: fileCloseSyscall
+ * Purpouse: FILE_CLOSE - flush and release the descriptor in FCB_FD.
+ * Inputs:
+ *   - cpu: The calling CPU.
+ *   - fcb: The zero-page address of the file control block.
+ * Outputs: 0 on success, SYSCALL_ERROR for an unknown descriptor.
+ * Effects: Closes the host file.
+ */
+uint8_t fileCloseSyscall(CPU& cpu, uint8_t fcb) {
+    cpu.waitForDma(); // A transfer in flight may be using the same stream
+    if (!fileControlBlock(fcb) || !cpu.files.close(cpu.memory[fcb + FCB_FD])) {
+        return SYSCALL_ERROR;
+    }
+    return 0;
+}
+
+/**
+ * Name: fileSeekSyscall
+ * Purpouse: FILE_SEEK - move the file position by FCB_OFFSET relative to FCB_MODE.
+ * Inputs:
+ *   - cpu: The calling CPU.
+ *   - fcb: The zero-page address of the file control block.
+ * Outputs: 0 on success with the new position in FCB_OFFSET, SYSCALL_ERROR otherwise.
+ * Effects: Repositions the host file.
+ */
+uint8_t fileSeekSyscall(CPU& cpu, uint8_t fcb) {
+    cpu.waitForDma(); // A transfer in flight may be using the same stream
+    fstream* stream = fileControlBlock(fcb) ? cpu.files.get(cpu.memory[fcb + FCB_FD]) : nullptr;
+    uint8_t whence = fileControlBlock(fcb) ? cpu.memory[fcb + FCB_MODE] : 0;
+    if (!stream || whence > 2) {
+        return SYSCALL_ERROR;
+    }
+    uint32_t offset = cpu.readWord(fcb + FCB_OFFSET) | (static_cast<uint32_t>(cpu.readWord(fcb + FCB_OFFSET + 2)) << 16);
+    const ios::seekdir directions[] = {ios::beg, ios::cur, ios::end};
+    stream->clear();
+    stream->seekg(static_cast<int32_t>(offset), directions[whence]);
+    streampos position = stream->tellg();
+    if (!*stream || position < 0) {
+        return SYSCALL_ERROR;
+    }
+    uint32_t newOffset = static_cast<uint32_t>(position);
+    cpu.writeWord(fcb + FCB_OFFSET, static_cast<uint16_t>(newOffset));
+    cpu.writeWord(fcb + FCB_OFFSET + 2, static_cast<uint16_t>(newOffset >> 16));
+    return 0;
+}
+
+/**
+ * Name: setInterruptVectorSyscall
+ * Purpouse: SET_INTERRUPT_VECTOR - install a handler from a zero-page block {line, address}.
+ * Inputs:
+ *   - cpu: The calling CPU.
+ *   - block: The zero-page address of the line byte, followed by the 16-bit handler address.
+ * Outputs: 0 on success, SYSCALL_ERROR for an invalid line.
+ * Effects: Writes the kernel's vector table on the program's behalf.
+ */
+uint8_t setInterruptVectorSyscall(CPU& cpu, uint8_t block) {
+    uint8_t line = cpu.memory[block];
+    if (line >= INTERRUPT_LINES || block > 0xFD) {
+        return SYSCALL_ERROR;
+    }
+    cpu.setInterruptVector(line, cpu.readWord(block + 1));
+    return 0;
+}
+
+/**
+ * Name: dmaStartSyscall
+ * Purpouse: DMA_START - decode a DMA control block and hand it to the DMA controller.
+ * Inputs:
+ *   - cpu: The calling CPU.
+ *   - block: The zero-page address of the DMA control block.
+ * Outputs: 0 if the transfer started, SYSCALL_ERROR if the block is invalid or DMA is busy.
+ * Effects: Starts a host-side transfer.
+ */
+uint8_t dmaStartSyscall(CPU& cpu, uint8_t block) {
+    if (block + DMA_BLOCK_SIZE > 0x100) {
+        return SYSCALL_ERROR;
+    }
+    uint8_t mode = cpu.memory[block + DMA_MODE];
+    DmaRequest request;
+    request.mode = static_cast<DmaMode>(mode & 0x0F);
+    request.flags = mode & (DMA_FLAG_ASYNC | DMA_FLAG_INTERRUPT);
+    request.fd = cpu.memory[block + DMA_FD];
+    request.source = cpu.readWord(block + DMA_SOURCE);
+    request.dest = cpu.readWord(block + DMA_DEST);
+    request.length = cpu.readWord(block + DMA_LENGTH);
+    if (request.mode > DmaMode::MEMORY_TO_FILE || !cpu.startDma(request)) {
+        return SYSCALL_ERROR;
+    }
+    return 0;
+}
+
+/**
+ * Name: netTransmitSyscall
+ * Purpouse: NET_TRANSMIT - send every packet queued on the NIC's TX ring.
+ * Inputs:
+ *   - cpu: The calling CPU.
+ *   - ring: The zero-page address of the NIC rings.
+ * Outputs: The number of packets accepted by the network, or SYSCALL_ERROR without a NIC
+ *          or when tx_tail is more than NET_RING_ENTRIES ahead of tx_head.
+ * Effects: Copies each payload out of memory and advances tx_head.
+ */
+uint8_t netTransmitSyscall(CPU& cpu, uint8_t ring) {
+    if (!cpu.network || ring + NET_RING_SIZE > 0x100) {
+        return SYSCALL_ERROR;
+    }
+    uint8_t txHead = cpu.memory[ring];
+    uint8_t txTail = cpu.memory[ring + 1];
+    if (static_cast<uint8_t>(txTail - txHead) > NET_RING_ENTRIES) {
+        return SYSCALL_ERROR; // More packets queued than the ring has descriptors
+    }
+    uint8_t accepted = 0;
+    array<uint8_t, 255> payload;
+    for (; txHead != txTail; txHead++) {
+        uint16_t descriptor = ring + NET_RING_HEADER_SIZE + NET_DESCRIPTOR_SIZE * (txHead % NET_RING_ENTRIES);
+        uint8_t length = cpu.memory[descriptor + 1];
+        uint16_t buffer = cpu.readWord(descriptor + 2);
+        if (buffer + length > cpu.memory.size()) {
+            continue;
+        }
+        cpu.memory.read(buffer, payload.data(), length);
+        if (cpu.network->send(cpu.pid, cpu.memory[descriptor], payload.data(), length)) {
+            accepted++;
+        }
+    }
+    cpu.memory.write(ring, txHead);
+    return accepted;
+}
+
+/**
+ * Name: netReceiveSyscall
+ * Purpouse: NET_RECEIVE - move delivered packets into free RX ring slots.
+ * Inputs:
+ *   - cpu: The calling CPU.
+ *   - ring: The zero-page address of the NIC rings.
+ * Outputs: The number of packets received, or SYSCALL_ERROR without a NIC.
+ * Effects: Copies payloads into the RX buffers, fills in source and length, advances rx_tail.
+ */
+uint8_t netReceiveSyscall(CPU& cpu, uint8_t ring) {
+    if (!cpu.network || ring + NET_RING_SIZE > 0x100) {
+        return SYSCALL_ERROR;
+    }
+    uint8_t rxHead = cpu.memory[ring + 2];
+    uint8_t rxTail = cpu.memory[ring + 3];
+    uint8_t received = 0;
+    Packet packet;
+    while (static_cast<uint8_t>(rxTail - rxHead) < NET_RING_ENTRIES && cpu.network->receive(cpu.pid, packet)) {
+        uint16_t descriptor = ring + NET_RING_HEADER_SIZE + NET_DESCRIPTOR_SIZE * (NET_RING_ENTRIES + rxTail % NET_RING_ENTRIES);
+        uint16_t buffer = cpu.readWord(descriptor + 2);
+        uint8_t length = cpu.isWritableRange(buffer, packet.length) ? packet.length : 0;
+        cpu.memory.write(buffer, packet.payload.data(), length);
+        cpu.noteWritten(buffer, length);
+        cpu.memory.write(descriptor, packet.source);
+        cpu.memory.write(descriptor + 1, length);
+        rxTail++;
+        received++;
+    }
+    cpu.memory.write(ring + 3, rxTail);
+    return received;
+}
+
+/**
+ * Name: defaultSyscallTable
+ * Purpouse: Provide the process-wide syscall table shared by every CPU.
+ * Inputs: None
+ * Outputs: The table, populated with the kernel's built-in services on first use.
+ * Effects: Embedders may register additional handlers on it, or point a CPU's
+ *          syscalls member at a table of its own.
+ */
+SyscallTable& defaultSyscallTable() {
+    static SyscallTable table = [] {
+        SyscallTable builtins;
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::PRINT_CHAR), [](CPU&, uint8_t argument) {
+            cout << static_cast<char>(argument) << '\n';
+            return argument;
+        });
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::READ_CHAR), [](CPU&, uint8_t) {
+            char inputChar;
+            cin >> inputChar;
+            return static_cast<uint8_t>(inputChar);
+        });
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::SUBMIT_RING), [](CPU& cpu, uint8_t argument) {
+            return cpu.processSyscallRing(argument);
+        });
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::FILE_OPEN), fileOpenSyscall);
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::FILE_READ), fileReadSyscall);
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::FILE_WRITE), fileWriteSyscall);
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::FILE_CLOSE), fileCloseSyscall);
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::FILE_SEEK), fileSeekSyscall);
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::SET_INTERRUPT_MASK), [](CPU& cpu, uint8_t argument) {
+            uint8_t previous = cpu.interruptMask;
+            cpu.interruptMask = argument;
+            return previous;
+        });
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::SET_INTERRUPT_VECTOR), setInterruptVectorSyscall);
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::SET_TIMER), [](CPU& cpu, uint8_t argument) {
+            cpu.timerInterval = argument;
+            cpu.timerDeadline = argument ? cpu.instructionCount + argument : UINT64_MAX;
+            return uint8_t{0};
+        });
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::DMA_START), dmaStartSyscall);
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::DMA_STATUS), [](CPU& cpu, uint8_t) {
+            return cpu.dmaStatus.load(memory_order_acquire);
+        });
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::PRESENT_FRAME), [](CPU& cpu, uint8_t) {
+            cpu.presentFrame();
+            return uint8_t{0};
+        });
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::NET_TRANSMIT), netTransmitSyscall);
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::NET_RECEIVE), netReceiveSyscall);
+        builtins.registerHandler(static_cast<uint8_t>(SyscallNumber::SET_BANK), [](CPU& cpu, uint8_t argument) {
+            return cpu.memory.selectBank(argument);
+        });
+        return builtins;
+    }();
+    return table;
+}
+
+// Simple assembler for the fictional CPU
+/**
+ * Name: parseHexProgram
+ * Purpouse: Convert a string of hex values into a vector of bytes.
+ * Inputs:
+ *   - hexString: A string containing hex values separated by spaces.
+ * Outputs: A vector of uint8_t representing the bytecode.
+ * Effects: Parses the input string and converts each hex value to a byte, printing errors for invalid values.
+ */
+vector<uint8_t> parseHexProgram(const string& hexString) {
+    stringstream ss(hexString);
+    string hexByte;
+    vector<uint8_t> program;
+    while (ss >> hexByte) {
+        try {
+            int byteValue = stoi(hexByte, nullptr, 16);
+            if (byteValue >= 0 && byteValue <= 255) {
+                program.push_back(static_cast<uint8_t>(byteValue));
+            } else {
                 cerr << "Invalid hex byte value: " << hexByte << endl;
             }
-        } catch (const exception& e) {
-            cerr << "Error parsing hex byte: " << hexByte << " - " << e.what() << endl;
+        } catch (const exception& e) {
+            cerr << "Error parsing hex byte: " << hexByte << " - " << e.what() << endl;
+        }
+    }
+    return program;
+}
+
+/**
+ * Name: assemble
+ * Purpouse: Assemble a simple assembly language file into bytecode.
+ * Inputs:
+ *   - filename: The path to the assembly file.
+ * Outputs: A vector of uint8_t representing the assembled bytecode.
+ * Effects: Reads the assembly file, translates instructions to opcodes, and handles labels.
+ */
+vector<uint8_t> assemble(const string& filename) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open assembly file " << filename << endl;
+        return {};
+    }
+    string line;
+    vector<string> lines;
+    while (getline(file, line)) {
+        lines.push_back(line);
+    }
+    file.close();
+    vector<uint8_t> bytecode;
+    map<string, uint16_t> labels(vdsoSymbols.begin(), vdsoSymbols.end());
+    uint16_t address = USER_PROGRAM_START_ADDRESS;
+    for (const auto& l : lines) {
+        stringstream ss(l);
+        string token;
+        ss >> token;
+        if (token.empty() || token[0] == ';') continue;
+        if (token.back() == ':') {
+            labels[token.substr(0, token.size() - 1)] = address;
+            ss >> token;
+        }
+        if (opcodeMap.count(token)) {
+            address += 1 + operandSize(opcodeMap.at(token));
+        }
+    }
+    for (const auto& l : lines) {
+        stringstream ss(l);
+        string token;
+        ss >> token;
+        if (token.empty() || token[0] == ';') continue;
+        if (token.back() == ':') {
+            ss >> token;
+        }
+        if (opcodeMap.count(token)) {
+            OpCode opcode = opcodeMap.at(token);
+            bytecode.push_back(opcode);
+            int size = operandSize(opcode);
+            if (size > 0) {
+                string operand;
+                ss >> operand;
+                int value;
+                if (labels.count(operand)) {
+                    value = labels.at(operand);
+                } else {
+                    try {
+                        value = stoi(operand, nullptr, 10);
+                    } catch (...) {
+                        cerr << "Error: Invalid operand '" << operand << "'" << endl;
+                        return {};
+                    }
+                }
+                bytecode.push_back(static_cast<uint8_t>(value));
+                if (size == 2) {
+                    bytecode.push_back(static_cast<uint8_t>(value >> 8));
+                }
+            }
+        }
+    }
+    return bytecode;
+}
+// Simple Micro-C to bytecode compiler
+
+// Micro-C builtins that read the vDSO page with a plain load (low byte of each field).
+const map<string, uint16_t> vdsoBuiltins = {
+    {"__instructions", VDSO_INSTRUCTION_COUNT},
+    {"__time", VDSO_TIME_US},
+    {"__pid", VDSO_PID},
+    {"__random", VDSO_RANDOM}
+};
+
+// One instruction of generated code, before it is encoded. Labels are position markers that
+// jumps refer to by number until the code is laid out.
+struct MicroCOp {
+    OpCode opcode = HALT;
+    uint16_t operand = 0; // Immediate, address, or label number for jumps
+    int line = 0;         // Source line, on the first instruction of a statement
+    bool isLabel = false;
+};
+
+// What compile() produced besides the bytecode.
+struct CompileListing {
+    vector<MicroCOp> code;
+    vector<int> lines; // Source line of each statement at the offset of its first byte, else 0
+};
+
+/**
+ * Name: emitOperandLoad
+ * Purpouse: Emit the instruction that loads a Micro-C operand into register A or B.
+ * Inputs:
+ *   - output: The code being generated.
+ *   - intoB: True to load into B, false to load into A.
+ *   - operand: A variable name, vDSO builtin or decimal literal.
+ *   - variables: The symbol table mapping variable names to addresses.
+ * Outputs: True on success, false if the operand is invalid.
+ * Effects: Variables and builtins are read from memory with LOAD_*_MEM, literals with LOAD_*.
+ */
+bool emitOperandLoad(vector<MicroCOp>& output, bool intoB, const string& operand,
+                     const unordered_map<string, uint8_t>& variables) {
+    uint16_t address;
+    if (variables.count(operand)) {
+        address = variables.at(operand);
+    } else if (vdsoBuiltins.count(operand)) {
+        address = vdsoBuiltins.at(operand);
+    } else {
+        try {
+            output.push_back({intoB ? LOAD_B : LOAD_A, static_cast<uint8_t>(stoi(operand))});
+            return true;
+        } catch (...) {
+            cerr << "Error: Invalid operand '" << operand << "'" << endl;
+            return false;
+        }
+    }
+    output.push_back({intoB ? LOAD_B_MEM : LOAD_A_MEM, address});
+    return true;
+}
+
+// The right-hand side of a Micro-C assignment: a tree of '+' and '-' over operands
+// (variables, vDSO builtins and decimal literals). Trees are immutable and share subtrees.
+struct MicroCExpr;
+using MicroCExprPtr = shared_ptr<const MicroCExpr>;
+
+struct MicroCExpr {
+    char op = 0;    // '+', '-', or 0 for an operand
+    string operand; // Operands only
+    MicroCExprPtr left, right;
+};
+
+MicroCExprPtr microCLeaf(const string& operand) {
+    auto leaf = make_shared<MicroCExpr>();
+    leaf->operand = operand;
+    return leaf;
+}
+
+MicroCExprPtr microCNode(char op, MicroCExprPtr left, MicroCExprPtr right) {
+    auto node = make_shared<MicroCExpr>();
+    node->op = op;
+    node->left = move(left);
+    node->right = move(right);
+    return node;
+}
+
+// Calls visit with each operand of an expression, left to right.
+void forEachLeaf(const MicroCExpr& expression, const function<void(const string&)>& visit) {
+    if (!expression.op) {
+        visit(expression.operand);
+        return;
+    }
+    forEachLeaf(*expression.left, visit);
+    forEachLeaf(*expression.right, visit);
+}
+
+// Micro-C programs are parsed into a tree of statements: assignments, and loops written
+// "while <operand> {" ... "}" that run while the operand is non-zero.
+struct MicroCStatement {
+    int line = 0;
+    string target;
+    MicroCExprPtr value;               // Assignments only
+    string condition;                  // Loops only; a non-empty condition marks a loop
+    vector<MicroCStatement> body;      // Loops only
+    vector<MicroCStatement> preheader; // Loops only: invariant statements hoisted out of the body
+    long tripCount = -1;               // Loops only: iterations, when known at compile time
+
+    bool isLoop() const {
+        return !condition.empty();
+    }
+};
+
+// The flat form of a program that liveness, slot allocation and code generation work on.
+enum MicroCKind { MICROC_ASSIGN, MICROC_JUMP, MICROC_JUMP_ZERO, MICROC_JUMP_NONZERO, MICROC_LABEL };
+
+struct MicroCInstruction {
+    MicroCKind kind;
+    int line;
+    string target;       // Assignments
+    MicroCExprPtr value; // Assignments
+    string operand;      // The operand a conditional jump tests
+    size_t label;        // Jumps and labels
+};
+
+// An execution profile of a Micro-C program: how many times each source line's statement
+// ran. The emulator counts executions per PC, and the compiler's line map turns those into
+// per-line counts, which stay meaningful however the program is compiled next time.
+class MicroCProfile {
+public:
+    string source;                          // The Micro-C file the profile was taken from
+    unordered_map<int, uint64_t> lineCounts; // Source line -> executions
+
+    /**
+     * Name: parse
+     * Purpouse: Read a profile file.
+     * Inputs:
+     *   - path: The file, as written by save().
+     * Outputs: The profile, or nullptr if the file is unreadable or a line is invalid (an
+     *          error message naming the line is printed).
+     * Effects: None
+     */
+    static unique_ptr<MicroCProfile> parse(const string& path) {
+        ifstream file(path);
+        if (!file.is_open()) {
+            cerr << "Error: Could not open profile " << path << endl;
+            return nullptr;
+        }
+        auto profile = make_unique<MicroCProfile>();
+        string line;
+        for (int number = 1; getline(file, line); number++) {
+            stringstream ss(line.substr(0, line.find(';')));
+            string first;
+            if (!(ss >> first)) {
+                continue;
+            }
+            int sourceLine = 0;
+            uint64_t count = 0;
+            if (first == "source") {
+                ss >> profile->source;
+            } else if (stringstream(first) >> sourceLine && sourceLine > 0 && ss >> count) {
+                profile->lineCounts[sourceLine] += count;
+            } else {
+                cerr << "Error: " << path << ":" << number << ": expected '<line> <count>'" << endl;
+                return nullptr;
+            }
+        }
+        return profile;
+    }
+
+    /**
+     * Name: save
+     * Purpouse: Write the profile to a file.
+     * Inputs:
+     *   - path: The file.
+     * Outputs: False if the file cannot be written.
+     * Effects: Lines are written in source order.
+     */
+    bool save(const string& path) const {
+        ofstream file(path);
+        if (!file.is_open()) {
+            cerr << "Error: Could not write profile " << path << endl;
+            return false;
+        }
+        map<int, uint64_t> ordered(lineCounts.begin(), lineCounts.end());
+        file << "; Micro-C profile: <line> <executions>" << endl;
+        file << "source " << source << endl;
+        for (const auto& entry : ordered) {
+            file << entry.first << " " << entry.second << endl;
+        }
+        return file.good();
+    }
+
+    uint64_t count(int line) const {
+        auto found = lineCounts.find(line);
+        return found == lineCounts.end() ? 0 : found->second;
+    }
+};
+
+class RewriteDatabase;
+
+struct CompileOptions {
+    bool optimize = true;                       // Constant folding, loop-invariant code motion and unrolling
+    bool optimizeSize = false;                  // Select the smallest code rather than the fastest; no unrolling
+    shared_ptr<const MicroCProfile> profile;    // Guides unrolling when set
+    shared_ptr<const RewriteDatabase> rewrites; // Superoptimizer rewrites for the peephole pass
+};
+
+// Unrolling limits: copies of a loop body, and bytes of code growth per loop (code and
+// variables share the zero page).
+const long MICROC_MAX_UNROLL = 16;
+const size_t MICROC_UNROLL_BYTES = 64;
+
+/**
+ * Name: parseMicroCOperand
+ * Purpouse: Check a Micro-C operand.
+ * Inputs:
+ *   - operand: A variable name, vDSO builtin or decimal literal (a literal may start with '-').
+ *   - known: The variables declared so far.
+ *   - line: The source line, for error messages.
+ * Outputs: False if the operand is an undeclared name or an invalid literal (an error
+ *          message is printed).
+ * Effects: None
+ */
+bool parseMicroCOperand(const string& operand, const unordered_map<string, bool>& known, int line) {
+    if (known.count(operand) || vdsoBuiltins.count(operand)) {
+        return true;
+    }
+    if (!operand.empty() && (isalpha(static_cast<unsigned char>(operand[0])) || operand[0] == '_')) {
+        cerr << "Error: Undefined variable '" << operand << "' at line " << line << endl;
+        return false;
+    }
+    size_t used = 0;
+    try {
+        stoi(operand, &used);
+    } catch (...) {
+    }
+    if (operand.empty() || used != operand.size()) {
+        cerr << "Error: Invalid operand '" << operand << "' at line " << line << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Name: parseMicroCExpression
+ * Purpouse: Parse the right-hand side of an assignment.
+ * Inputs:
+ *   - tokens: The tokens: names, numbers, and the characters + - ( ).
+ *   - position: The next token (advanced past the expression).
+ *   - known: The variables declared so far.
+ *   - line: The source line, for error messages.
+ * Outputs: The expression tree, or nullptr on a syntax error (an error message is printed).
+ * Effects: None. The grammar is
+ *            expression := term { ('+' | '-') term }
+ *            term       := '(' expression ')' | operand | '-' number
+ *          so '+' and '-' associate to the left.
+ */
+MicroCExprPtr parseMicroCExpression(const vector<string>& tokens, size_t& position,
+                                     const unordered_map<string, bool>& known, int line) {
+    function<MicroCExprPtr()> term = [&]() -> MicroCExprPtr {
+        if (position == tokens.size() || tokens[position] == ")" || tokens[position] == "+") {
+            cerr << "Error: Expected an operand at line " << line << endl;
+            return nullptr;
+        }
+        string token = tokens[position++];
+        if (token == "(") {
+            MicroCExprPtr inner = parseMicroCExpression(tokens, position, known, line);
+            if (inner && (position == tokens.size() || tokens[position] != ")")) {
+                cerr << "Error: Expected ')' at line " << line << endl;
+                return nullptr;
+            }
+            position++;
+            return inner;
+        }
+        if (token == "-" && position < tokens.size()) {
+            token += tokens[position++]; // A negative literal
+        }
+        return parseMicroCOperand(token, known, line) ? microCLeaf(token) : nullptr;
+    };
+    MicroCExprPtr expression = term();
+    while (expression && position < tokens.size() && (tokens[position] == "+" || tokens[position] == "-")) {
+        char op = tokens[position++][0];
+        MicroCExprPtr right = term();
+        expression = right ? microCNode(op, expression, right) : nullptr;
+    }
+    return expression;
+}
+
+/**
+ * Name: parseMicroC
+ * Purpouse: Parse a Micro-C source file into its declarations and statements.
+ * Inputs:
+ *   - filename: The path to the Micro-C source file.
+ *   - declared: Receives the variable names in declaration order.
+ *   - statements: Receives the top-level statements in program order.
+ * Outputs: False on a syntax error or an undefined variable (an error message is printed).
+ * Effects: Reads the source file.
+ */
+bool parseMicroC(const string& filename, vector<string>& declared, vector<MicroCStatement>& statements) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open source file " << filename << endl;
+        return false;
+    }
+    unordered_map<string, bool> known;
+    vector<MicroCStatement> open; // Loops being parsed, innermost last
+    string line;
+    for (int number = 1; getline(file, line); number++) {
+        stringstream ss(line);
+        string token;
+        ss >> token;
+
+        if (token.empty() || (token.size() >= 2 && token[0] == '/' && token[1] == '/')) continue;
+
+        vector<MicroCStatement>& current = open.empty() ? statements : open.back().body;
+        if (token == "int") {
+            string varName;
+            ss >> varName;
+            if (varName.back() == ';') {
+                varName.pop_back();
+            }
+            if (known.count(varName)) {
+                cerr << "Error: Variable '" << varName << "' already declared." << endl;
+                return false;
+            }
+            known[varName] = true;
+            declared.push_back(varName);
+            continue;
+        }
+        if (token == "while") {
+            MicroCStatement loop;
+            loop.line = number;
+            string brace;
+            ss >> loop.condition >> brace;
+            if (loop.condition.empty() || brace != "{") {
+                cerr << "Error: Expected 'while <operand> {' at line " << number << endl;
+                return false;
+            }
+            if (!parseMicroCOperand(loop.condition, known, number)) {
+                return false;
+            }
+            open.push_back(move(loop));
+            continue;
+        }
+        if (token == "}") {
+            if (open.empty()) {
+                cerr << "Error: Unexpected '}' at line " << number << endl;
+                return false;
+            }
+            MicroCStatement loop = move(open.back());
+            open.pop_back();
+            (open.empty() ? statements : open.back().body).push_back(move(loop));
+            continue;
+        }
+        MicroCStatement statement;
+        statement.line = number;
+        statement.target = token;
+        string equals;
+        ss >> equals;
+        if (equals != "=") {
+            cerr << "Error: Expected '=' in assignment statement." << endl;
+            return false;
+        }
+        if (!known.count(statement.target)) {
+            cerr << "Error: Undefined variable '" << statement.target << "'" << endl;
+            return false;
+        }
+        string rest;
+        getline(ss, rest);
+        rest = rest.substr(0, rest.find("//"));
+        vector<string> tokens;
+        for (size_t i = 0; i < rest.size();) {
+            char c = rest[i];
+            if (isalnum(static_cast<unsigned char>(c)) || c == '_') {
+                size_t end = i;
+                while (end < rest.size() && (isalnum(static_cast<unsigned char>(rest[end])) || rest[end] == '_')) {
+                    end++;
+                }
+                tokens.push_back(rest.substr(i, end - i));
+                i = end;
+            } else if (c == '+' || c == '-' || c == '(' || c == ')') {
+                tokens.push_back(string(1, c));
+                i++;
+            } else if (c == ';') {
+                rest.erase(i); // The statement ends here
+            } else if (isspace(static_cast<unsigned char>(c))) {
+                i++;
+            } else {
+                cerr << "Error: Unknown operator '" << c << "'" << endl;
+                return false;
+            }
+        }
+        size_t position = 0;
+        statement.value = parseMicroCExpression(tokens, position, known, number);
+        if (!statement.value) {
+            return false;
+        }
+        if (position < tokens.size()) {
+            cerr << "Error: Unexpected '" << tokens[position] << "' at line " << number << endl;
+            return false;
+        }
+        current.push_back(statement);
+    }
+    if (!open.empty()) {
+        cerr << "Error: Missing '}' for the loop at line " << open.back().line << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Name: microCLiteral
+ * Purpouse: Get the value of a literal operand.
+ * Inputs:
+ *   - operand: A variable name, vDSO builtin or decimal literal.
+ *   - variables: The declared variable names.
+ *   - value: Receives the literal's 8-bit value.
+ * Outputs: True if the operand is a literal.
+ * Effects: None
+ */
+bool microCLiteral(const string& operand, const unordered_set<string>& variables, uint8_t& value) {
+    if (operand.empty() || variables.count(operand) || vdsoBuiltins.count(operand)) {
+        return false;
+    }
+    try {
+        value = static_cast<uint8_t>(stoi(operand));
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+/**
+ * Name: lowerMicroC
+ * Purpouse: Flatten statements into assignments, labels and jumps.
+ * Inputs:
+ *   - statements: The statements to lower.
+ *   - variables: The declared variable names.
+ *   - out: Receives the instructions.
+ *   - nextLabel: The next unused label number (advanced).
+ * Outputs: None
+ * Effects: Loops are rotated: a guard skips the loop when the condition starts out zero
+ *          (left out when the trip count is known), the preheader runs once, and the test
+ *          sits at the bottom, so each iteration costs one conditional jump. A literal
+ *          condition gives an unconditional loop, or no loop at all when it is zero.
+ */
+void lowerMicroC(const vector<MicroCStatement>& statements, const unordered_set<string>& variables,
+                 vector<MicroCInstruction>& out, size_t& nextLabel) {
+    for (const MicroCStatement& statement : statements) {
+        if (!statement.isLoop()) {
+            out.push_back({MICROC_ASSIGN, statement.line, statement.target, statement.value, "", 0});
+            continue;
+        }
+        uint8_t value = 1;
+        bool literal = microCLiteral(statement.condition, variables, value);
+        if ((literal && value == 0) || statement.tripCount == 0) {
+            continue;
+        }
+        size_t top = nextLabel++;
+        size_t exit = nextLabel++;
+        bool guarded = !literal && statement.tripCount < 0;
+        if (guarded) {
+            out.push_back({MICROC_JUMP_ZERO, statement.line, "", nullptr, statement.condition, exit});
+        }
+        lowerMicroC(statement.preheader, variables, out, nextLabel);
+        out.push_back({MICROC_LABEL, statement.line, "", nullptr, "", top});
+        lowerMicroC(statement.body, variables, out, nextLabel);
+        out.push_back({literal ? MICROC_JUMP : MICROC_JUMP_NONZERO, statement.line, "", nullptr, statement.condition, top});
+        if (guarded) {
+            out.push_back({MICROC_LABEL, statement.line, "", nullptr, "", exit});
+        }
+    }
+}
+
+// Size and nominal cycles of generated code (see opcodeCycles).
+struct MicroCCost {
+    size_t bytes = 0;
+    uint64_t cycles = 0;
+
+    void add(OpCode opcode) {
+        bytes += 1 + operandSize(opcode);
+        cycles += opcodeCycles(opcode);
+    }
+};
+
+// One way of computing an expression into A.
+struct MicroCCover {
+    vector<MicroCOp> code;
+    MicroCCost cost;
+};
+
+// Instruction selection for expressions by bottom-up tree pattern matching. Every subtree is
+// labeled with its cheapest cover, costed from the opcode cycle and size tables. The rules
+// (tiles) are:
+//   leaf               LOAD_A / LOAD_A_MEM
+//   x op leaf          x; LOAD_B leaf; ADD_A_B or SUB_A_B
+//   leaf + x           x; LOAD_B leaf; ADD_A_B (addition commutes)
+//   x op c             x, when c adds up to zero
+//   (x op1 c1) op2 c2  rewritten into x + c, with c = ±c1 ± c2 folded (c1 + x works too)
+//   x op (y op2 z)     reassociated into (x op y) op' z, which is exact in 8-bit arithmetic
+// Reassociation covers every right operand that is not a leaf, so with only '+' and '-' no
+// expression ever needs a temporary.
+class MicroCSelector {
+public:
+    /**
+     * Name: MicroCSelector
+     * Purpouse: Prepare to select instructions.
+     * Inputs:
+     *   - variables: The symbol table mapping variable names to addresses.
+     *   - optimizeSize: Prefer fewer bytes over fewer cycles.
+     * Outputs: None
+     * Effects: None
+     */
+    MicroCSelector(const unordered_map<string, uint8_t>& variables, bool optimizeSize)
+        : variables(variables), optimizeSize(optimizeSize) {}
+
+    /**
+     * Name: select
+     * Purpouse: Find the cheapest code that computes an expression into A.
+     * Inputs:
+     *   - expression: The expression.
+     * Outputs: The cover.
+     * Effects: None
+     */
+    const MicroCCover& select(const MicroCExprPtr& expression) {
+        return label(expression);
+    }
+
+private:
+    bool cheaper(const MicroCCover& a, const MicroCCover& b) const {
+        pair<uint64_t, uint64_t> costA{a.cost.cycles, a.cost.bytes};
+        pair<uint64_t, uint64_t> costB{b.cost.cycles, b.cost.bytes};
+        if (optimizeSize) {
+            swap(costA.first, costA.second);
+            swap(costB.first, costB.second);
+        }
+        return costA < costB;
+    }
+
+    // True if the expression is a literal leaf; value receives it.
+    bool constant(const MicroCExprPtr& expression, uint8_t& value) const {
+        if (expression->op || variables.count(expression->operand) || vdsoBuiltins.count(expression->operand)) {
+            return false;
+        }
+        try {
+            value = static_cast<uint8_t>(stoi(expression->operand));
+            return true;
+        } catch (...) {
+            return false;
+        }
+    }
+
+    // Appends instructions, or another cover, to a cover being built.
+    static void append(MicroCCover& cover, OpCode opcode, uint16_t operand = 0) {
+        cover.code.push_back({opcode, operand});
+        cover.cost.add(opcode);
+    }
+    static void append(MicroCCover& cover, const MicroCCover& part) {
+        cover.code.insert(cover.code.end(), part.code.begin(), part.code.end());
+        cover.cost.bytes += part.cost.bytes;
+        cover.cost.cycles += part.cost.cycles;
+    }
+    void appendLoad(MicroCCover& cover, bool intoB, const string& operand) const {
+        size_t first = cover.code.size();
+        emitOperandLoad(cover.code, intoB, operand, variables);
+        for (size_t i = first; i < cover.code.size(); i++) {
+            cover.cost.add(cover.code[i].opcode);
+        }
+    }
+
+    /**
+     * Name: label
+     * Purpouse: Find the cheapest cover of a subtree.
+     * Inputs:
+     *   - node: The subtree.
+     * Outputs: The cover.
+     * Effects: Memoizes the result. Rewritten subtrees are kept alive for the memo.
+     */
+    const MicroCCover& label(MicroCExprPtr node) {
+        auto found = memo.find(node.get());
+        if (found != memo.end()) {
+            return *found->second;
+        }
+        unique_ptr<MicroCCover> best;
+        auto consider = [&](const MicroCCover& candidate) {
+            if (!best || cheaper(candidate, *best)) {
+                best = make_unique<MicroCCover>(candidate);
+            }
+        };
+        auto rewrite = [&](MicroCExprPtr tree) {
+            rewritten.push_back(tree);
+            consider(label(tree));
+        };
+        const MicroCExprPtr& left = node->left;
+        const MicroCExprPtr& right = node->right;
+        if (!node->op) {
+            MicroCCover cover;
+            appendLoad(cover, false, node->operand);
+            consider(cover);
+        } else if (!right->op) {
+            MicroCCover cover;
+            append(cover, label(left));
+            appendLoad(cover, true, right->operand);
+            append(cover, node->op == '+' ? ADD_A_B : SUB_A_B);
+            consider(cover);
+        } else {
+            char op = node->op == '+' ? right->op : (right->op == '+' ? '-' : '+');
+            rewrite(microCNode(op, microCNode(node->op, left, right->left), right->right));
+        }
+        uint8_t outer = 0;
+        if (node->op && constant(right, outer)) {
+            uint8_t addend = node->op == '+' ? outer : static_cast<uint8_t>(-outer);
+            if (addend == 0) {
+                consider(label(left)); // x + 0
+            }
+            uint8_t inner = 0;
+            if (left->op && constant(left->right, inner)) {
+                addend += left->op == '+' ? inner : static_cast<uint8_t>(-inner);
+                rewrite(microCNode('+', left->left, microCLeaf(to_string(addend))));
+            } else if (left->op == '+' && constant(left->left, inner)) {
+                addend += inner;
+                rewrite(microCNode('+', left->right, microCLeaf(to_string(addend))));
+            }
+        }
+        if (node->op == '+' && !left->op) {
+            MicroCCover cover;
+            append(cover, label(right));
+            appendLoad(cover, true, left->operand);
+            append(cover, ADD_A_B);
+            consider(cover);
+        }
+        return *(memo[node.get()] = move(best));
+    }
+
+    const unordered_map<string, uint8_t>& variables;
+    bool optimizeSize;
+    unordered_map<const MicroCExpr*, unique_ptr<MicroCCover>> memo;
+    vector<MicroCExprPtr> rewritten;
+};
+
+/**
+ * Name: selectMicroC
+ * Purpouse: Choose the instructions for a lowered program.
+ * Inputs:
+ *   - program: The lowered program.
+ *   - variables: The symbol table mapping variable names to addresses.
+ *   - optimizeSize: Prefer smaller code over fewer cycles.
+ *   - output: Receives the instructions and labels, ending in HALT.
+ * Outputs: False if an operand is invalid.
+ * Effects: None
+ */
+bool selectMicroC(const vector<MicroCInstruction>& program, const unordered_map<string, uint8_t>& variables,
+                  bool optimizeSize, vector<MicroCOp>& output) {
+    MicroCSelector selector(variables, optimizeSize);
+    for (const MicroCInstruction& instruction : program) {
+        size_t first = output.size();
+        switch (instruction.kind) {
+            case MICROC_ASSIGN: {
+                const MicroCCover& cover = selector.select(instruction.value);
+                output.insert(output.end(), cover.code.begin(), cover.code.end());
+                output.push_back({STORE_A, variables.at(instruction.target)});
+                output[first].line = instruction.line;
+                break;
+            }
+            case MICROC_JUMP_ZERO:
+            case MICROC_JUMP_NONZERO:
+                if (!emitOperandLoad(output, false, instruction.operand, variables)) {
+                    return false;
+                }
+                output.push_back({instruction.kind == MICROC_JUMP_ZERO ? JZ : JNZ, static_cast<uint16_t>(instruction.label)});
+                break;
+            case MICROC_JUMP:
+                output.push_back({JMP, static_cast<uint16_t>(instruction.label)});
+                break;
+            case MICROC_LABEL:
+                output.push_back({HALT, static_cast<uint16_t>(instruction.label), 0, true});
+                break;
+        }
+    }
+    output.push_back({HALT});
+    return true;
+}
+
+/**
+ * Name: microCCost
+ * Purpouse: Estimate the code that lowered statements generate.
+ * Inputs:
+ *   - statements: The statements.
+ *   - variables: The declared variable names.
+ * Outputs: Their size and the cycles of one pass through them (loops inside count once).
+ * Effects: None
+ */
+MicroCCost microCCost(const vector<MicroCStatement>& statements, const unordered_set<string>& variables) {
+    vector<MicroCInstruction> flat;
+    size_t labels = 0;
+    lowerMicroC(statements, variables, flat, labels);
+    unordered_map<string, uint8_t> addresses;
+    for (const string& name : variables) {
+        addresses[name] = 0xFF;
+    }
+    vector<MicroCOp> code;
+    MicroCCost cost;
+    if (selectMicroC(flat, addresses, false, code)) {
+        code.pop_back(); // HALT
+        for (const MicroCOp& op : code) {
+            if (!op.isLabel) {
+                cost.add(op.opcode);
+            }
+        }
+    }
+    return cost;
+}
+
+/**
+ * Name: countDefinitions
+ * Purpouse: Count the assignments to each variable in statements, including nested loops.
+ * Inputs:
+ *   - statements: The statements.
+ *   - counts: Incremented once per assignment to a variable.
+ * Outputs: None
+ * Effects: None
+ */
+void countDefinitions(const vector<MicroCStatement>& statements, unordered_map<string, size_t>& counts) {
+    for (const MicroCStatement& statement : statements) {
+        if (statement.isLoop()) {
+            countDefinitions(statement.preheader, counts);
+            countDefinitions(statement.body, counts);
+        } else {
+            counts[statement.target]++;
+        }
+    }
+}
+
+// True if the statement (or anything nested in it) reads the variable.
+bool readsVariable(const MicroCStatement& statement, const string& name) {
+    bool reads = statement.condition == name;
+    if (statement.value) {
+        forEachLeaf(*statement.value, [&](const string& operand) { reads = reads || operand == name; });
+    }
+    if (reads) {
+        return true;
+    }
+    for (const auto* list : {&statement.preheader, &statement.body}) {
+        for (const MicroCStatement& inner : *list) {
+            if (readsVariable(inner, name)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Name: foldConstants
+ * Purpouse: Propagate and fold compile-time constants, and find loop trip counts.
+ * Inputs:
+ *   - statements: The statements (rewritten in place).
+ *   - known: Variables with a known value on entry (updated to the values on exit).
+ *   - variables: The declared variable names.
+ * Outputs: None
+ * Effects: Operands with a known value become literals, and an assignment whose operands
+ *          are all known becomes a literal store. A loop forgets the variables it assigns.
+ *          A loop "while i {" whose only assignment to i is a "i = i - c;" statement directly
+ *          in its body (anywhere, since it runs once per iteration either way), with c
+ *          constant and i's entry value a multiple of c, gets its trip count.
+ */
+void foldConstants(vector<MicroCStatement>& statements, unordered_map<string, uint8_t>& known, const unordered_set<string>& variables) {
+    auto valueOf = [&](const string& operand, uint8_t& value) {
+        if (microCLiteral(operand, variables, value)) {
+            return true;
+        }
+        auto found = known.find(operand);
+        return found != known.end() && (value = found->second, true);
+    };
+    // Replaces operands with known values by literals and folds constant subtrees.
+    function<MicroCExprPtr(const MicroCExprPtr&)> fold = [&](const MicroCExprPtr& expression) {
+        uint8_t value = 0;
+        if (!expression->op) {
+            return valueOf(expression->operand, value) ? microCLeaf(to_string(value)) : expression;
+        }
+        MicroCExprPtr left = fold(expression->left);
+        MicroCExprPtr right = fold(expression->right);
+        uint8_t a = 0;
+        uint8_t b = 0;
+        if (!left->op && !right->op && valueOf(left->operand, a) && valueOf(right->operand, b)) {
+            return microCLeaf(to_string(static_cast<uint8_t>(expression->op == '+' ? a + b : a - b)));
+        }
+        return microCNode(expression->op, left, right);
+    };
+    for (MicroCStatement& statement : statements) {
+        if (!statement.isLoop()) {
+            statement.value = fold(statement.value);
+            uint8_t value = 0;
+            if (!statement.value->op && valueOf(statement.value->operand, value)) {
+                statement.value = microCLeaf(to_string(value));
+                known[statement.target] = value;
+            } else {
+                known.erase(statement.target);
+            }
+            continue;
+        }
+        unordered_map<string, size_t> definitions;
+        countDefinitions(statement.preheader, definitions);
+        countDefinitions(statement.body, definitions);
+        const string& counter = statement.condition;
+        uint8_t entry = 0;
+        uint8_t step = 0;
+        if (!definitions.count(counter) && valueOf(counter, entry)) {
+            statement.condition = to_string(entry); // Never changes: an infinite or a dead loop
+        } else if (variables.count(counter) && definitions[counter] == 1 && valueOf(counter, entry)) {
+            for (const MicroCStatement& inner : statement.body) {
+                if (!inner.isLoop() && inner.target == counter && inner.value->op == '-' && !inner.value->left->op &&
+                    inner.value->left->operand == counter && !inner.value->right->op &&
+                    !definitions.count(inner.value->right->operand) && valueOf(inner.value->right->operand, step) &&
+                    step != 0 && entry % step == 0) {
+                    statement.tripCount = entry / step;
+                }
+            }
+        }
+        for (const auto& definition : definitions) {
+            known.erase(definition.first);
+        }
+        unordered_map<string, uint8_t> inside = known;
+        foldConstants(statement.preheader, inside, variables);
+        foldConstants(statement.body, inside, variables);
+    }
+}
+
+/**
+ * Name: hoistInvariants
+ * Purpouse: Move loop-invariant assignments out of loops (loop-invariant code motion).
+ * Inputs:
+ *   - statements: The statements whose loops are optimized (in place).
+ *   - variables: The declared variable names.
+ * Outputs: The number of statements hoisted.
+ * Effects: An assignment at the top level of a loop body moves to the loop's preheader when
+ *          its target is assigned nowhere else in the loop, is not the loop condition, and
+ *          is not read earlier in the body, and its operands are literals or variables the
+ *          loop does not assign. vDSO builtins change between reads, so they never qualify.
+ *          The preheader runs once, only if the loop runs, so the result is unchanged.
+ */
+size_t hoistInvariants(vector<MicroCStatement>& statements, const unordered_set<string>& variables) {
+    size_t hoisted = 0;
+    for (MicroCStatement& loop : statements) {
+        if (!loop.isLoop()) {
+            continue;
+        }
+        hoisted += hoistInvariants(loop.body, variables);
+        for (bool moved = true; moved;) {
+            moved = false;
+            unordered_map<string, size_t> definitions;
+            countDefinitions(loop.body, definitions);
+            auto invariant = [&](const MicroCExpr& expression) {
+                bool result = true;
+                forEachLeaf(expression, [&](const string& operand) {
+                    result = result && !vdsoBuiltins.count(operand) && !definitions.count(operand);
+                });
+                return result;
+            };
+            for (size_t i = 0; i < loop.body.size() && !moved; i++) {
+                const MicroCStatement& statement = loop.body[i];
+                if (statement.isLoop() || definitions[statement.target] != 1 || statement.target == loop.condition ||
+                    !invariant(*statement.value)) {
+                    continue;
+                }
+                bool readEarlier = false;
+                for (size_t j = 0; j < i && !readEarlier; j++) {
+                    readEarlier = readsVariable(loop.body[j], statement.target);
+                }
+                if (!readEarlier) {
+                    loop.preheader.push_back(statement);
+                    loop.body.erase(loop.body.begin() + static_cast<long>(i));
+                    moved = true;
+                    hoisted++;
+                }
+            }
+        }
+    }
+    return hoisted;
+}
+
+/**
+ * Name: unrollLoops
+ * Purpouse: Unroll loops with a known trip count where the cost model says it pays.
+ * Inputs:
+ *   - statements: The statements (rewritten in place).
+ *   - variables: The declared variable names.
+ *   - budgets: Bytes of code growth allowed per loop, by source line; null allows
+ *              MICROC_UNROLL_BYTES for every loop.
+ * Outputs: The number of loops unrolled.
+ * Effects: For a loop of T iterations, each factor k is costed from the opcode size and
+ *          cycle tables: T % k iterations are peeled in front, the body is repeated k times,
+ *          and the bottom test then runs T / k times instead of T (never, when k == T and
+ *          the loop disappears). The cheapest factor in cycles whose code growth stays
+ *          within the loop's budget wins. Without budgets, k is at most MICROC_MAX_UNROLL.
+ *          A loop known to run zero times is removed.
+ */
+size_t unrollLoops(vector<MicroCStatement>& statements, const unordered_set<string>& variables,
+                   const unordered_map<int, size_t>* budgets) {
+    size_t unrolled = 0;
+    vector<MicroCStatement> result;
+    for (MicroCStatement& statement : statements) {
+        if (!statement.isLoop()) {
+            result.push_back(move(statement));
+            continue;
+        }
+        unrolled += unrollLoops(statement.body, variables, budgets);
+        long trips = statement.tripCount;
+        if (trips < 0) {
+            result.push_back(move(statement));
+            continue;
+        }
+        MicroCCost body = microCCost(statement.body, variables);
+        MicroCCost overhead;
+        uint8_t value;
+        overhead.add(microCLiteral(statement.condition, variables, value) ? LOAD_A : LOAD_A_MEM);
+        overhead.add(JNZ);
+        long budget = static_cast<long>(MICROC_UNROLL_BYTES);
+        long maxFactor = min(trips, MICROC_MAX_UNROLL);
+        if (budgets) {
+            auto found = budgets->find(statement.line);
+            budget = found == budgets->end() ? 0 : static_cast<long>(found->second);
+            maxFactor = trips;
+        }
+        long factor = 1;
+        uint64_t bestCycles = trips * body.cycles + trips * overhead.cycles;
+        size_t bestBytes = 0;
+        for (long k = 2; k <= maxFactor; k++) {
+            bool whole = k == trips;
+            long peeled = trips % k;
+            long growth = (k - 1 + peeled) * static_cast<long>(body.bytes) - (whole ? static_cast<long>(overhead.bytes) : 0);
+            uint64_t cycles = trips * body.cycles + (whole ? 0 : (trips / k) * overhead.cycles);
+            if (growth <= budget && (cycles < bestCycles || (cycles == bestCycles && growth < static_cast<long>(bestBytes)))) {
+                factor = k;
+                bestCycles = cycles;
+                bestBytes = static_cast<size_t>(max(growth, 0L));
+            }
+        }
+        if (trips == 0) {
+            unrolled++; // Never runs, and neither does its preheader
+            continue;
+        }
+        // Known to run at least once, so the preheader can run unconditionally.
+        for (MicroCStatement& hoisted : statement.preheader) {
+            result.push_back(move(hoisted));
+        }
+        statement.preheader.clear();
+        if (factor == 1) {
+            result.push_back(move(statement));
+            continue;
+        }
+        unrolled++;
+        long peeled = factor == trips ? trips : trips % factor;
+        for (long i = 0; i < peeled; i++) {
+            result.insert(result.end(), statement.body.begin(), statement.body.end());
+        }
+        if (factor < trips) {
+            vector<MicroCStatement> copies;
+            for (long i = 0; i < factor; i++) {
+                copies.insert(copies.end(), statement.body.begin(), statement.body.end());
+            }
+            statement.body = move(copies);
+            statement.tripCount = trips / factor;
+            result.push_back(move(statement));
+        }
+    }
+    statements = move(result);
+    return unrolled;
+}
+
+/**
+ * Name: loopHeat
+ * Purpouse: Get how often a loop's body ran according to a profile.
+ * Inputs:
+ *   - loop: The loop.
+ *   - profile: The profile.
+ * Outputs: The most executions of any statement directly in the body, or of a nested loop
+ *          when the body holds nothing else. Statement counts add up across unrolled
+ *          copies, so this does not depend on how the profiled program was compiled.
+ * Effects: None
+ */
+uint64_t loopHeat(const MicroCStatement& loop, const MicroCProfile& profile) {
+    uint64_t direct = 0;
+    uint64_t nested = 0;
+    for (const MicroCStatement& statement : loop.body) {
+        if (statement.isLoop()) {
+            nested = max(nested, loopHeat(statement, profile));
+        } else {
+            direct = max(direct, profile.count(statement.line));
+        }
+    }
+    return direct ? direct : nested;
+}
+
+/**
+ * Name: planUnrolling
+ * Purpouse: Share out the free zero page among loops for unrolling, hottest first.
+ * Inputs:
+ *   - statements: The optimized statements, before unrolling.
+ *   - variables: The declared variable names.
+ *   - profile: The profile.
+ *   - freeBytes: The zero-page bytes left over by the code and variables.
+ *   - budgets: Receives the code growth allowed for each loop, by source line.
+ * Outputs: None
+ * Effects: Each loop with a known trip count asks for enough to unroll completely, counting
+ *          what its inner loops were already granted. Loops are served in order of their
+ *          heat in the profile until the free bytes run out; loops the profile never saw
+ *          running get nothing, so cold code stays small.
+ */
+void planUnrolling(const vector<MicroCStatement>& statements, const unordered_set<string>& variables,
+                   const MicroCProfile& profile, size_t freeBytes, unordered_map<int, size_t>& budgets) {
+    vector<pair<uint64_t, const MicroCStatement*>> loops;
+    function<void(const vector<MicroCStatement>&)> collect = [&](const vector<MicroCStatement>& list) {
+        for (const MicroCStatement& statement : list) {
+            if (statement.isLoop()) {
+                loops.push_back({loopHeat(statement, profile), &statement});
+                collect(statement.body);
+            }
+        }
+    };
+    function<size_t(const vector<MicroCStatement>&)> granted = [&](const vector<MicroCStatement>& list) {
+        size_t bytes = 0;
+        for (const MicroCStatement& statement : list) {
+            if (statement.isLoop()) {
+                auto found = budgets.find(statement.line);
+                bytes += (found == budgets.end() ? 0 : found->second) + granted(statement.body);
+            }
+        }
+        return bytes;
+    };
+    collect(statements);
+    stable_sort(loops.begin(), loops.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    for (const auto& loop : loops) {
+        long trips = loop.second->tripCount;
+        if (loop.first == 0 || trips <= 1) {
+            continue;
+        }
+        // Unrolling completely also drops the bottom test: a load of the condition and a JNZ.
+        uint8_t value;
+        size_t test = 1 + operandSize(microCLiteral(loop.second->condition, variables, value) ? LOAD_A : LOAD_A_MEM) + 1 + operandSize(JNZ);
+        size_t body = microCCost(loop.second->body, variables).bytes + granted(loop.second->body);
+        size_t wanted = static_cast<size_t>(trips - 1) * body;
+        size_t grant = min(wanted > test ? wanted - test : 0, freeBytes);
+        budgets[loop.second->line] = grant;
+        freeBytes -= grant;
+    }
+}
+
+/**
+ * Name: allocateVariableSlots
+ * Purpouse: Pack variables into as few zero-page slots as their live ranges allow.
+ * Inputs:
+ *   - declared: The variable names in declaration order.
+ *   - program: The lowered program.
+ *   - slots: Receives each referenced variable's slot number (0 is the top of the zero
+ *            page); variables that are never referenced get none.
+ *   - maxLive: Receives the largest number of variables live at once.
+ *   - maxLiveLine: Receives the source line where that happens.
+ * Outputs: The number of slots used.
+ * Effects: None. Liveness is the usual backward dataflow over instruction successors,
+ *          iterated to a fixed point around loops. A variable interferes with everything
+ *          live after each of its assignments, and all variables read before being assigned
+ *          (so they must still read as zero) interfere with each other. Variables are then
+ *          colored greedily in order of first appearance, which is optimal for straight-line
+ *          code.
+ */
+size_t allocateVariableSlots(const vector<string>& declared, const vector<MicroCInstruction>& program,
+                             unordered_map<string, size_t>& slots, size_t& maxLive, int& maxLiveLine) {
+    unordered_map<string, size_t> index;
+    for (size_t v = 0; v < declared.size(); v++) {
+        index[declared[v]] = v;
+    }
+    size_t words = (declared.size() + 63) / 64;
+    using VariableSet = vector<uint64_t>;
+    auto insert = [&](VariableSet& set, const string& name) {
+        auto found = index.find(name);
+        if (found != index.end()) {
+            set[found->second / 64] |= 1ull << (found->second % 64);
+        }
+    };
+    auto contains = [](const VariableSet& set, size_t v) { return (set[v / 64] >> (v % 64)) & 1; };
+
+    size_t count = program.size();
+    unordered_map<size_t, size_t> labels;
+    for (size_t s = 0; s < count; s++) {
+        if (program[s].kind == MICROC_LABEL) {
+            labels[program[s].label] = s;
+        }
+    }
+    vector<VariableSet> uses(count, VariableSet(words));
+    vector<size_t> defines(count, SIZE_MAX);
+    vector<vector<size_t>> successors(count);
+    vector<VariableSet> liveIn(count + 1, VariableSet(words)); // liveIn[count]: at the HALT
+    vector<VariableSet> liveOut(count, VariableSet(words));
+    for (size_t s = 0; s < count; s++) {
+        const MicroCInstruction& instruction = program[s];
+        insert(uses[s], instruction.operand);
+        if (instruction.value) {
+            forEachLeaf(*instruction.value, [&](const string& operand) { insert(uses[s], operand); });
+        }
+        if (instruction.kind == MICROC_ASSIGN) {
+            defines[s] = index.at(instruction.target);
+        }
+        if (instruction.kind != MICROC_JUMP) {
+            successors[s].push_back(s + 1);
+        }
+        if (instruction.kind == MICROC_JUMP || instruction.kind == MICROC_JUMP_ZERO || instruction.kind == MICROC_JUMP_NONZERO) {
+            successors[s].push_back(labels.at(instruction.label));
+        }
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t s = count; s-- > 0;) {
+            for (size_t w = 0; w < words; w++) {
+                uint64_t out = 0;
+                for (size_t next : successors[s]) {
+                    out |= liveIn[next][w];
+                }
+                liveOut[s][w] = out;
+                uint64_t kill = defines[s] != SIZE_MAX && defines[s] / 64 == w ? 1ull << (defines[s] % 64) : 0;
+                uint64_t in = uses[s][w] | (out & ~kill);
+                changed |= in != liveIn[s][w];
+                liveIn[s][w] = in;
+            }
+        }
+    }
+
+    vector<vector<size_t>> interference(declared.size());
+    auto interfere = [&](size_t a, size_t b) {
+        if (a != b) {
+            interference[a].push_back(b);
+            interference[b].push_back(a);
+        }
+    };
+    maxLive = 0;
+    maxLiveLine = 0;
+    for (size_t s = 0; s < count; s++) {
+        size_t live = defines[s] != SIZE_MAX && !contains(liveOut[s], defines[s]);
+        for (size_t v = 0; v < declared.size(); v++) {
+            if (contains(liveOut[s], v)) {
+                if (defines[s] != SIZE_MAX) {
+                    interfere(defines[s], v);
+                }
+                live++;
+            }
+        }
+        if (live > maxLive) {
+            maxLive = live;
+            maxLiveLine = program[s].line;
+        }
+    }
+    vector<size_t> entry;
+    for (size_t v = 0; count > 0 && v < declared.size(); v++) {
+        if (contains(liveIn[0], v)) {
+            for (size_t other : entry) {
+                interfere(v, other);
+            }
+            entry.push_back(v);
+        }
+    }
+    if (entry.size() > maxLive) {
+        maxLive = entry.size();
+        maxLiveLine = program.empty() ? 0 : program[0].line;
+    }
+
+    vector<size_t> order;
+    vector<bool> seen(declared.size());
+    for (const MicroCInstruction& instruction : program) {
+        vector<string> names = {instruction.operand};
+        if (instruction.value) {
+            forEachLeaf(*instruction.value, [&](const string& operand) { names.push_back(operand); });
+        }
+        names.push_back(instruction.target);
+        for (const string& name : names) {
+            auto found = index.find(name);
+            if (found != index.end() && !seen[found->second]) {
+                seen[found->second] = true;
+                order.push_back(found->second);
+            }
+        }
+    }
+    vector<size_t> slotOf(declared.size(), SIZE_MAX);
+    size_t used = 0;
+    for (size_t v : order) {
+        vector<bool> taken(used + 1);
+        for (size_t other : interference[v]) {
+            if (slotOf[other] != SIZE_MAX) {
+                taken[slotOf[other]] = true;
+            }
+        }
+        size_t slot = find(taken.begin(), taken.end(), false) - taken.begin();
+        slotOf[v] = slot;
+        slots[declared[v]] = slot;
+        used = max(used, slot + 1);
+    }
+    return used;
+}
+
+/**
+ * Name: encodeMicroC
+ * Purpouse: Lay out generated code as bytecode.
+ * Inputs:
+ *   - code: The instructions and labels.
+ *   - output: Receives the bytecode.
+ *   - lines: If not null, receives the source line of each statement at the offset of its
+ *            first byte, and 0 at every other offset.
+ * Outputs: None
+ * Effects: Jumps take 8-bit targets, which the caller's zero-page check keeps valid.
+ */
+void encodeMicroC(const vector<MicroCOp>& code, vector<uint8_t>& output, vector<int>* lines) {
+    unordered_map<uint16_t, size_t> labelAddress;
+    size_t offset = 0;
+    for (const MicroCOp& op : code) {
+        if (op.isLabel) {
+            labelAddress[op.operand] = USER_PROGRAM_START_ADDRESS + offset;
+        } else {
+            offset += 1 + operandSize(op.opcode);
+        }
+    }
+    if (lines) {
+        lines->assign(offset, 0);
+    }
+    for (const MicroCOp& op : code) {
+        if (op.isLabel) {
+            continue;
+        }
+        if (lines && op.line) {
+            (*lines)[output.size()] = op.line;
+        }
+        output.push_back(op.opcode);
+        bool jump = op.opcode == JMP || op.opcode == JZ || op.opcode == JNZ;
+        uint16_t operand = jump ? static_cast<uint16_t>(labelAddress.at(op.operand)) : op.operand;
+        for (int i = 0; i < operandSize(op.opcode); i++) {
+            output.push_back(static_cast<uint8_t>(operand >> (8 * i)));
+        }
+    }
+}
+
+// Superoptimizer: finds the cheapest straight-line sequence equivalent to a short window of
+// generated code. Windows are abstracted so that one search serves every program: zero-page
+// addresses become cells c0, c1, ... in order of first use, while immediates are kept.
+const size_t SUPEROPT_WINDOW = 4; // Longest window searched
+const size_t SUPEROPT_CELLS = 3;  // Most distinct memory cells in a window
+const int SUPEROPT_INPUTS = 3;    // Most 8-bit inputs verified exhaustively (256^3 cases)
+
+// Registers live after a window. Memory cells and the stack are always treated as live.
+const uint8_t LIVE_A = 1;
+const uint8_t LIVE_B = 2;
+
+struct SuperOp {
+    OpCode opcode;
+    uint8_t operand; // Immediate, or cell number for memory instructions
+};
+
+struct SuperState {
+    uint8_t a;
+    uint8_t b;
+    array<uint8_t, SUPEROPT_CELLS> cells;
+    array<uint8_t, SUPEROPT_WINDOW> stack;
+    uint8_t depth;
+};
+
+// True for the opcodes whose operand names a memory cell.
+bool touchesCell(OpCode opcode) {
+    return opcode == LOAD_A_MEM || opcode == LOAD_B_MEM || opcode == STORE_A || opcode == STORE_A_MEM;
+}
+
+/**
+ * Name: superExecute
+ * Purpouse: Run an abstract sequence on a state.
+ * Inputs:
+ *   - sequence: The sequence.
+ *   - state: The state (updated).
+ * Outputs: False if the sequence pops more than it pushed or pushes past the window size.
+ * Effects: None
+ */
+bool superExecute(const vector<SuperOp>& sequence, SuperState& state) {
+    for (const SuperOp& op : sequence) {
+        switch (op.opcode) {
+            case LOAD_A: state.a = op.operand; break;
+            case LOAD_B: state.b = op.operand; break;
+            case LOAD_A_MEM: state.a = state.cells[op.operand]; break;
+            case LOAD_B_MEM: state.b = state.cells[op.operand]; break;
+            case STORE_A:
+            case STORE_A_MEM: state.cells[op.operand] = state.a; break;
+            case ADD_A_B: state.a += state.b; break;
+            case SUB_A_B: state.a -= state.b; break;
+            case PUSH_B:
+                if (state.depth == SUPEROPT_WINDOW) return false;
+                state.stack[state.depth++] = state.b;
+                break;
+            case POP_B:
+                if (state.depth == 0) return false;
+                state.b = state.stack[--state.depth];
+                break;
+            default: return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Name: superDependencies
+ * Purpouse: Find what an abstract sequence reads before writing it, and what it writes.
+ * Inputs:
+ *   - sequence: The sequence.
+ *   - read: Receives a mask of the inputs read first (bit 0 A, bit 1 B, bit 2+n cell n).
+ *   - written: Receives a mask of the same fields written.
+ * Outputs: None
+ * Effects: None
+ */
+void superDependencies(const vector<SuperOp>& sequence, uint32_t& read, uint32_t& written) {
+    read = 0;
+    written = 0;
+    auto use = [&](uint32_t field) { read |= field & ~written; };
+    for (const SuperOp& op : sequence) {
+        uint32_t cell = touchesCell(op.opcode) ? 4u << op.operand : 0;
+        switch (op.opcode) {
+            case LOAD_A: written |= 1; break;
+            case LOAD_B:
+            case POP_B: written |= 2; break;
+            case LOAD_A_MEM: use(cell); written |= 1; break;
+            case LOAD_B_MEM: use(cell); written |= 2; break;
+            case STORE_A:
+            case STORE_A_MEM: use(1); written |= cell; break;
+            case ADD_A_B:
+            case SUB_A_B: use(3); written |= 1; break;
+            case PUSH_B: use(2); break;
+            default: break;
+        }
+    }
+}
+
+/**
+ * Name: superEquivalent
+ * Purpouse: Check that two abstract sequences have the same effect on every input.
+ * Inputs:
+ *   - target: The original sequence.
+ *   - candidate: The proposed replacement.
+ *   - live: The registers live afterwards (LIVE_A, LIVE_B).
+ *   - cells: The number of memory cells.
+ *   - samples: Random states tried first, to reject most candidates cheaply.
+ * Outputs: True if the live registers, every cell and the stack always end up equal. False
+ *          as well when more than SUPEROPT_INPUTS values would have to be enumerated.
+ * Effects: None. Only fields a sequence reads, or that one sequence overwrites while the
+ *          other passes them through to a live output, can make the outputs differ, so
+ *          exactly those are enumerated over all 8-bit values.
+ */
+bool superEquivalent(const vector<SuperOp>& target, const vector<SuperOp>& candidate, uint8_t live, size_t cells,
+                     const vector<SuperState>& samples) {
+    auto same = [&](SuperState start) {
+        SuperState left = start;
+        SuperState right = start;
+        if (!superExecute(target, left) || !superExecute(candidate, right)) {
+            return false;
+        }
+        if (((live & LIVE_A) && left.a != right.a) || ((live & LIVE_B) && left.b != right.b) || left.depth != right.depth) {
+            return false;
+        }
+        return equal(left.cells.begin(), left.cells.begin() + cells, right.cells.begin()) &&
+               equal(left.stack.begin(), left.stack.begin() + left.depth, right.stack.begin());
+    };
+    for (const SuperState& sample : samples) {
+        if (!same(sample)) {
+            return false;
+        }
+    }
+    uint32_t targetRead, targetWritten, candidateRead, candidateWritten;
+    superDependencies(target, targetRead, targetWritten);
+    superDependencies(candidate, candidateRead, candidateWritten);
+    uint32_t outputs = live | (((1u << cells) - 1) << 2);
+    uint32_t inputs = targetRead | candidateRead | (outputs & (targetWritten ^ candidateWritten));
+    vector<int> fields;
+    for (int field = 0; field < 2 + static_cast<int>(cells); field++) {
+        if (inputs & (1u << field)) {
+            fields.push_back(field);
+        }
+    }
+    if (static_cast<int>(fields.size()) > SUPEROPT_INPUTS) {
+        return false;
+    }
+    for (uint32_t values = 0; values < (1u << (8 * fields.size())); values++) {
+        SuperState start{};
+        for (size_t i = 0; i < fields.size(); i++) {
+            uint8_t value = static_cast<uint8_t>(values >> (8 * i));
+            uint8_t& field = fields[i] == 0 ? start.a : fields[i] == 1 ? start.b : start.cells[fields[i] - 2];
+            field = value;
+        }
+        if (!same(start)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Name: superoptimize
+ * Purpouse: Find the cheapest sequence equivalent to a window of code.
+ * Inputs:
+ *   - target: The window.
+ *   - live: The registers live after it.
+ *   - cells: The number of memory cells it uses.
+ *   - best: Receives the cheapest equivalent sequence, if one beats the window.
+ * Outputs: True if a cheaper sequence was found.
+ * Effects: Enumerates every sequence no longer than the window over the straight-line
+ *          opcodes (loads of the window's immediates, 0 and 1, loads and stores of its
+ *          cells, ADD_A_B, SUB_A_B, PUSH_B, POP_B), cheapest in cycles and then bytes
+ *          according to opcodeCycles and operandSize, pruning any prefix that already
+ *          costs as much as the best sequence so far.
+ */
+bool superoptimize(const vector<SuperOp>& target, uint8_t live, size_t cells, vector<SuperOp>& best) {
+    auto cost = [](const vector<SuperOp>& sequence) {
+        pair<int, int> total{0, 0};
+        for (const SuperOp& op : sequence) {
+            total.first += opcodeCycles(op.opcode);
+            total.second += 1 + operandSize(op.opcode);
+        }
+        return total;
+    };
+    set<uint8_t> immediates = {0, 1};
+    for (const SuperOp& op : target) {
+        if (op.opcode == LOAD_A || op.opcode == LOAD_B) {
+            immediates.insert(op.operand);
+        }
+    }
+    vector<SuperOp> alphabet = {{ADD_A_B, 0}, {SUB_A_B, 0}, {PUSH_B, 0}, {POP_B, 0}};
+    for (uint8_t value : immediates) {
+        alphabet.push_back({LOAD_A, value});
+        alphabet.push_back({LOAD_B, value});
+    }
+    for (uint8_t cell = 0; cell < cells; cell++) {
+        alphabet.push_back({LOAD_A_MEM, cell});
+        alphabet.push_back({LOAD_B_MEM, cell});
+        alphabet.push_back({STORE_A, cell});
+    }
+    mt19937 random(12345);
+    vector<SuperState> samples(16);
+    for (SuperState& sample : samples) {
+        sample.a = static_cast<uint8_t>(random());
+        sample.b = static_cast<uint8_t>(random());
+        for (uint8_t& cell : sample.cells) {
+            cell = static_cast<uint8_t>(random());
+        }
+        sample.depth = 0;
+    }
+
+    pair<int, int> bestCost = cost(target);
+    bool found = false;
+    vector<SuperOp> sequence;
+    function<void(pair<int, int>)> search = [&](pair<int, int> spent) {
+        if (superEquivalent(target, sequence, live, cells, samples)) {
+            best = sequence;
+            bestCost = spent;
+            found = true;
+        }
+        if (sequence.size() == target.size()) {
+            return;
+        }
+        for (const SuperOp& op : alphabet) {
+            pair<int, int> next{spent.first + opcodeCycles(op.opcode), spent.second + 1 + operandSize(op.opcode)};
+            if (next < bestCost) {
+                sequence.push_back(op);
+                search(next);
+                sequence.pop_back();
+            }
+        }
+    };
+    search({0, 0});
+    return found;
+}
+
+// Prints an abstract sequence as "LOAD_A_MEM c0; LOAD_B 1; ADD_A_B".
+string superText(const vector<SuperOp>& sequence) {
+    string text;
+    for (const SuperOp& op : sequence) {
+        for (const auto& entry : opcodeMap) {
+            if (entry.second == op.opcode) {
+                text += (text.empty() ? "" : "; ") + entry.first;
+            }
+        }
+        if (touchesCell(op.opcode)) {
+            text += " c" + to_string(op.operand);
+        } else if (operandSize(op.opcode)) {
+            text += " " + to_string(op.operand);
+        }
+    }
+    return text;
+}
+
+// Parses superText() output back into a sequence.
+bool parseSuperText(const string& text, vector<SuperOp>& sequence) {
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ';')) {
+        stringstream fields(item);
+        string mnemonic, operand;
+        if (!(fields >> mnemonic)) {
+            continue;
+        }
+        auto found = opcodeMap.find(mnemonic);
+        if (found == opcodeMap.end()) {
+            return false;
+        }
+        SuperOp op{found->second, 0};
+        fields >> operand;
+        if (touchesCell(op.opcode) != (!operand.empty() && operand[0] == 'c')) {
+            return false;
+        }
+        if (!operand.empty()) {
+            int value = atoi(operand.c_str() + (operand[0] == 'c'));
+            if (value < 0 || value > 255 || (touchesCell(op.opcode) && value >= static_cast<int>(SUPEROPT_CELLS))) {
+                return false;
+            }
+            op.operand = static_cast<uint8_t>(value);
+        }
+        sequence.push_back(op);
+    }
+    return true;
+}
+
+// The rewrites found by the superoptimizer, keyed by "<window> | <live registers>".
+class RewriteDatabase {
+public:
+    /**
+     * Name: parse
+     * Purpouse: Read a rewrite database file.
+     * Inputs:
+     *   - path: The file, as written by save().
+     * Outputs: The database, or nullptr if the file is unreadable or a line is invalid (an
+     *          error message naming the line is printed).
+     * Effects: None
+     */
+    static unique_ptr<RewriteDatabase> parse(const string& path) {
+        ifstream file(path);
+        if (!file.is_open()) {
+            cerr << "Error: Could not open rewrite database " << path << endl;
+            return nullptr;
+        }
+        auto database = make_unique<RewriteDatabase>();
+        string line;
+        for (int number = 1; getline(file, line); number++) {
+            line = line.substr(0, line.find('#'));
+            if (line.find_first_not_of(" \t\r") == string::npos) {
+                continue;
+            }
+            size_t bar = line.find('|');
+            size_t arrow = line.find("=>");
+            vector<SuperOp> window, replacement;
+            string live = bar < arrow ? line.substr(bar + 1, arrow - bar - 1) : "";
+            live.erase(remove(live.begin(), live.end(), ' '), live.end());
+            if (arrow == string::npos || bar > arrow || !parseSuperText(line.substr(0, bar), window) ||
+                !parseSuperText(line.substr(arrow + 2), replacement) || live.find_first_not_of("AB-") != string::npos) {
+                cerr << "Error: " << path << ":" << number << ": expected '<window> | <live> => <replacement>'" << endl;
+                return nullptr;
+            }
+            if (cellCount(replacement) > cellCount(window)) {
+                cerr << "Error: " << path << ":" << number << ": the replacement uses a cell the window does not have" << endl;
+                return nullptr;
+            }
+            database->rewrites[key(window, liveMask(live))] = replacement;
+        }
+        return database;
+    }
+
+    /**
+     * Name: save
+     * Purpouse: Write the database to a file.
+     * Inputs:
+     *   - path: The file.
+     * Outputs: False if the file cannot be written.
+     * Effects: None
+     */
+    bool save(const string& path) const {
+        ofstream file(path);
+        if (!file.is_open()) {
+            cerr << "Error: Could not write rewrite database " << path << endl;
+            return false;
+        }
+        file << "# Superoptimizer rewrites: <window> | <registers live after it> => <cheapest equivalent>" << endl;
+        for (const auto& rewrite : rewrites) {
+            file << rewrite.first << " => " << superText(rewrite.second) << endl;
+        }
+        return file.good();
+    }
+
+    static string key(const vector<SuperOp>& window, uint8_t live) {
+        string registers = string(live & LIVE_A ? "A" : "") + (live & LIVE_B ? "B" : "");
+        return superText(window) + " | " + (registers.empty() ? "-" : registers);
+    }
+
+    const vector<SuperOp>* find(const string& windowKey) const {
+        auto found = rewrites.find(windowKey);
+        return found == rewrites.end() ? nullptr : &found->second;
+    }
+
+    void add(const string& windowKey, const vector<SuperOp>& replacement) {
+        rewrites[windowKey] = replacement;
+    }
+
+    size_t size() const {
+        return rewrites.size();
+    }
+
+    /**
+     * Name: removeUnsound
+     * Purpouse: Re-check every rewrite, so a stale or hand-edited file cannot produce wrong code.
+     * Inputs:
+     *   - path: The file the database came from, for messages.
+     * Outputs: The number of rewrites removed.
+     * Effects: Drops each rewrite that superEquivalent cannot prove matches its window, with
+     *          an error message naming it.
+     */
+    size_t removeUnsound(const string& path) {
+        size_t removed = 0;
+        for (auto rewrite = rewrites.begin(); rewrite != rewrites.end();) {
+            size_t bar = rewrite->first.rfind(" | ");
+            vector<SuperOp> window;
+            parseSuperText(rewrite->first.substr(0, bar), window);
+            if (superEquivalent(window, rewrite->second, liveMask(rewrite->first.substr(bar + 3)), cellCount(window), {})) {
+                ++rewrite;
+                continue;
+            }
+            cerr << "Error: " << path << ": ignoring unsound rewrite '" << rewrite->first << " => " << superText(rewrite->second) << "'" << endl;
+            rewrite = rewrites.erase(rewrite);
+            removed++;
+        }
+        return removed;
+    }
+
+private:
+    // The number of cells a sequence names; windows number theirs from 0 in order of use.
+    static size_t cellCount(const vector<SuperOp>& sequence) {
+        size_t count = 0;
+        for (const SuperOp& op : sequence) {
+            if (touchesCell(op.opcode)) {
+                count = max(count, static_cast<size_t>(op.operand) + 1);
+            }
+        }
+        return count;
+    }
+
+    static uint8_t liveMask(const string& text) {
+        return (text.find('A') != string::npos ? LIVE_A : 0) | (text.find('B') != string::npos ? LIVE_B : 0);
+    }
+
+    map<string, vector<SuperOp>> rewrites;
+};
+
+/**
+ * Name: abstractWindow
+ * Purpouse: Turn a window of generated code into an abstract sequence.
+ * Inputs:
+ *   - code: The generated code.
+ *   - begin, end: The window.
+ *   - window: Receives the abstract sequence.
+ *   - cells: Receives the address of each cell.
+ * Outputs: False if the window holds a label, a control transfer, an address outside the
+ *          zero page (such as a vDSO field, which changes between reads), or too many cells.
+ * Effects: None
+ */
+bool abstractWindow(const vector<MicroCOp>& code, size_t begin, size_t end, vector<SuperOp>& window, vector<uint16_t>& cells) {
+    window.clear();
+    cells.clear();
+    for (size_t i = begin; i < end; i++) {
+        const MicroCOp& op = code[i];
+        switch (op.isLabel ? HALT : op.opcode) {
+            case LOAD_A:
+            case LOAD_B:
+                window.push_back({op.opcode, static_cast<uint8_t>(op.operand)});
+                break;
+            case ADD_A_B:
+            case SUB_A_B:
+            case PUSH_B:
+            case POP_B:
+                window.push_back({op.opcode, 0});
+                break;
+            case LOAD_A_MEM:
+            case LOAD_B_MEM:
+            case STORE_A:
+            case STORE_A_MEM: {
+                if (op.operand >= 0x100) {
+                    return false;
+                }
+                size_t cell = find(cells.begin(), cells.end(), op.operand) - cells.begin();
+                if (cell == cells.size()) {
+                    if (cells.size() == SUPEROPT_CELLS) {
+                        return false;
+                    }
+                    cells.push_back(op.operand);
+                }
+                window.push_back({op.opcode, static_cast<uint8_t>(cell)});
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Name: registerLiveness
+ * Purpouse: Find which registers are live after each instruction of generated code.
+ * Inputs:
+ *   - code: The generated code.
+ * Outputs: LIVE_A/LIVE_B masks, one per instruction.
+ * Effects: None. Both registers are assumed live at labels, jumps, SYSCALL and HALT, where
+ *          the final registers are visible in a dump.
+ */
+vector<uint8_t> registerLiveness(const vector<MicroCOp>& code) {
+    vector<uint8_t> liveAfter(code.size());
+    uint8_t live = LIVE_A | LIVE_B;
+    for (size_t i = code.size(); i-- > 0;) {
+        liveAfter[i] = live;
+        const MicroCOp& op = code[i];
+        switch (op.isLabel ? HALT : op.opcode) {
+            case LOAD_A:
+            case LOAD_A_MEM: live &= ~LIVE_A; break;
+            case LOAD_B:
+            case LOAD_B_MEM:
+            case POP_B: live &= ~LIVE_B; break;
+            case STORE_A:
+            case STORE_A_MEM: live |= LIVE_A; break;
+            case ADD_A_B:
+            case SUB_A_B: live |= LIVE_A | LIVE_B; break;
+            case PUSH_B: live |= LIVE_B; break;
+            default: live = LIVE_A | LIVE_B; break;
+        }
+    }
+    return liveAfter;
+}
+
+/**
+ * Name: applyRewrites
+ * Purpouse: Peephole-optimize generated code with the superoptimizer's rewrites.
+ * Inputs:
+ *   - code: The generated code (rewritten in place).
+ *   - database: The rewrites.
+ * Outputs: The number of rewrites applied.
+ * Effects: Tries the longest windows first and repeats until nothing matches. The first
+ *          source line in a window moves to the first instruction of its replacement; other
+ *          statements merged into the replacement are counted with it when profiling.
+ */
+size_t applyRewrites(vector<MicroCOp>& code, const RewriteDatabase& database) {
+    size_t applied = 0;
+    for (bool changed = true; changed;) {
+        changed = false;
+        vector<uint8_t> liveAfter = registerLiveness(code);
+        vector<SuperOp> window;
+        vector<uint16_t> cells;
+        for (size_t begin = 0; begin < code.size() && !changed; begin++) {
+            for (size_t length = min(SUPEROPT_WINDOW, code.size() - begin); length > 0 && !changed; length--) {
+                if (!abstractWindow(code, begin, begin + length, window, cells)) {
+                    continue;
+                }
+                const vector<SuperOp>* replacement = database.find(RewriteDatabase::key(window, liveAfter[begin + length - 1]));
+                if (!replacement) {
+                    continue;
+                }
+                vector<MicroCOp> ops;
+                for (const SuperOp& op : *replacement) {
+                    ops.push_back({op.opcode, static_cast<uint16_t>(touchesCell(op.opcode) ? cells.at(op.operand) : op.operand)});
+                }
+                int line = 0;
+                for (size_t i = begin; i < begin + length && !line; i++) {
+                    line = code[i].line;
+                }
+                code.erase(code.begin() + begin, code.begin() + begin + length);
+                code.insert(code.begin() + begin, ops.begin(), ops.end());
+                if (line && begin < code.size() && !code[begin].isLabel && !code[begin].line) {
+                    code[begin].line = line;
+                }
+                applied++;
+                changed = true;
+            }
+        }
+    }
+    return applied;
+}
+
+/**
+ * Name: extendRewriteDatabase
+ * Purpouse: Superoptimize every window of generated code not searched before.
+ * Inputs:
+ *   - code: The generated code.
+ *   - database: Receives the rewrites found.
+ *   - searched: The windows already searched (updated).
+ * Outputs: The number of rewrites found.
+ * Effects: Short windows are searched first, and a window containing a shorter one that
+ *          already has a rewrite is skipped, since the peephole pass improves it anyway.
+ */
+size_t extendRewriteDatabase(const vector<MicroCOp>& code, RewriteDatabase& database, unordered_set<string>& searched) {
+    size_t found = 0;
+    vector<uint8_t> liveAfter = registerLiveness(code);
+    vector<SuperOp> window, best;
+    vector<uint16_t> cells;
+    auto keyAt = [&](size_t begin, size_t end) {
+        return abstractWindow(code, begin, end, window, cells) ? RewriteDatabase::key(window, liveAfter[end - 1]) : string();
+    };
+    for (size_t length = 1; length <= SUPEROPT_WINDOW; length++) {
+        for (size_t begin = 0; begin + length <= code.size(); begin++) {
+            string windowKey = keyAt(begin, begin + length);
+            bool covered = windowKey.empty() || database.find(windowKey);
+            for (size_t inner = 1; inner < length && !covered; inner++) {
+                for (size_t start = begin; start + inner <= begin + length && !covered; start++) {
+                    string innerKey = keyAt(start, start + inner);
+                    covered = !innerKey.empty() && database.find(innerKey);
+                }
+            }
+            if (covered || !searched.insert(windowKey).second) {
+                continue;
+            }
+            keyAt(begin, begin + length);
+            if (superoptimize(window, liveAfter[begin + length - 1], cells.size(), best)) {
+                database.add(windowKey, best);
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+/**
+ * Name: compile
+ * Purpouse: Compile a simple Micro-C source file into bytecode.
+ * Inputs:
+ *   - filename: The path to the Micro-C source file.
+ *   - options: Optimization settings.
+ *   - listing: If not null, receives the generated code and the source line of each
+ *              statement at the offset of its first byte (for profiling).
+ * Outputs: A vector of uint8_t representing the compiled bytecode.
+ * Effects: Parses the source file, optimizes it, packs variables whose live ranges do not
+ *          overlap into shared zero-page slots, and translates the program to bytecode,
+ *          selecting the fastest instructions for each expression (the smallest, without
+ *          any unrolling, when optimizing for size). With a profile, the zero page left free goes to unrolling the hottest loops.
+ *          With a rewrite database, the generated code is peephole-optimized.
+ *          If unrolled code does not fit the zero page, compiles again with the default
+ *          unrolling limits, then without unrolling. Prints each variable's address and
+ *          the data footprint.
+ */
+vector<uint8_t> compile(const string& filename, const CompileOptions& options, CompileListing* listing) {
+    vector<string> declared;
+    vector<MicroCStatement> parsed;
+    if (!parseMicroC(filename, declared, parsed)) {
+        return {};
+    }
+    unordered_set<string> names(declared.begin(), declared.end());
+    enum UnrollMode { UNROLL_PROFILE, UNROLL_DEFAULT, UNROLL_NONE };
+    vector<UnrollMode> modes = {UNROLL_DEFAULT, UNROLL_NONE};
+    if (options.optimizeSize) {
+        modes = {UNROLL_NONE}; // Unrolling only ever grows the code
+    } else if (options.optimize && options.profile) {
+        modes.insert(modes.begin(), UNROLL_PROFILE);
+        if (options.profile->source != filename) {
+            cout << "Compiling: Warning: the profile was taken from '" << options.profile->source << "'" << endl;
+        }
+    }
+    for (UnrollMode mode : modes) {
+        bool unroll = mode != UNROLL_NONE;
+        vector<MicroCStatement> statements = parsed;
+        if (options.optimize) {
+            unordered_map<string, uint8_t> known;
+            for (const string& name : declared) {
+                known[name] = 0; // The allocator keeps variables read before assignment zero
+            }
+            foldConstants(statements, known, names);
+            size_t hoisted = hoistInvariants(statements, names);
+            unordered_map<int, size_t> budgets;
+            if (mode == UNROLL_PROFILE) {
+                vector<MicroCInstruction> rolled;
+                size_t labels = 0;
+                lowerMicroC(statements, names, rolled, labels);
+                unordered_map<string, size_t> slots;
+                size_t maxLive = 0;
+                int maxLiveLine = 0;
+                size_t used = microCCost(statements, names).bytes + 1 + allocateVariableSlots(declared, rolled, slots, maxLive, maxLiveLine);
+                planUnrolling(statements, names, *options.profile, used < 0x100 ? 0x100 - used : 0, budgets);
+            }
+            size_t unrolled = unroll ? unrollLoops(statements, names, mode == UNROLL_PROFILE ? &budgets : nullptr) : 0;
+            if (unrolled) {
+                known.clear();
+                for (const string& name : declared) {
+                    known[name] = 0;
+                }
+                foldConstants(statements, known, names);
+            }
+            if (hoisted || unrolled) {
+                cout << dec << "Compiling: Hoisted " << hoisted << " loop-invariant statement(s), unrolled " << unrolled << " loop(s)" << endl;
+            }
+        }
+        vector<MicroCInstruction> program;
+        size_t labelCount = 0;
+        lowerMicroC(statements, names, program, labelCount);
+
+        unordered_map<string, size_t> slots;
+        size_t maxLive = 0;
+        int maxLiveLine = 0;
+        size_t slotCount = allocateVariableSlots(declared, program, slots, maxLive, maxLiveLine);
+
+        // Variables are allocated downward from the top of the zero page so they stay clear
+        // of the code, which is loaded upward from USER_PROGRAM_START_ADDRESS.
+        unordered_map<string, uint8_t> variables;
+        for (const auto& slot : slots) {
+            variables[slot.first] = static_cast<uint8_t>(0xFF - slot.second);
+        }
+        vector<MicroCOp> code;
+        if (!selectMicroC(program, variables, options.optimizeSize, code)) {
+            return {};
+        }
+        size_t rewritten = options.optimize && options.rewrites ? applyRewrites(code, *options.rewrites) : 0;
+        vector<uint8_t> assemblyOutput;
+        vector<int> lines;
+        encodeMicroC(code, assemblyOutput, &lines);
+        size_t codeEnd = USER_PROGRAM_START_ADDRESS + assemblyOutput.size();
+        size_t available = codeEnd <= 0x100 ? 0x100 - codeEnd : 0;
+        if (slotCount > available) {
+            if (options.optimize && unroll) {
+                cout << "Compiling: Unrolled code does not fit the zero page; compiling "
+                     << (mode == UNROLL_PROFILE ? "with the default unrolling limits" : "without unrolling") << endl;
+                continue;
+            }
+            cerr << "Error: Variables need " << slotCount << " zero-page slots (" << maxLive << " live at once at line " << maxLiveLine
+                 << ") but only " << available << " bytes are free above the " << assemblyOutput.size() << " bytes of code" << endl;
+            return {};
+        }
+        for (const string& name : declared) {
+            if (!variables.count(name)) {
+                cout << "Compiling: Variable '" << name << "' is never used; no slot allocated" << endl;
+            } else {
+                cout << "Compiling: Declared variable '" << name << "' at address " << dec << (int)variables[name] << endl;
+            }
+        }
+        if (rewritten) {
+            cout << dec << "Compiling: Applied " << rewritten << " superoptimizer rewrite(s)" << endl;
+        }
+        if (listing) {
+            listing->code = move(code);
+            listing->lines = move(lines);
+        }
+        cout << dec << "Compiling: " << slots.size() << " variables in " << slotCount << " zero-page bytes";
+        if (slotCount > 0) {
+            cout << " (" << 0x100 - slotCount << "-255, at most " << maxLive << " live at once)";
+        }
+        cout << ", " << assemblyOutput.size() << " bytes of code" << endl;
+        return assemblyOutput;
+    }
+    return {};
+}
+
+/**
+ * Name: buildProgram
+ * Purpouse: Produce bytecode from a source file, choosing the tool by extension.
+ * Inputs:
+ *   - filename: A Micro-C (.mc) or assembly file.
+ *   - options: Compiler settings, for Micro-C.
+ * Outputs: The bytecode, or an empty vector on failure.
+ * Effects: Runs the compiler or the assembler.
+ */
+vector<uint8_t> buildProgram(const string& filename, const CompileOptions& options) {
+    bool microC = filename.size() >= 3 && filename.compare(filename.size() - 3, 3, ".mc") == 0;
+    return microC ? compile(filename, options, nullptr) : assemble(filename);
+}
+
+// Fleet runner: many CPU instances in one process, spread across worker threads and run in
+// round-robin slices of FLEET_SLICE instructions.
+const uint64_t FLEET_SLICE = 1000;
+
+// Fleet results: a columnar binary file with one row per machine. A header and a column
+// directory are followed by one contiguous array per column, each starting on a
+// RESULT_ALIGNMENT boundary, with little-endian fixed-width values (the layout of Arrow
+// primitive and fixed-size-binary buffers). A reader maps the file and uses each column
+// as a typed array without parsing anything. Rows are in completion order; the "machine"
+// column holds each row's machine index.
+const char RESULT_MAGIC[8] = {'E', 'M', 'U', 'R', 'S', 'L', 'T', '1'};
+const uint32_t RESULT_VERSION = 1;
+const uint32_t RESULT_UINT = 1;  // Unsigned integers, width bytes each
+const uint32_t RESULT_BYTES = 2; // Fixed-size binary, width bytes per row
+const uint64_t RESULT_ALIGNMENT = 64;
+const size_t RESULT_BATCH_ROWS = 4096;
+
+struct ResultHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t columns;
+    uint64_t rows;
+};
+
+struct ResultColumn {
+    char name[40]; // NUL-terminated
+    uint32_t type;
+    uint32_t width;
+    uint64_t offset; // From the start of the file
+    uint64_t reserved;
+};
+
+// A memory range captured into a RESULT_BYTES column, read in each machine's current bank.
+struct ResultRange {
+    uint16_t address;
+    uint16_t length;
+};
+
+class ResultSink {
+public:
+    /**
+     * Name: create
+     * Purpouse: Create a result file sized for a known number of rows.
+     * Inputs:
+     *   - path: The output file (replaced).
+     *   - rows: The number of rows that will be written.
+     *   - ranges: Memory ranges to capture, one column each.
+     * Outputs: The sink, or nullptr on failure (an error message is printed).
+     * Effects: Writes the header and column directory and extends the file to its final
+     *          size, so batches can be written anywhere in it concurrently.
+     */
+    static unique_ptr<ResultSink> create(const string& path, uint64_t rows, const vector<ResultRange>& ranges) {
+#if !defined(_WIN32)
+        auto sink = unique_ptr<ResultSink>(new ResultSink());
+        sink->ranges = ranges;
+        sink->rows = rows;
+        sink->addColumn("machine", RESULT_UINT, 4);
+        sink->addColumn("a", RESULT_UINT, 1);
+        sink->addColumn("b", RESULT_UINT, 1);
+        sink->addColumn("pc", RESULT_UINT, 2);
+        sink->addColumn("sp", RESULT_UINT, 2);
+        sink->addColumn("bank", RESULT_UINT, 1);
+        sink->addColumn("halted", RESULT_UINT, 1); // 0 when stopped at the budget
+        sink->addColumn("instructions", RESULT_UINT, 8);
+        for (const ResultRange& range : ranges) {
+            stringstream name;
+            name << "mem_0x" << hex << setw(4) << setfill('0') << range.address << dec << "_" << range.length;
+            sink->addColumn(name.str(), RESULT_BYTES, range.length);
+        }
+        uint64_t offset = sizeof(ResultHeader) + sink->columns.size() * sizeof(ResultColumn);
+        for (ResultColumn& column : sink->columns) {
+            offset = (offset + RESULT_ALIGNMENT - 1) / RESULT_ALIGNMENT * RESULT_ALIGNMENT;
+            column.offset = offset;
+            offset += rows * column.width;
+        }
+        sink->length = offset;
+        ResultHeader header{};
+        memcpy(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+        header.version = RESULT_VERSION;
+        header.columns = static_cast<uint32_t>(sink->columns.size());
+        header.rows = rows;
+        sink->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (sink->fd < 0 || ftruncate(sink->fd, static_cast<off_t>(sink->length)) != 0 ||
+            !sink->writeAt(reinterpret_cast<const uint8_t*>(&header), sizeof(header), 0) ||
+            !sink->writeAt(reinterpret_cast<const uint8_t*>(sink->columns.data()), sink->columns.size() * sizeof(ResultColumn), sizeof(header))) {
+            cerr << "Error: Could not create result file " << path << endl;
+            return nullptr;
+        }
+        return sink;
+#else
+        (void)rows;
+        (void)ranges;
+        cerr << "Error: Result files need a POSIX host (" << path << ")" << endl;
+        return nullptr;
+#endif
+    }
+
+    ~ResultSink() {
+#if !defined(_WIN32)
+        if (fd >= 0) {
+            ::close(fd);
+        }
+#endif
+    }
+
+    // A per-thread row builder. Rows accumulate in private column buffers; a full batch
+    // claims its row range with one atomic add and is written with one pwrite per column.
+    class Batch {
+    public:
+        explicit Batch(ResultSink& owner) : sink(owner), buffers(owner.columns.size()) {}
+
+        ~Batch() {
+            flush();
+        }
+
+        /**
+         * Name: append
+         * Purpouse: Add a finished machine as a row.
+         * Inputs:
+         *   - index: The machine's index in the fleet.
+         *   - machine: The machine.
+         *   - halted: False if the machine was stopped at its budget.
+         * Outputs: None
+         * Effects: Flushes the batch when it reaches RESULT_BATCH_ROWS rows.
+         */
+        void append(uint64_t index, const CPU& machine, bool halted);
+
+        void flush() {
+            if (count == 0) {
+                return;
+            }
+            uint64_t first = sink.nextRow.fetch_add(count);
+            for (size_t c = 0; c < buffers.size(); c++) {
+                const ResultColumn& column = sink.columns[c];
+                if (first + count > sink.rows ||
+                    !sink.writeAt(buffers[c].data(), buffers[c].size(), column.offset + first * column.width)) {
+                    sink.failed.store(true);
+                }
+                buffers[c].clear();
+            }
+            count = 0;
+        }
+
+    private:
+        void put(size_t column, uint64_t value) {
+            for (uint32_t i = 0; i < sink.columns[column].width; i++) {
+                buffers[column].push_back(static_cast<uint8_t>(value >> (8 * i)));
+            }
+        }
+
+        ResultSink& sink;
+        vector<vector<uint8_t>> buffers;
+        uint64_t count = 0;
+    };
+
+    uint64_t rowsWritten() const {
+        return min(nextRow.load(), rows);
+    }
+
+    bool ok() const {
+        return !failed.load();
+    }
+
+    uint64_t size() const {
+        return length;
+    }
+
+    size_t columnCount() const {
+        return columns.size();
+    }
+
+private:
+    ResultSink() = default;
+
+    void addColumn(const string& name, uint32_t type, uint32_t width) {
+        ResultColumn column{};
+        strncpy(column.name, name.c_str(), sizeof(column.name) - 1);
+        column.type = type;
+        column.width = width;
+        columns.push_back(column);
+    }
+
+    bool writeAt(const uint8_t* data, size_t count, uint64_t offset) {
+#if !defined(_WIN32)
+        while (count > 0) {
+            ssize_t written = pwrite(fd, data, count, static_cast<off_t>(offset));
+            if (written <= 0) {
+                return false;
+            }
+            data += written;
+            count -= static_cast<size_t>(written);
+            offset += static_cast<uint64_t>(written);
+        }
+        return true;
+#else
+        (void)data;
+        (void)offset;
+        return count == 0;
+#endif
+    }
+
+    int fd = -1;
+    uint64_t rows = 0;
+    uint64_t length = 0;
+    vector<ResultColumn> columns;
+    vector<ResultRange> ranges;
+    atomic<uint64_t> nextRow{0};
+    atomic<bool> failed{false};
+};
+
+void ResultSink::Batch::append(uint64_t index, const CPU& machine, bool halted) {
+    put(0, index);
+    put(1, machine.reg_A);
+    put(2, machine.reg_B);
+    put(3, machine.pc);
+    put(4, machine.sp);
+    put(5, machine.memory.bank());
+    put(6, halted);
+    put(7, machine.instructionCount);
+    for (size_t r = 0; r < sink.ranges.size(); r++) {
+        vector<uint8_t>& buffer = buffers[8 + r];
+        size_t at = buffer.size();
+        buffer.resize(at + sink.ranges[r].length);
+        machine.memory.read(sink.ranges[r].address, buffer.data() + at, sink.ranges[r].length);
+    }
+    if (++count == RESULT_BATCH_ROWS) {
+        flush();
+    }
+}
+
+// Parameter sweeps: a text file declaring what each fleet machine starts with, one
+// dimension per line ("target = values", ';' starts a comment):
+//
+//   A = 0..255 step 5                      registers A and B
+//   B = 1, 2, 4                            a list
+//   mem 0x20 = random 0..99 x 16 seed 7    16 draws from a seeded generator
+//   mem 0x4000:2 = 100..900 step 100       a little-endian value 1-8 bytes wide
+//
+// The sweep is the cartesian product of its dimensions, numbered in mixed radix with the
+// last line varying fastest. Nothing is materialized: machine i computes combination
+// i % combinations() from its digits when its worker builds it, and a random value is
+// splitmix64(seed + draw), so any instance can be generated independently.
+enum SweepTarget { SWEEP_REG_A, SWEEP_REG_B, SWEEP_MEMORY };
+
+struct SweepDimension {
+    SweepTarget target = SWEEP_MEMORY;
+    uint16_t address = 0;
+    uint8_t width = 1;
+    bool random = false;
+    uint64_t first = 0; // Range (or random range) bounds
+    uint64_t last = 0;
+    uint64_t step = 1;
+    uint64_t count = 0; // Number of values
+    uint64_t seed = 0;
+    vector<uint64_t> values; // A list; empty for ranges
+
+    uint64_t value(uint64_t index) const {
+        if (!values.empty()) {
+            return values[index];
+        }
+        if (random) {
+            uint64_t span = last - first + 1;
+            uint64_t draw = splitmix64(seed + index * 0x9E3779B97F4A7C15ull);
+            return span == 0 ? draw : first + draw % span;
+        }
+        return first + index * step;
+    }
+};
+
+class ParameterSweep {
+public:
+    /**
+     * Name: parse
+     * Purpouse: Read a sweep file.
+     * Inputs:
+     *   - path: The file.
+     * Outputs: The sweep, or nullptr if the file is unreadable or a line is invalid (an error
+     *          message naming the line is printed).
+     * Effects: None
+     */
+    static unique_ptr<ParameterSweep> parse(const string& path) {
+        ifstream file(path);
+        if (!file.is_open()) {
+            cerr << "Error: Could not open sweep file " << path << endl;
+            return nullptr;
+        }
+        auto sweep = make_unique<ParameterSweep>();
+        string line;
+        for (int number = 1; getline(file, line); number++) {
+            line = line.substr(0, line.find(';'));
+            if (line.find_first_not_of(" \t\r") == string::npos) {
+                continue;
+            }
+            SweepDimension dimension;
+            string error = parseDimension(line, dimension);
+            if (error.empty() && dimension.count == 0) {
+                error = "no values";
+            } else if (error.empty() && sweep->total > UINT64_MAX / dimension.count) {
+                error = "too many combinations";
+            }
+            if (!error.empty()) {
+                cerr << "Error: " << path << ":" << number << ": " << error << endl;
+                return nullptr;
+            }
+            sweep->total *= dimension.count;
+            sweep->dimensions.push_back(move(dimension));
+        }
+        return sweep;
+    }
+
+    uint64_t combinations() const {
+        return total;
+    }
+
+    size_t dimensionCount() const {
+        return dimensions.size();
+    }
+
+    /**
+     * Name: apply
+     * Purpouse: Initialize a machine with its combination of the sweep.
+     * Inputs:
+     *   - instance: The machine's index in the fleet.
+     *   - machine: A machine with its program loaded.
+     * Outputs: None
+     * Effects: Sets the swept registers and writes the swept memory.
+     */
+    void apply(uint64_t instance, CPU& machine) const {
+        if (total == 0) {
+            return;
+        }
+        uint64_t rest = instance % total;
+        for (size_t d = dimensions.size(); d-- > 0;) {
+            const SweepDimension& dimension = dimensions[d];
+            uint64_t value = dimension.value(rest % dimension.count);
+            rest /= dimension.count;
+            if (dimension.target == SWEEP_REG_A) {
+                machine.reg_A = static_cast<uint8_t>(value);
+            } else if (dimension.target == SWEEP_REG_B) {
+                machine.reg_B = static_cast<uint8_t>(value);
+            } else {
+                uint8_t bytes[8];
+                for (int i = 0; i < dimension.width; i++) {
+                    bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+                }
+                machine.memory.write(dimension.address, bytes, dimension.width);
+            }
+        }
+    }
+
+private:
+    /**
+     * Name: parseDimension
+     * Purpouse: Parse one "target = values" line.
+     * Inputs:
+     *   - line: The line without its comment.
+     *   - dimension: Receives the dimension.
+     * Outputs: An error message, or an empty string on success.
+     * Effects: None
+     */
+    static string parseDimension(const string& line, SweepDimension& dimension) {
+        size_t equals = line.find('=');
+        if (equals == string::npos) {
+            return "expected 'target = values'";
+        }
+        stringstream target(line.substr(0, equals));
+        string name;
+        string location;
+        target >> name >> location;
+        try {
+            if (name == "A" || name == "B") {
+                dimension.target = name == "A" ? SWEEP_REG_A : SWEEP_REG_B;
+            } else if (name == "mem" && !location.empty()) {
+                size_t colon = location.find(':');
+                unsigned long address = stoul(location.substr(0, colon), nullptr, 0);
+                unsigned long width = colon == string::npos ? 1 : stoul(location.substr(colon + 1), nullptr, 0);
+                if (location.find('-') != string::npos || width < 1 || width > 8 || address >= ADDRESS_SPACE_SIZE ||
+                    width > ADDRESS_SPACE_SIZE - address) {
+                    return "memory target must be 1-8 bytes inside the address space";
+                }
+                dimension.address = static_cast<uint16_t>(address);
+                dimension.width = static_cast<uint8_t>(width);
+            } else {
+                return "unknown target '" + name + "' (use A, B or mem <address>[:<bytes>])";
+            }
+
+            string values = line.substr(equals + 1);
+            stringstream words(values);
+            string word;
+            words >> word;
+            dimension.random = word == "random";
+            if (dimension.random) {
+                words >> word;
+            }
+            size_t dots = word.find("..");
+            if (dots != string::npos) {
+                dimension.first = stoull(word.substr(0, dots), nullptr, 0);
+                dimension.last = stoull(word.substr(dots + 2), nullptr, 0);
+                string keyword;
+                uint64_t number = 0;
+                while (words >> keyword) {
+                    string operand;
+                    if (!(words >> operand)) {
+                        return "'" + keyword + "' needs a value";
+                    }
+                    number = stoull(operand, nullptr, 0);
+                    if (keyword == "step" && !dimension.random && number > 0) {
+                        dimension.step = number;
+                    } else if (keyword == "x" && dimension.random && number > 0) {
+                        dimension.count = number;
+                    } else if (keyword == "seed" && dimension.random) {
+                        dimension.seed = number;
+                    } else {
+                        return "unexpected '" + keyword + " " + operand + "'";
+                    }
+                }
+                if (dimension.first > dimension.last) {
+                    return "empty range";
+                }
+                if (dimension.random && dimension.count == 0) {
+                    return "random values need a count ('x <n>')";
+                }
+                if (!dimension.random) {
+                    uint64_t steps = (dimension.last - dimension.first) / dimension.step;
+                    if (steps == UINT64_MAX) {
+                        return "too many values in the range";
+                    }
+                    dimension.count = steps + 1;
+                }
+            } else if (!dimension.random) {
+                stringstream list(values);
+                string item;
+                while (getline(list, item, ',')) {
+                    dimension.values.push_back(stoull(item, nullptr, 0));
+                }
+                if (dimension.values.empty()) {
+                    return "no values";
+                }
+                dimension.count = dimension.values.size();
+                dimension.last = *max_element(dimension.values.begin(), dimension.values.end());
+            } else {
+                return "random values need a range ('random <first>..<last> x <n>')";
+            }
+        } catch (const exception&) {
+            return "invalid number";
+        }
+        int bits = dimension.target == SWEEP_MEMORY ? 8 * dimension.width : 8;
+        if (bits < 64 && dimension.last >> bits) {
+            return "value does not fit the target";
+        }
+        return "";
+    }
+
+    vector<SweepDimension> dimensions;
+    uint64_t total = 1;
+};
+
+struct FleetOptions {
+    size_t machines = 1;
+    size_t threads = 1;
+    bool pinThreads = true;     // Pin workers to CPUs, spread across NUMA nodes
+    uint64_t budget = 10000000; // Instructions per machine before it is stopped
+    bool network = false;
+    uint64_t latencyMicroseconds = 0;
+    uint64_t bytesPerSecond = 0; // 0 = unlimited
+    string resultPath;           // Columnar result file; empty for none
+    vector<ResultRange> resultRanges;
+    shared_ptr<const ParameterSweep> sweep; // Per-machine initial values; null for none
+};
+
+/**
+ * Name: parseCpuList
+ * Purpouse: Parse a Linux CPU list such as "0-3,8-11".
+ * Inputs:
+ *   - text: The list.
+ * Outputs: The CPU numbers.
+ * Effects: None
+ */
+vector<int> parseCpuList(const string& text) {
+    vector<int> cpus;
+    stringstream ss(text);
+    string range;
+    while (getline(ss, range, ',')) {
+        size_t dash = range.find('-');
+        try {
+            int first = stoi(range.substr(0, dash));
+            int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        } catch (const exception&) {
+            // Skip malformed entries
+        }
+    }
+    return cpus;
+}
+
+/**
+ * Name: hostNumaNodes
+ * Purpouse: Discover which host CPUs belong to which NUMA node.
+ * Inputs: None
+ * Outputs: One CPU list per node with CPUs; never empty.
+ * Effects: Reads /sys on Linux. Elsewhere, or when that fails, all CPUs form a single node.
+ */
+vector<vector<int>> hostNumaNodes() {
+    vector<vector<int>> nodes;
+#if defined(__linux__)
+    for (int node = 0; ; node++) {
+        ifstream list("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        if (!list.is_open()) {
+            break;
+        }
+        string text;
+        getline(list, text);
+        vector<int> cpus = parseCpuList(text);
+        if (!cpus.empty()) {
+            nodes.push_back(move(cpus));
+        }
+    }
+#endif
+    if (nodes.empty()) {
+        vector<int> cpus;
+        for (unsigned cpu = 0; cpu < max(1u, thread::hardware_concurrency()); cpu++) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+        nodes.push_back(move(cpus));
+    }
+    return nodes;
+}
+
+/**
+ * Name: pinWorker
+ * Purpouse: Pin the calling worker thread to one host CPU.
+ * Inputs:
+ *   - worker: The worker index; consecutive workers go to different NUMA nodes.
+ *   - nodes: The host topology from hostNumaNodes().
+ * Outputs: True if the thread was pinned.
+ * Effects: Sets the thread's CPU affinity on Linux; does nothing elsewhere.
+ */
+bool pinWorker(size_t worker, const vector<vector<int>>& nodes) {
+#if defined(__linux__)
+    const vector<int>& cpus = nodes[worker % nodes.size()];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[(worker / nodes.size()) % cpus.size()], &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)worker;
+    (void)nodes;
+    return false;
+#endif
+}
+
+// Destroys a machine built in a PageArena; the arena owns the storage.
+struct ArenaMachineDeleter {
+    void operator()(CPU* machine) const {
+        machine->~CPU();
+    }
+};
+
+/**
+ * Name: runFleet
+ * Purpouse: Run copies of a program on many emulated machines at once.
+ * Inputs:
+ *   - program: The bytecode every machine loads.
+ *   - options: Machine and thread counts, the per-machine budget and network settings.
+ * Outputs: None (prints a summary to standard output)
+ * Effects: Each machine gets its index as PID. With the network enabled, every machine's
+ *          NIC is attached to one shared VirtualNetwork, addressed by PID. Each worker is
+ *          pinned (when the host allows it) and builds its own machines in a private
+ *          huge-page arena, so their state is first touched on the worker's NUMA node.
+ *          With a sweep, each worker initializes its machines with their combinations as it
+ *          builds them. With a result path, every machine's final state is written as one
+ *          row of a columnar result file as soon as it stops.
+ */
+void runFleet(const vector<uint8_t>& program, const FleetOptions& options) {
+    if (options.network && options.machines > 256) {
+        cout << "A virtual network supports at most 256 machines (PIDs are 8-bit)." << endl;
+        return;
+    }
+    unique_ptr<VirtualNetwork> network;
+    if (options.network) {
+        network = make_unique<VirtualNetwork>(options.machines, options.latencyMicroseconds, options.bytesPerSecond);
+    }
+    unique_ptr<ResultSink> results;
+    if (!options.resultPath.empty()) {
+        results = ResultSink::create(options.resultPath, options.machines, options.resultRanges);
+        if (!results) {
+            return;
+        }
+    }
+    vector<vector<int>> nodes = hostNumaNodes();
+    // Declared before the machines so the arenas outlive them.
+    vector<unique_ptr<PageArena>> arenas(options.threads);
+    vector<unique_ptr<CPU, ArenaMachineDeleter>> machines(options.machines);
+
+    atomic<uint64_t> totalInstructions{0};
+    atomic<size_t> outOfBudget{0};
+    atomic<size_t> workersReady{0};
+    atomic<size_t> workersPinned{0};
+    atomic<bool> go{false};
+    chrono::steady_clock::time_point start;
+    vector<thread> workers;
+    for (size_t w = 0; w < options.threads; w++) {
+        workers.emplace_back([&, w] {
+            if (options.pinThreads && pinWorker(w, nodes)) {
+                workersPinned++;
+            }
+            arenas[w] = make_unique<PageArena>();
+            PageArena& arena = *arenas[w];
+            for (size_t i = w; i < machines.size(); i += options.threads) {
+                CPU* machine = new (arena.allocate(sizeof(CPU), alignof(CPU))) CPU();
+                machines[i].reset(machine);
+                machine->memory.setPageAllocator(&arena);
+                machine->trace = false;
+                machine->pid = static_cast<uint8_t>(i);
+                machine->loadProgram(program, USER_PROGRAM_START_ADDRESS);
+                machine->pc = USER_PROGRAM_START_ADDRESS;
+                if (options.sweep) {
+                    options.sweep->apply(i, *machine);
+                }
+                if (network) {
+                    machine->network = network.get();
+                    network->setArrivalCallback(static_cast<uint8_t>(i), [machine] { machine->raiseInterrupt(IRQ_NET); });
+                }
+            }
+            // Machines may talk to each other, so nobody runs until every worker has built its share.
+            if (++workersReady == options.threads) {
+                start = chrono::steady_clock::now();
+                go.store(true);
+            }
+            while (!go.load()) {
+                this_thread::yield();
+            }
+
+            uint64_t executed = 0;
+            size_t stopped = 0;
+            unique_ptr<ResultSink::Batch> batch = results ? make_unique<ResultSink::Batch>(*results) : nullptr;
+            bool active = true;
+            while (active) {
+                active = false;
+                for (size_t i = w; i < machines.size(); i += options.threads) {
+                    CPU& machine = *machines[i];
+                    if (machine.halted) {
+                        continue;
+                    }
+                    executed += machine.run(min(FLEET_SLICE, options.budget - machine.instructionCount));
+                    bool atBudget = !machine.halted && machine.instructionCount >= options.budget;
+                    if (atBudget) {
+                        machine.halted = true;
+                        stopped++;
+                    }
+                    if (batch && machine.halted) {
+                        batch->append(i, machine, !atBudget);
+                    }
+                    active |= !machine.halted;
+                }
+            }
+            batch.reset();
+            totalInstructions += executed;
+            outOfBudget += stopped;
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "Fleet: " << options.machines << " machines on " << options.threads << " threads, "
+         << totalInstructions.load() << " instructions in " << fixed << setprecision(3) << seconds * 1000 << " ms ("
+         << setprecision(1) << totalInstructions.load() / max(seconds, 1e-9) / 1e6 << " MIPS)." << defaultfloat << endl;
+    cout << "Halted: " << options.machines - outOfBudget.load() << ", stopped at budget: " << outOfBudget.load() << endl;
+    size_t arenaBytes = 0;
+    for (const auto& arena : arenas) {
+        arenaBytes += arena->bytesReserved();
+    }
+    cout << "Workers pinned: " << workersPinned.load() << "/" << options.threads << " across " << nodes.size()
+         << " NUMA node(s), arenas: " << arenaBytes / 1024 << " KB" << endl;
+    if (results) {
+        cout << "Results: " << results->rowsWritten() << " rows x " << results->columnCount() << " columns in '" << options.resultPath
+             << "' (" << results->size() << " bytes)" << (results->ok() ? "" : ", WRITE FAILED") << endl;
+    }
+    if (network) {
+        cout << "Network: " << network->sent.load() << " sent, " << network->delivered.load() << " delivered, "
+             << network->dropped.load() << " dropped" << endl;
+    }
+    if (machines.size() <= 8) {
+        for (const auto& machine : machines) {
+            cout << "  PID " << (int)machine->pid << ": A=" << (int)machine->reg_A << " B=" << (int)machine->reg_B
+                 << " instructions=" << machine->instructionCount << endl;
         }
     }
-    return program;
 }
 
+// Job server: tenants share a pool of worker threads that run their jobs' machines in
+// run(budget) slices of up to JOB_SLICE instructions. Each slice goes to the tenant with the
+// least weighted service so far (start-time fair queuing, the WFQ variant that copes with
+// slices of unknown length), so over any busy period tenants receive instructions in
+// proportion to their weights however much work each one queues. Quotas bound a tenant's
+// total instructions, the private memory pages its machines hold and how many machines it
+// has at once; further instances wait for a slot rather than being built up front.
+const uint64_t JOB_SLICE = 10000;
+
+struct TenantQuota {
+    uint64_t instructions = 0; // Across all of the tenant's jobs; 0 = unlimited
+    size_t pages = 0;          // Private memory pages held at once; 0 = unlimited
+    size_t instances = 0;      // Machines admitted at once; 0 = one per worker thread
+};
+
+struct TenantAccount {
+    uint64_t instructions = 0;
+    double cpuSeconds = 0; // Worker thread CPU time spent in the tenant's slices
+    uint64_t slices = 0;
+    size_t halted = 0;
+    size_t stopped = 0; // Reached their job's instruction budget
+    size_t killed = 0;  // Ended by a quota
+    double finishedAt = 0; // Seconds into the last serve()
+};
+
 /**
- * Name: assemble
- * Purpouse: Assemble a simple assembly language file into bytecode.
- * Inputs:
- *   - filename: The path to the assembly file.
- * Outputs: A vector of uint8_t representing the assembled bytecode.
- * Effects: Reads the assembly file, translates instructions to opcodes, and handles labels.
+ * Name: threadCpuSeconds
+ * Purpouse: Read the calling thread's CPU clock.
+ * Inputs: None
+ * Outputs: Seconds of CPU time; only differences are meaningful.
+ * Effects: None. Falls back to the wall clock where there is no per-thread clock.
  */
-vector<uint8_t> assemble(const string& filename) {
-    ifstream file(filename);
-    if (!file.is_open()) {
-        cerr << "Error: Could not open assembly file " << filename << endl;
-        return {};
+double threadCpuSeconds() {
+#if !defined(_WIN32)
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+#else
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+class JobServer {
+public:
+    /**
+     * Name: setTenant
+     * Purpouse: Add a tenant or change its weight and quotas.
+     * Inputs:
+     *   - name: The tenant.
+     *   - weight: Its share of the workers relative to other tenants (> 0).
+     *   - quota: Its limits.
+     * Outputs: None
+     * Effects: Accounting of an existing tenant is kept.
+     */
+    void setTenant(const string& name, double weight, const TenantQuota& quota) {
+        Tenant* tenant = find(name);
+        if (!tenant) {
+            tenants.emplace_back();
+            tenant = &tenants.back();
+            tenant->name = name;
+        }
+        tenant->weight = weight;
+        tenant->quota = quota;
     }
-    string line;
-    vector<string> lines;
-    while (getline(file, line)) {
-        lines.push_back(line);
+
+    /**
+     * Name: submit
+     * Purpouse: Queue copies of a program for a tenant.
+     * Inputs:
+     *   - tenant: An existing tenant.
+     *   - program: The bytecode.
+     *   - copies: How many machines run it.
+     *   - budget: Instructions per machine before it is stopped.
+     * Outputs: False if the tenant does not exist.
+     * Effects: Nothing runs until serve().
+     */
+    bool submit(const string& tenant, vector<uint8_t> program, size_t copies, uint64_t budget) {
+        Tenant* owner = find(tenant);
+        if (!owner) {
+            return false;
+        }
+        jobs.push_back({make_shared<const vector<uint8_t>>(move(program)), budget});
+        owner->waiting.push_back({jobs.size() - 1, copies});
+        return true;
     }
-    file.close();
-    vector<uint8_t> bytecode;
-    map<string, uint16_t> labels;
-    uint16_t address = USER_PROGRAM_START_ADDRESS;
-    for (const auto& l : lines) {
-        stringstream ss(l);
-        string token;
-        ss >> token;
-        if (token.empty() || token[0] == ';') continue;
-        if (token.back() == ':') {
-            labels[token.substr(0, token.size() - 1)] = address;
-            ss >> token;
+
+    /**
+     * Name: serve
+     * Purpouse: Run every queued instance to completion.
+     * Inputs:
+     *   - threads: Worker threads.
+     * Outputs: None (prints per-tenant accounting to standard output)
+     * Effects: Machines are built one at a time as they are admitted, outside the lock, and
+     *          destroyed when they halt, reach their budget or break a quota. When a tenant's instruction quota runs out, its
+     *          remaining instances are killed.
+     */
+    void serve(size_t threads) {
+        for (Tenant& tenant : tenants) {
+            tenant.virtualTime = 0;
         }
-        if (opcodeMap.count(token)) {
-            address++;
-            if (token == "LOAD_A" || token == "LOAD_B" || token == "JMP" || token == "STORE_A") {
-                address++;
-            }
+        start = chrono::steady_clock::now();
+        workerCount = threads;
+        vector<thread> workers;
+        for (size_t w = 0; w < threads; w++) {
+            workers.emplace_back([this] { work(); });
+        }
+        for (auto& worker : workers) {
+            worker.join();
         }
+        jobs.clear();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Served " << tenants.size() << " tenant(s) on " << threads << " thread(s) in " << fixed << setprecision(3)
+             << seconds * 1000 << " ms." << defaultfloat << endl;
+        printTenants();
     }
-    for (const auto& l : lines) {
-        stringstream ss(l);
-        string token;
-        ss >> token;
-        if (token.empty() || token[0] == ';') continue;
-        if (token.back() == ':') {
-            ss >> token;
+
+    /**
+     * Name: printTenants
+     * Purpouse: Print each tenant's weight, quotas, queue and accounting.
+     * Inputs: None
+     * Outputs: None (prints to standard output)
+     * Effects: None
+     */
+    void printTenants() const {
+        uint64_t total = 0;
+        for (const Tenant& tenant : tenants) {
+            total += tenant.account.instructions;
         }
-        if (opcodeMap.count(token)) {
-            bytecode.push_back(opcodeMap.at(token));
-            if (token == "LOAD_A" || token == "LOAD_B" || token == "JMP" || token == "STORE_A") {
-                string operand;
-                ss >> operand;
-                if (labels.count(operand)) {
-                    bytecode.push_back(static_cast<uint8_t>(labels.at(operand)));
-                } else {
-                    try {
-                        bytecode.push_back(static_cast<uint8_t>(stoi(operand, nullptr, 10)));
-                    } catch (...) {
-                        cerr << "Error: Invalid operand '" << operand << "'" << endl;
-                        return {};
-                    }
-                }
+        cout << left << setw(12) << "  tenant" << right << setw(7) << "weight" << setw(14) << "instructions" << setw(7) << "share"
+             << setw(10) << "cpu ms" << setw(8) << "slices" << setw(8) << "halted" << setw(8) << "stopped" << setw(8) << "killed"
+             << setw(8) << "queued" << setw(12) << "done at ms" << endl;
+        for (const Tenant& tenant : tenants) {
+            const TenantAccount& account = tenant.account;
+            size_t queued = tenant.ready.size();
+            for (const Pending& pending : tenant.waiting) {
+                queued += pending.copies;
+            }
+            cout << "  " << left << setw(10) << tenant.name << right << fixed << setprecision(1) << setw(7) << tenant.weight
+                 << setw(14) << account.instructions << setw(6) << (total ? 100.0 * account.instructions / total : 0.0) << "%"
+                 << setprecision(3) << setw(10) << account.cpuSeconds * 1000 << setw(8) << account.slices << setw(8) << account.halted
+                 << setw(8) << account.stopped << setw(8) << account.killed << setw(8) << queued << setw(12)
+                 << account.finishedAt * 1000 << defaultfloat << endl;
+            const TenantQuota& quota = tenant.quota;
+            if (quota.instructions || quota.pages || quota.instances) {
+                cout << "    quota:" << (quota.instructions ? " instructions=" + to_string(quota.instructions) : "")
+                     << (quota.pages ? " pages=" + to_string(quota.pages) : "")
+                     << (quota.instances ? " instances=" + to_string(quota.instances) : "") << endl;
             }
         }
     }
-    return bytecode;
-}
-// Simple Micro-C to bytecode compiler
-/**
- * Name: compile
- * Purpouse: Compile a simple Micro-C source file into bytecode.
- * Inputs:
- *   - filename: The path to the Micro-C source file.
- * Outputs: A vector of uint8_t representing the compiled bytecode.
- * Effects: Reads the source file, translates variable declarations and assignments to bytecode.
- */
-vector<uint8_t> compile(const string& filename) {
-    ifstream file(filename);
-    if (!file.is_open()) {
-        cerr << "Error: Could not open source file " << filename << endl;
-        return {};
-    }
 
-    vector<uint8_t> assemblyOutput;
-    unordered_map<string, uint8_t> variables;
-    uint8_t next_var_addr = 0x10;
+private:
+    struct Job {
+        shared_ptr<const vector<uint8_t>> program;
+        uint64_t budget = 0;
+    };
 
-    string line;
-    while (getline(file, line)) {
-        stringstream ss(line);
-        string token;
-        ss >> token;
+    struct Pending {
+        size_t job;
+        size_t copies;
+    };
 
-        if (token.empty() || (token.size() >= 2 && token[0] == '/' && token[1] == '/')) continue;
+    struct Instance {
+        unique_ptr<CPU> machine;
+        uint64_t budget;
+        size_t pages = 0; // As last charged to the tenant
+    };
 
-        if (token == "int") {
-            string varName;
-            ss >> varName;
-            if (varName.back() == ';') {
-                varName.pop_back();
+    struct Tenant {
+        string name;
+        double weight = 1;
+        TenantQuota quota;
+        double virtualTime = 0; // Instructions served (and reserved) divided by weight
+        deque<unique_ptr<Instance>> ready;
+        deque<Pending> waiting; // Not admitted yet
+        size_t live = 0;        // Admitted and not finished
+        size_t running = 0;     // Slices in flight
+        uint64_t inFlight = 0;  // Instructions reserved by slices in flight
+        size_t pages = 0;
+        TenantAccount account;
+    };
+
+    Tenant* find(const string& name) {
+        for (Tenant& tenant : tenants) {
+            if (tenant.name == name) {
+                return &tenant;
             }
-            if (variables.count(varName)) {
-                cerr << "Error: Variable '" << varName << "' already declared." << endl;
-                return {};
+        }
+        return nullptr;
+    }
+
+    // Reserves the next waiting copy of a tenant that is under its instance quota (or, with
+    // none, has fewer live machines than there are workers) and has instructions left. The
+    // caller builds it without the lock. Called with the lock held.
+    Tenant* reserve(Job& job, uint8_t& pid) {
+        for (Tenant& tenant : tenants) {
+            size_t limit = tenant.quota.instances ? tenant.quota.instances : workerCount;
+            if (tenant.waiting.empty() || tenant.live >= limit || remainingInstructions(tenant) == 0) {
+                continue;
             }
-            variables[varName] = next_var_addr++;
-            cout << "Compiling: Declared variable '" << varName << "' at address " << (int)variables[varName] << endl;
-        } else {
-            string varName = token;
-            string equals, val1;
-            ss >> equals >> val1;
-            
-            if (equals != "=") {
-                cerr << "Error: Expected '=' in assignment statement." << endl;
-                return {};
+            Pending& pending = tenant.waiting.front();
+            job = jobs[pending.job];
+            pid = static_cast<uint8_t>(tenant.live);
+            tenant.live++;
+            if (--pending.copies == 0) {
+                tenant.waiting.pop_front();
             }
+            return &tenant;
+        }
+        return nullptr;
+    }
 
-            if (!variables.count(varName)) {
-                cerr << "Error: Undefined variable '" << varName << "'" << endl;
-                return {};
-            }
+    static unique_ptr<Instance> build(const Job& job, uint8_t pid) {
+        auto instance = make_unique<Instance>();
+        instance->machine = make_unique<CPU>();
+        instance->machine->trace = false;
+        instance->machine->pid = pid;
+        instance->machine->loadProgram(*job.program, USER_PROGRAM_START_ADDRESS);
+        instance->machine->pc = USER_PROGRAM_START_ADDRESS;
+        instance->budget = job.budget;
+        return instance;
+    }
 
-            string op;
-            ss >> op;
+    uint64_t remainingInstructions(const Tenant& tenant) const {
+        if (tenant.quota.instructions == 0) {
+            return UINT64_MAX;
+        }
+        uint64_t used = tenant.account.instructions + tenant.inFlight;
+        return used < tenant.quota.instructions ? tenant.quota.instructions - used : 0;
+    }
 
-            if (op.empty() || op.back() == ';') { // Simple assignment (e.g., a = 10; or a = b;)
-                if (op.back() == ';') {
-                    op.pop_back();
-                }
-                int value_or_var;
-                if (variables.count(val1)) { // The operand is a variable
-                    value_or_var = variables.at(val1);
-                    assemblyOutput.push_back(LOAD_A);
-                    assemblyOutput.push_back(value_or_var);
-                } else { // The operand is a literal number
-                    try {
-                        value_or_var = stoi(val1);
-                        assemblyOutput.push_back(LOAD_A);
-                        assemblyOutput.push_back(static_cast<uint8_t>(value_or_var));
-                    } catch (...) {
-                        cerr << "Error: Invalid operand '" << val1 << "'" << endl;
-                        return {};
-                    }
-                }
-                assemblyOutput.push_back(STORE_A);
-                assemblyOutput.push_back(variables.at(varName));
-            } else { // Arithmetic assignment (e.g., a = a + b;)
-                string val2_str;
-                ss >> val2_str;
-                if (val2_str.back() == ';') {
-                    val2_str.pop_back();
-                }
+    // Ends a tenant's remaining work once its instruction quota is spent.
+    void exhaust(Tenant& tenant) {
+        for (const Pending& pending : tenant.waiting) {
+            tenant.account.killed += pending.copies;
+        }
+        tenant.waiting.clear();
+        tenant.account.killed += tenant.ready.size();
+        for (const auto& instance : tenant.ready) {
+            tenant.pages -= instance->pages;
+        }
+        tenant.live -= tenant.ready.size();
+        tenant.ready.clear();
+        finishIfIdle(tenant);
+    }
 
-                if (variables.count(val1)) {
-                    assemblyOutput.push_back(LOAD_A);
-                    assemblyOutput.push_back(variables.at(val1));
-                } else {
-                    try {
-                        assemblyOutput.push_back(LOAD_A);
-                        assemblyOutput.push_back(static_cast<uint8_t>(stoi(val1)));
-                    } catch (...) {
-                        cerr << "Error: Invalid operand '" << val1 << "'" << endl;
-                        return {};
-                    }
-                }
+    void finishIfIdle(Tenant& tenant) {
+        if (tenant.live == 0 && tenant.waiting.empty()) {
+            tenant.account.finishedAt = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+    }
 
-                if (variables.count(val2_str)) {
-                    assemblyOutput.push_back(LOAD_B);
-                    assemblyOutput.push_back(variables.at(val2_str));
-                } else {
-                    try {
-                        assemblyOutput.push_back(LOAD_B);
-                        assemblyOutput.push_back(static_cast<uint8_t>(stoi(val2_str)));
-                    } catch (...) {
-                        cerr << "Error: Invalid operand '" << val2_str << "'" << endl;
-                        return {};
-                    }
+    // Picks the next slice: the tenant with the least virtual time that has a ready machine
+    // and instructions left. Called with the lock held.
+    Tenant* pick() {
+        Tenant* best = nullptr;
+        for (Tenant& tenant : tenants) {
+            if (remainingInstructions(tenant) == 0) {
+                if (tenant.running == 0 && (!tenant.ready.empty() || !tenant.waiting.empty())) {
+                    exhaust(tenant);
                 }
+                continue;
+            }
+            if (tenant.ready.empty()) {
+                continue;
+            }
+            if (!best || tenant.virtualTime < best->virtualTime) {
+                best = &tenant;
+            }
+        }
+        return best;
+    }
 
-                if (op == "+") {
-                    assemblyOutput.push_back(ADD_A_B);
-                } else if (op == "-") {
-                    assemblyOutput.push_back(SUB_A_B);
-                } else {
-                    cerr << "Error: Unknown operator '" << op << "'" << endl;
-                    return {};
+    void work() {
+        unique_lock<mutex> lock(serverMutex);
+        while (true) {
+            Job job;
+            uint8_t pid = 0;
+            if (Tenant* owner = reserve(job, pid)) {
+                building++;
+                lock.unlock();
+                unique_ptr<Instance> instance = build(job, pid);
+                lock.lock();
+                building--;
+                owner->ready.push_back(move(instance));
+                wake.notify_all();
+                continue;
+            }
+            Tenant* tenant = pick();
+            if (!tenant) {
+                if (slicesInFlight == 0 && building == 0) {
+                    wake.notify_all();
+                    return;
                 }
-                assemblyOutput.push_back(STORE_A);
-                assemblyOutput.push_back(variables.at(varName));
+                wake.wait(lock);
+                continue;
             }
+            unique_ptr<Instance> instance = move(tenant->ready.front());
+            tenant->ready.pop_front();
+            uint64_t slice = min({JOB_SLICE, instance->budget - instance->machine->instructionCount, remainingInstructions(*tenant)});
+            tenant->inFlight += slice;
+            tenant->running++;
+            tenant->virtualTime += static_cast<double>(slice) / tenant->weight;
+            slicesInFlight++;
+            lock.unlock();
+
+            double cpuStart = threadCpuSeconds();
+            uint64_t executed = instance->machine->run(slice);
+            double cpuSeconds = threadCpuSeconds() - cpuStart;
+            size_t pages = instance->machine->memory.pagesAllocated();
+
+            lock.lock();
+            slicesInFlight--;
+            tenant->inFlight -= slice;
+            tenant->running--;
+            tenant->virtualTime -= static_cast<double>(slice - executed) / tenant->weight;
+            TenantAccount& account = tenant->account;
+            account.instructions += executed;
+            account.cpuSeconds += cpuSeconds;
+            account.slices++;
+            tenant->pages = tenant->pages - instance->pages + pages;
+            instance->pages = pages;
+            bool overPages = tenant->quota.pages && tenant->pages > tenant->quota.pages;
+            if (instance->machine->halted || instance->machine->instructionCount >= instance->budget || overPages) {
+                (instance->machine->halted ? account.halted : overPages ? account.killed : account.stopped)++;
+                tenant->pages -= instance->pages;
+                tenant->live--;
+                finishIfIdle(*tenant);
+            } else {
+                tenant->ready.push_back(move(instance));
+            }
+            wake.notify_all();
         }
     }
-    assemblyOutput.push_back(HALT);
-    return assemblyOutput;
+
+    deque<Tenant> tenants; // A deque keeps tenants in place as more are added
+    vector<Job> jobs;
+    mutex serverMutex;
+    condition_variable wake;
+    size_t slicesInFlight = 0;
+    size_t building = 0;    // Machines being built outside the lock
+    size_t workerCount = 1; // Live machines a tenant without an instance quota may have
+    chrono::steady_clock::time_point start;
+};
+
+/**
+ * Name: readOptionalNumber
+ * Purpouse: Read an optional trailing numeric argument of a REPL command.
+ * Inputs:
+ *   - ss: The rest of the command line.
+ *   - value: Receives the number when one is given; left untouched otherwise.
+ * Outputs: False when a token is present but is not a whole non-negative number.
+ * Effects: Consumes one token from ss.
+ */
+bool readOptionalNumber(stringstream& ss, uint64_t& value) {
+    string token;
+    if (!(ss >> token)) {
+        return true;
+    }
+    if (token[0] == '-') {
+        return false;
+    }
+    stringstream parsed(token);
+    uint64_t number = 0;
+    if (!(parsed >> number) || parsed.peek() != EOF) {
+        return false;
+    }
+    value = number;
+    return true;
 }
 
 /**
@@ -463,7 +7426,14 @@ vector<uint8_t> compile(const string& filename) {
  */
 int main() {
     CPU cpu;
+    FleetOptions fleetOptions;
+    JobServer jobServer;
+    ContentStore store;
+    CompileOptions compileOptions;
+    string compiledSource; // The Micro-C file last compiled, and its listing for mapping profiles
+    CompileListing compiledListing;
     bool running = false;
+    bool loaded = false; // A program has been loaded since the last clear
     cout << "CPU Emulator Ready. Type 'help' for a list of commands." << endl;
 
     while (true) {
@@ -479,11 +7449,35 @@ int main() {
             cout << "  load <hex codes>   - Loads a program from a string of hex values" << endl;
             cout << "  asm <filename.asm> - Assembles and loads a program from an assembly file" << endl;
             cout << "  compile <filename.mc>- Compiles and loads a program from a Micro-C file" << endl;
+            cout << "  optimize [on|off|speed|size] - Shows or sets Micro-C loop optimizations and the instruction selection goal" << endl;
+            cout << "  profile on|off|save <file>|use <file|none> - Profiles a run, or compiles with a profile" << endl;
+            cout << "  superopt build <db> <file.mc>... | use <db|none> - Builds or applies superoptimizer rewrites" << endl;
+            cout << "  image <file.bin>   - Demand-loads a raw program image (pages load on first use)" << endl;
+            cout << "  build <src> <out>  - Assembles or compiles a program into a raw image file" << endl;
             cout << "  run                - Executes the entire program until a HALT" << endl;
             cout << "  step               - Executes a single instruction" << endl;
             cout << "  dump               - Prints the current state of the CPU" << endl;
             cout << "  mem <address>      - Displays the value at a specific memory address" << endl;
-            cout << "  reset              - Resets the CPU state" << endl;
+            cout << "  bank [n]           - Shows or selects the bank in the banked window" << endl;
+            cout << "  reset              - Restores the machine to its state right after loading" << endl;
+            cout << "  clear              - Powers the machine back on with empty memory" << endl;
+            cout << "  persist <file> [n]|off - Backs the machine with a state file, checkpointing every n instructions" << endl;
+            cout << "  checkpoint         - Makes the persistent state durable now" << endl;
+            cout << "  migrate send|receive <socket> - Moves the running machine to/from another emulator" << endl;
+            cout << "  snapshot save|load <file> - Writes or restores a compressed snapshot of the machine" << endl;
+            cout << "  store [<dir>|put <name> <file>|save|load <name>] - Keeps images and snapshots in a deduplicated store" << endl;
+            cout << "  sandbox <dir>      - Confines program file syscalls to a host directory" << endl;
+            cout << "  irq <line>         - Raises an interrupt line" << endl;
+            cout << "  frame <file.ppm>   - Writes the framebuffer to a PPM file" << endl;
+            cout << "  framehash          - Prints the framebuffer hash for golden tests" << endl;
+            cout << "  framedump <prefix> - Writes changed frames to <prefix>_N.ppm at PRESENT_FRAME ('off' stops)" << endl;
+            cout << "  fleet <n> <threads> <file> [budget] - Runs n copies of a program on worker threads" << endl;
+            cout << "  network <latency_us> <bytes/s>|off  - Connects fleet machines with a virtual network" << endl;
+            cout << "  results <file> [addr:len ...]|off   - Writes fleet final states to a columnar binary file" << endl;
+            cout << "  sweep <file>|off   - Varies fleet machines' initial registers and memory by a sweep file" << endl;
+            cout << "  tenant [<name> [weight] [instructions=n] [pages=n] [instances=n]] - Adds a job server tenant or lists them" << endl;
+            cout << "  job <tenant> <file> [copies] [budget] - Queues machines for a tenant" << endl;
+            cout << "  serve [threads]    - Runs queued jobs with weighted fair scheduling and prints accounting" << endl;
             cout << "  quit               - Exits the emulator" << endl;
         } else if (command == "load") {
             string hexString;
@@ -493,6 +7487,7 @@ int main() {
                 cpu.loadProgram(program, USER_PROGRAM_START_ADDRESS);
                 cpu.pc = USER_PROGRAM_START_ADDRESS;
                 running = true;
+                loaded = true;
                 cout << "Program loaded and PC reset to " << USER_PROGRAM_START_ADDRESS << "." << endl;
             }
         } else if (command == "asm") {
@@ -504,6 +7499,7 @@ int main() {
                     cpu.loadProgram(program, USER_PROGRAM_START_ADDRESS);
                     cpu.pc = USER_PROGRAM_START_ADDRESS;
                     running = true;
+                    loaded = true;
                     cout << "Assembly program '" << filename << "' loaded and PC reset." << endl;
                 } else {
                     cout << "Failed to assemble program." << endl;
@@ -511,15 +7507,104 @@ int main() {
             } else {
                 cout << "Usage: asm <filename.asm>" << endl;
             }
+        } else if (command == "optimize") {
+            string setting;
+            ss >> setting;
+            if (setting == "on" || setting == "off") {
+                compileOptions.optimize = setting == "on";
+            } else if (setting == "speed" || setting == "size") {
+                compileOptions.optimizeSize = setting == "size";
+            } else if (!setting.empty()) {
+                cout << "Usage: optimize [on|off|speed|size]" << endl;
+            }
+            cout << "Micro-C loop optimizations " << (compileOptions.optimize ? "on" : "off") << ", optimizing for "
+                 << (compileOptions.optimizeSize ? "size" : "speed") << endl;
+        } else if (command == "profile") {
+            string action, path;
+            ss >> action >> path;
+            if (action == "on") {
+                cpu.profile.assign(cpu.memory.size(), 0);
+                cout << "Profiling: counting executions per PC" << endl;
+            } else if (action == "off") {
+                cpu.profile.clear();
+                cout << "Profiling stopped." << endl;
+            } else if (action == "save" && !path.empty()) {
+                if (cpu.profile.empty() || compiledSource.empty()) {
+                    cout << "Error: Turn profiling on and run a compiled Micro-C program first." << endl;
+                } else {
+                    MicroCProfile profile;
+                    profile.source = compiledSource;
+                    const vector<int>& lines = compiledListing.lines;
+                    for (size_t offset = 0; offset < lines.size(); offset++) {
+                        if (lines[offset] != 0) {
+                            profile.lineCounts[lines[offset]] += cpu.profile[USER_PROGRAM_START_ADDRESS + offset];
+                        }
+                    }
+                    if (profile.save(path)) {
+                        cout << "Profile of '" << compiledSource << "' (" << profile.lineCounts.size() << " statements) written to " << path << endl;
+                    }
+                }
+            } else if (action == "use" && !path.empty()) {
+                if (path == "none") {
+                    compileOptions.profile.reset();
+                    cout << "Compiling without a profile." << endl;
+                } else if (auto profile = MicroCProfile::parse(path)) {
+                    compileOptions.profile = move(profile);
+                    cout << "Compiling with the profile in " << path << endl;
+                }
+            } else {
+                cout << "Usage: profile on|off|save <file>|use <file|none>" << endl;
+            }
+        } else if (command == "superopt") {
+            string action, path;
+            ss >> action >> path;
+            if (action == "build" && !path.empty()) {
+                unique_ptr<RewriteDatabase> database = ifstream(path).good() ? RewriteDatabase::parse(path) : make_unique<RewriteDatabase>();
+                CompileOptions raw = compileOptions;
+                raw.rewrites.reset();
+                unordered_set<string> searched;
+                size_t found = 0;
+                string source;
+                auto started = chrono::steady_clock::now();
+                while (database && ss >> source) {
+                    CompileListing listing;
+                    if (compile(source, raw, &listing).empty()) {
+                        database.reset();
+                        break;
+                    }
+                    found += extendRewriteDatabase(listing.code, *database, searched);
+                }
+                if (!database || searched.empty()) {
+                    cout << "Usage: superopt build <database> <file.mc> [file.mc ...]" << endl;
+                } else if (database->save(path)) {
+                    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+                    cout << "Superoptimizer: searched " << searched.size() << " windows in " << fixed << setprecision(2) << seconds << defaultfloat
+                         << "s, found " << found << " new rewrite(s); " << path << " holds " << database->size() << endl;
+                }
+            } else if (action == "use" && !path.empty()) {
+                if (path == "none") {
+                    compileOptions.rewrites.reset();
+                    cout << "Compiling without superoptimizer rewrites." << endl;
+                } else if (auto database = RewriteDatabase::parse(path)) {
+                    size_t removed = database->removeUnsound(path);
+                    cout << "Compiling with " << database->size() << " superoptimizer rewrite(s) from " << path;
+                    cout << (removed ? " (" + to_string(removed) + " unsound rewrite(s) ignored)" : string()) << endl;
+                    compileOptions.rewrites = move(database);
+                }
+            } else {
+                cout << "Usage: superopt build <database> <file.mc>... | use <database|none>" << endl;
+            }
         } else if (command == "compile") {
             string filename;
             ss >> filename;
             if (!filename.empty()) {
-                vector<uint8_t> bytecode = compile(filename);
+                vector<uint8_t> bytecode = compile(filename, compileOptions, &compiledListing);
+                compiledSource = bytecode.empty() ? "" : filename;
                 if (!bytecode.empty()) {
                     cpu.loadProgram(bytecode, USER_PROGRAM_START_ADDRESS);
                     cpu.pc = USER_PROGRAM_START_ADDRESS;
                     running = true;
+                    loaded = true;
                     cout << "Compiled program '" << filename << "' loaded and PC reset." << endl;
                 } else {
                     cout << "Failed to compile program." << endl;
@@ -527,6 +7612,34 @@ int main() {
             } else {
                 cout << "Usage: compile <filename.mc>" << endl;
             }
+        } else if (command == "image") {
+            string filename;
+            ss >> filename;
+            if (filename.empty()) {
+                cout << "Usage: image <file.bin>" << endl;
+            } else if (cpu.loadImage(filename, USER_PROGRAM_START_ADDRESS)) {
+                cpu.pc = USER_PROGRAM_START_ADDRESS;
+                running = true;
+                loaded = true;
+                cout << "Image '" << filename << "' mapped (" << cpu.memory.imagePages() << " pages, loaded on demand) and PC reset." << endl;
+            }
+        } else if (command == "build") {
+            string source, output;
+            ss >> source >> output;
+            vector<uint8_t> program = source.empty() ? vector<uint8_t>() : buildProgram(source, compileOptions);
+            if (output.empty()) {
+                cout << "Usage: build <file.asm|file.mc> <out.bin>" << endl;
+            } else if (program.empty()) {
+                cout << "Failed to build program." << endl;
+            } else {
+                ofstream out(output, ios::binary);
+                out.write(reinterpret_cast<const char*>(program.data()), program.size());
+                if (!out) {
+                    cout << "Could not write '" << output << "'." << endl;
+                } else {
+                    cout << "Wrote " << program.size() << " bytes to '" << output << "'." << endl;
+                }
+            }
         } else if (command == "run") {
             if (running) {
                 while (cpu.step()) {}
@@ -555,12 +7668,344 @@ int main() {
                 cout << "Invalid memory address." << endl;
             }
         } else if (command == "reset") {
-            cpu.pc = 0;
-            cpu.reg_A = 0;
-            cpu.reg_B = 0;
+            uint32_t restored = cpu.restart();
+            running = loaded;
+            cout << "CPU state reset to the loaded program (" << restored << " pages restored)." << endl;
+        } else if (command == "bank") {
+            int bank = -1;
+            ss >> bank;
+            if (bank >= 0 && bank <= 255) {
+                cpu.memory.selectBank(static_cast<uint8_t>(bank));
+            }
+            cout << "Bank " << (int)cpu.memory.bank() << " mapped at 0x" << hex << BANK_WINDOW_ADDRESS << "-0x"
+                 << BANK_WINDOW_ADDRESS + BANK_WINDOW_PAGES * PAGE_SIZE - 1 << dec << "." << endl;
+        } else if (command == "sandbox") {
+            string directory;
+            ss >> directory;
+            if (directory.empty()) {
+                cout << "Sandbox root: " << (cpu.files.getRoot().empty() ? "(none)" : cpu.files.getRoot().string()) << endl;
+            } else if (cpu.files.setRoot(directory)) {
+                cout << "File syscalls confined to " << cpu.files.getRoot().string() << "." << endl;
+            } else {
+                cout << "Invalid sandbox directory." << endl;
+            }
+        } else if (command == "irq") {
+            int line = -1;
+            ss >> line;
+            if (line >= 0 && line < INTERRUPT_LINES) {
+                cpu.raiseInterrupt(static_cast<uint8_t>(line));
+                cout << "Interrupt line " << line << " pending." << endl;
+            } else {
+                cout << "Usage: irq <0-" << INTERRUPT_LINES - 1 << ">" << endl;
+            }
+        } else if (command == "frame") {
+            string filename;
+            ss >> filename;
+            cpu.framebuffer.update(cpu.memory.page(FRAMEBUFFER_ADDRESS));
+            if (filename.empty()) {
+                cout << "Usage: frame <file.ppm>" << endl;
+            } else if (cpu.framebuffer.writePpm(filename)) {
+                cout << "Framebuffer written to '" << filename << "'." << endl;
+            } else {
+                cout << "Failed to write '" << filename << "'." << endl;
+            }
+        } else if (command == "framehash") {
+            cpu.framebuffer.update(cpu.memory.page(FRAMEBUFFER_ADDRESS));
+            cout << "Framebuffer hash: " << hex << setw(16) << setfill('0') << cpu.framebuffer.hash() << setfill(' ') << dec << endl;
+        } else if (command == "framedump") {
+            string prefix;
+            ss >> prefix;
+            if (prefix == "off") {
+                cpu.framebuffer.dumpPrefix.clear();
+            } else if (!prefix.empty()) {
+                cpu.framebuffer.dumpPrefix = prefix;
+            }
+            cout << "Frames presented: " << cpu.framebuffer.framesPresented << ", written: " << cpu.framebuffer.framesWritten << endl;
+            if (!cpu.framebuffer.dumpPrefix.empty()) {
+                cout << "Changed frames will be written to '" << cpu.framebuffer.dumpPrefix << "_N.ppm'." << endl;
+            }
+        } else if (command == "fleet") {
+            FleetOptions options = fleetOptions;
+            string filename;
+            ss >> options.machines >> options.threads >> filename;
+            bool validBudget = ss.fail() || readOptionalNumber(ss, options.budget);
+            if (filename.empty() || options.machines == 0 || options.threads == 0 || !validBudget) {
+                cout << "Usage: fleet <machines> <threads> <file.asm|file.mc> [budget]" << endl;
+            } else {
+                vector<uint8_t> program = buildProgram(filename, compileOptions);
+                if (program.empty()) {
+                    cout << "Failed to build program." << endl;
+                } else {
+                    runFleet(program, options);
+                }
+            }
+        } else if (command == "tenant") {
+            string name;
+            double weight = 1;
+            TenantQuota quota;
+            ss >> name;
+            string setting;
+            bool valid = true;
+            while (ss >> setting) {
+                size_t equals = setting.find('=');
+                try {
+                    if (equals == string::npos) {
+                        weight = stod(setting);
+                        valid = valid && weight > 0;
+                    } else if (setting.compare(0, equals, "instructions") == 0) {
+                        quota.instructions = stoull(setting.substr(equals + 1));
+                    } else if (setting.compare(0, equals, "pages") == 0) {
+                        quota.pages = stoull(setting.substr(equals + 1));
+                    } else if (setting.compare(0, equals, "instances") == 0) {
+                        quota.instances = stoull(setting.substr(equals + 1));
+                    } else {
+                        valid = false;
+                    }
+                } catch (const exception&) {
+                    valid = false;
+                }
+            }
+            if (name.empty()) {
+                jobServer.printTenants();
+            } else if (!valid) {
+                cout << "Usage: tenant <name> [weight] [instructions=n] [pages=n] [instances=n]" << endl;
+            } else {
+                jobServer.setTenant(name, weight, quota);
+                cout << "Tenant '" << name << "' has weight " << weight << "." << endl;
+            }
+        } else if (command == "job") {
+            string tenant;
+            string filename;
+            uint64_t copies = 1;
+            uint64_t budget = fleetOptions.budget;
+            ss >> tenant >> filename;
+            bool validNumbers = readOptionalNumber(ss, copies) && readOptionalNumber(ss, budget);
+            bool usage = filename.empty() || copies == 0 || !validNumbers;
+            vector<uint8_t> program = usage ? vector<uint8_t>() : buildProgram(filename, compileOptions);
+            if (usage) {
+                cout << "Usage: job <tenant> <file.asm|file.mc> [copies] [budget]" << endl;
+            } else if (program.empty()) {
+                cout << "Failed to build program." << endl;
+            } else if (!jobServer.submit(tenant, program, copies, budget)) {
+                cout << "No tenant '" << tenant << "'. Add it with 'tenant " << tenant << " [weight]' first." << endl;
+            } else {
+                cout << "Queued " << copies << " instance(s) of '" << filename << "' for tenant '" << tenant << "'." << endl;
+            }
+        } else if (command == "serve") {
+            size_t threads = 1;
+            ss >> threads;
+            jobServer.serve(max<size_t>(threads, 1));
+        } else if (command == "sweep") {
+            string path;
+            ss >> path;
+            if (path.empty()) {
+                if (fleetOptions.sweep) {
+                    cout << "Fleet sweep: " << fleetOptions.sweep->dimensionCount() << " dimension(s), "
+                         << fleetOptions.sweep->combinations() << " combinations." << endl;
+                } else {
+                    cout << "Fleet sweep: (none)" << endl;
+                }
+            } else if (path == "off") {
+                fleetOptions.sweep.reset();
+                cout << "Fleet sweep disabled." << endl;
+            } else if (shared_ptr<ParameterSweep> sweep = ParameterSweep::parse(path)) {
+                fleetOptions.sweep = sweep;
+                cout << "Fleet sweep '" << path << "': " << sweep->dimensionCount() << " dimension(s), " << sweep->combinations()
+                     << " combinations; machine i starts with combination i mod " << sweep->combinations() << "." << endl;
+            }
+        } else if (command == "results") {
+            string path;
+            ss >> path;
+            vector<ResultRange> ranges;
+            string range;
+            bool valid = true;
+            while (ss >> range) {
+                size_t colon = range.find(':');
+                try {
+                    unsigned long address = stoul(range.substr(0, colon), nullptr, 0);
+                    unsigned long length = colon == string::npos ? 1 : stoul(range.substr(colon + 1), nullptr, 0);
+                    valid = valid && length > 0 && length <= 0xFFFF && address < ADDRESS_SPACE_SIZE && address + length <= ADDRESS_SPACE_SIZE;
+                    ranges.push_back({static_cast<uint16_t>(address), static_cast<uint16_t>(length)});
+                } catch (const exception&) {
+                    valid = false;
+                }
+            }
+            if (path.empty()) {
+                cout << "Fleet results: " << (fleetOptions.resultPath.empty() ? string("(none)") : fleetOptions.resultPath) << endl;
+            } else if (path == "off") {
+                fleetOptions.resultPath.clear();
+                fleetOptions.resultRanges.clear();
+                cout << "Fleet results disabled." << endl;
+            } else if (!valid) {
+                cout << "Usage: results <file> [address:length ...] | results off" << endl;
+            } else {
+                fleetOptions.resultPath = path;
+                fleetOptions.resultRanges = ranges;
+                cout << "Fleet results go to '" << path << "' with " << ranges.size() << " memory range(s)." << endl;
+            }
+        } else if (command == "network") {
+            string setting;
+            ss >> setting;
+            if (setting == "off") {
+                fleetOptions.network = false;
+                cout << "Fleet network disabled." << endl;
+            } else {
+                stringstream values(setting);
+                uint64_t latency = 0, bandwidth = 0;
+                if (!setting.empty() && readOptionalNumber(values, latency) && readOptionalNumber(ss, bandwidth)) {
+                    fleetOptions.network = true;
+                    fleetOptions.latencyMicroseconds = latency;
+                    fleetOptions.bytesPerSecond = bandwidth;
+                    cout << "Fleet network enabled: " << latency << " us latency, "
+                         << (bandwidth ? to_string(bandwidth) + " bytes/s" : string("unlimited bandwidth")) << "." << endl;
+                } else {
+                    cout << "Usage: network <latency_us> [bytes_per_second] | network off" << endl;
+                }
+            }
+        } else if (command == "clear") {
+            cpu.reset();
             running = false;
-            cout << "CPU state reset." << endl;
+            loaded = false;
+            cout << "Machine cleared to its power-on state." << endl;
+        } else if (command == "persist") {
+            string path;
+            uint64_t interval = 0;
+            ss >> path >> interval;
+            if (path.empty()) {
+                cout << "State file: " << (cpu.stateFile ? cpu.stateFile->getPath() : string("(none)")) << endl;
+            } else if (path == "off") {
+                cpu.stopPersisting();
+                cout << "Machine state detached from its file." << endl;
+            } else if (cpu.persistTo(path, interval)) {
+                if (cpu.stateFile->holdsMachine()) {
+                    running = !cpu.halted;
+                    loaded = true;
+                    cout << "Resumed machine from '" << path << "' at instruction " << cpu.instructionCount << " (PC 0x"
+                         << hex << cpu.pc << dec << ", " << (cpu.halted ? "halted" : "runnable") << ")." << endl;
+                } else {
+                    cout << "Machine state now persisted in '" << path << "'." << endl;
+                }
+            }
+        } else if (command == "migrate") {
+            string direction;
+            string socketPath;
+            ss >> direction >> socketPath;
+            if (socketPath.empty() || (direction != "send" && direction != "receive")) {
+                cout << "Usage: migrate send|receive <socket>" << endl;
+            } else if (direction == "send") {
+                MigrationStats stats;
+                if (!running) {
+                    cout << "No running program to migrate." << endl;
+                } else if (cpu.migrateTo(socketPath, stats)) {
+                    running = false;
+                    cout << dec << "Migrated after " << stats.rounds << " pre-copy rounds (" << stats.pagesSent << " pages); paused "
+                         << stats.pauseMicroseconds << " us to copy the last " << stats.finalPages << " pages and registers." << endl;
+                }
+            } else {
+                cout << "Waiting for a machine on " << socketPath << "..." << endl;
+                if (cpu.migrateFrom(socketPath)) {
+                    running = !cpu.halted;
+                    loaded = true;
+                    cout << "Machine arrived at instruction " << dec << cpu.instructionCount << " (PC 0x" << hex << cpu.pc << dec << ")." << endl;
+                }
+            }
+        } else if (command == "snapshot") {
+            string direction;
+            string path;
+            ss >> direction >> path;
+            if (path.empty() || (direction != "save" && direction != "load")) {
+                cout << "Usage: snapshot save|load <file>" << endl;
+            } else if (direction == "save") {
+                vector<uint8_t> snapshot;
+                auto start = chrono::steady_clock::now();
+                cpu.encodeSnapshot(snapshot);
+                auto microseconds = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+                ofstream file(path, ios::binary);
+                file.write(reinterpret_cast<const char*>(snapshot.data()), static_cast<streamsize>(snapshot.size()));
+                if (!file) {
+                    cout << "Could not write '" << path << "'." << endl;
+                } else {
+                    SnapshotHeader header;
+                    memcpy(&header, snapshot.data(), sizeof(header));
+                    cout << dec << "Snapshot saved to '" << path << "': " << header.pages << " pages in " << snapshot.size()
+                         << " bytes, encoded in " << microseconds << " us." << endl;
+                }
+            } else {
+                ifstream file(path, ios::binary);
+                vector<uint8_t> snapshot((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+                auto start = chrono::steady_clock::now();
+                if (!file.is_open()) {
+                    cout << "Could not read '" << path << "'." << endl;
+                } else if (cpu.decodeSnapshot(snapshot.data(), snapshot.size())) {
+                    auto microseconds = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+                    running = !cpu.halted;
+                    cout << dec << "Snapshot restored in " << microseconds << " us at instruction " << cpu.instructionCount
+                         << " (PC 0x" << hex << cpu.pc << dec << ")." << endl;
+                }
+            }
+        } else if (command == "store") {
+            string action;
+            string name;
+            string source;
+            ss >> action >> name >> source;
+            bool named = action == "put" || action == "save" || action == "load";
+            if (action.empty()) {
+                if (!store.isOpen()) {
+                    cout << "No store open. Use 'store <dir>' first." << endl;
+                } else {
+                    StoreUsage usage = store.usage();
+                    cout << dec << "Store '" << store.getRoot() << "': " << usage.objects << " objects referencing " << usage.chunkRefs
+                         << " pages, " << usage.chunks << " distinct chunks (" << usage.chunks * PAGE_SIZE << " bytes); this session wrote "
+                         << store.chunksWritten << " chunks and deduplicated " << store.chunksShared << "." << endl;
+                }
+            } else if (!named) {
+                if (store.open(action)) {
+                    cout << "Using store '" << action << "'." << endl;
+                }
+            } else if (!store.isOpen()) {
+                cout << "No store open. Use 'store <dir>' first." << endl;
+            } else if (!ContentStore::validName(name) || (action == "put") == source.empty()) {
+                cout << "Usage: store <dir> | store put <name> <file.asm|file.mc|file.bin> | store save|load <name>" << endl;
+            } else if (action == "put") {
+                vector<uint8_t> program;
+                if (filesystem::path(source).extension() == ".bin") {
+                    ifstream file(source, ios::binary);
+                    program.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+                } else {
+                    program = buildProgram(source, compileOptions);
+                }
+                uint64_t written = store.chunksWritten;
+                uint64_t shared = store.chunksShared;
+                if (program.empty() || program.size() > ADDRESS_SPACE_SIZE) {
+                    cout << "Failed to build program." << endl;
+                } else if (store.putImage(name, program)) {
+                    cout << dec << "Stored image '" << name << "' (" << program.size() << " bytes): " << store.chunksWritten - written
+                         << " new chunks, " << store.chunksShared - shared << " already stored." << endl;
+                }
+            } else if (action == "save") {
+                uint64_t written = store.chunksWritten;
+                uint64_t shared = store.chunksShared;
+                if (cpu.storeSnapshot(store, name)) {
+                    cout << dec << "Stored snapshot '" << name << "': " << store.chunksWritten - written << " new chunks, "
+                         << store.chunksShared - shared << " already stored." << endl;
+                }
+            } else {
+                auto start = chrono::steady_clock::now();
+                if (cpu.loadFromStore(store, name)) {
+                    auto microseconds = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+                    running = !cpu.halted;
+                    loaded = true;
+                    cout << dec << "Loaded '" << name << "' from the store in " << microseconds << " us (PC 0x" << hex << cpu.pc << dec << ")." << endl;
+                }
+            }
+        } else if (command == "checkpoint") {
+            if (!cpu.stateFile) {
+                cout << "No state file attached. Use 'persist <file>' first." << endl;
+            } else if (cpu.checkpoint()) {
+                cout << "Checkpoint " << cpu.stateFile->header().checkpoints << " written at instruction " << cpu.instructionCount << "." << endl;
+            }
         } else if (command == "quit") {
+            cpu.checkpoint();
             cout << "Exiting emulator." << endl;
             break;
         } else {
@@ -0,0 +1,20 @@
+; Writes a different byte at 0x4000 in banks 0, 1 and 2, then reads each back through the
+; banked window. Switching banks only remaps the window; nothing is copied.
+start:
+    LOAD_A 10
+    STORE_A_MEM 16384   ; Bank 0, 0x4000
+    LOAD_A 17           ; Syscall number for SET_BANK
+    LOAD_B 1
+    SYSCALL
+    LOAD_A 11
+    STORE_A_MEM 16384   ; Bank 1, 0x4000
+    LOAD_A 17
+    LOAD_B 2
+    SYSCALL
+    LOAD_A 12
+    STORE_A_MEM 16384   ; Bank 2, 0x4000
+    LOAD_A 17
+    LOAD_B 1
+    SYSCALL
+    LOAD_A_MEM 16384    ; A = 11
+    HALT
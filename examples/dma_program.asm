@@ -0,0 +1,32 @@
+; Starts an asynchronous 4KB copy from 0x2000 to 0x3000 and keeps running until the
+; DMA completion interrupt arrives. The DMA control block lives at 224-231 and the
+; vector block {line 1, handler} at 240-242.
+start:
+    LOAD_A 1        ; IRQ_DMA
+    STORE_A 240
+    LOAD_A done     ; Handler address
+    STORE_A 241
+    LOAD_A 10       ; Syscall number for SET_INTERRUPT_VECTOR
+    LOAD_B 240
+    SYSCALL
+    LOAD_A 9        ; Syscall number for SET_INTERRUPT_MASK
+    LOAD_B 253      ; Unmask line 1 only
+    SYSCALL
+    LOAD_A 192      ; MEMORY_TO_MEMORY | DMA_FLAG_ASYNC | DMA_FLAG_INTERRUPT
+    STORE_A 224
+    LOAD_A 32       ; Source 0x2000
+    STORE_A 227
+    LOAD_A 48       ; Destination 0x3000
+    STORE_A 229
+    LOAD_A 16       ; Length 0x1000
+    STORE_A 231
+    LOAD_A 12       ; Syscall number for DMA_START
+    LOAD_B 224
+    SYSCALL
+work:
+    JMP work        ; Computation overlaps the transfer here
+done:
+    LOAD_A 1        ; Syscall number for PRINT_CHAR
+    LOAD_B 68       ; 'D'
+    SYSCALL
+    HALT
@@ -0,0 +1,52 @@
+; Copies the sandbox file "in" to "out" using block file syscalls.
+; FCBs live at 160 and 176, paths at 192 ("in") and 200 ("out"), the data buffer at 0x2000.
+start:
+    LOAD_A 105      ; 'i'
+    STORE_A 192
+    LOAD_A 110      ; 'n'
+    STORE_A 193
+    LOAD_A 111      ; 'o'
+    STORE_A 200
+    LOAD_A 117      ; 'u'
+    STORE_A 201
+    LOAD_A 116      ; 't'
+    STORE_A 202
+    LOAD_A 192      ; FCB1 path = "in", mode READ
+    STORE_A 162
+    LOAD_A 4        ; Syscall number for FILE_OPEN
+    LOAD_B 160
+    SYSCALL
+    LOAD_A 0        ; FCB1 buffer = 0x2000, length = 0x1000
+    STORE_A 162
+    LOAD_A 32
+    STORE_A 163
+    LOAD_A 16
+    STORE_A 165
+    LOAD_A 5        ; Syscall number for FILE_READ
+    LOAD_B 160
+    SYSCALL
+    LOAD_A 1        ; FCB2 path = "out", mode WRITE
+    STORE_A 177
+    LOAD_A 200
+    STORE_A 178
+    LOAD_A 4        ; Syscall number for FILE_OPEN
+    LOAD_B 176
+    SYSCALL
+    LOAD_A 0        ; FCB2 buffer = 0x2000, length = bytes read
+    STORE_A 178
+    LOAD_A 32
+    STORE_A 179
+    LOAD_A_MEM 166
+    STORE_A 180
+    LOAD_A_MEM 167
+    STORE_A 181
+    LOAD_A 6        ; Syscall number for FILE_WRITE
+    LOAD_B 176
+    SYSCALL
+    LOAD_A 7        ; Syscall number for FILE_CLOSE
+    LOAD_B 160
+    SYSCALL
+    LOAD_A 7
+    LOAD_B 176
+    SYSCALL
+    HALT
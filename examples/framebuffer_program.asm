@@ -0,0 +1,14 @@
+; Draws a red, a green and a blue pixel on the framebuffer's first scanline, presents the
+; frame, then presents again without changes (which a frame dump skips).
+start:
+    LOAD_A 224      ; RGB332 red
+    STORE_A_MEM FRAMEBUFFER
+    LOAD_A 28       ; RGB332 green
+    STORE_A_MEM 32769
+    LOAD_A 3        ; RGB332 blue
+    STORE_A_MEM 32770
+    LOAD_A 14       ; Syscall number for PRESENT_FRAME
+    SYSCALL
+    LOAD_A 14
+    SYSCALL
+    HALT
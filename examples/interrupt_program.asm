@@ -0,0 +1,21 @@
+; Spins until the interval timer interrupts it, then prints 'T' from the handler.
+; The vector block {line 0, handler} lives at 240-242.
+start:
+    LOAD_A timer    ; Handler address for IRQ_TIMER
+    STORE_A 241
+    LOAD_A 10       ; Syscall number for SET_INTERRUPT_VECTOR
+    LOAD_B 240
+    SYSCALL
+    LOAD_A 9        ; Syscall number for SET_INTERRUPT_MASK
+    LOAD_B 254      ; Unmask line 0 only
+    SYSCALL
+    LOAD_A 11       ; Syscall number for SET_TIMER
+    LOAD_B 20       ; Fire every 20 instructions
+    SYSCALL
+spin:
+    JMP spin
+timer:
+    LOAD_A 1        ; Syscall number for PRINT_CHAR
+    LOAD_B 84       ; 'T'
+    SYSCALL
+    HALT
@@ -0,0 +1,15 @@
+; Runs forever, counting in bank 1 and drawing the count into the framebuffer, so there is
+; always something for live migration to copy. In one emulator run "migrate receive
+; /tmp/emu.sock"; in another load this program, "step" a few times and then run
+; "migrate send /tmp/emu.sock". The count continues in the receiving emulator.
+start:
+    LOAD_A 17           ; Syscall number for SET_BANK
+    LOAD_B 1
+    SYSCALL
+loop:
+    LOAD_A_MEM 16384    ; Count at 0x4000 in bank 1
+    LOAD_B 1
+    ADD_A_B
+    STORE_A_MEM 16384
+    STORE_A_MEM 32768   ; Top-left framebuffer pixel
+    JMP loop
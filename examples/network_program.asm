@@ -0,0 +1,49 @@
+; Run with "network 50 1000000" then "fleet 2 2 examples/network_program.asm".
+; Each machine sends its PID letter ('A' + PID) to the other machine and halts after
+; printing the letter it receives. NIC rings live at 160-195, the TX payload at 200 and
+; the RX buffers at 208, 216, 224 and 232; the vector block {line 2, handler} at 240-242.
+start:
+    LOAD_A 2        ; IRQ_NET
+    STORE_A 240
+    LOAD_A packet   ; Handler address
+    STORE_A 241
+    LOAD_A 10       ; Syscall number for SET_INTERRUPT_VECTOR
+    LOAD_B 240
+    SYSCALL
+    LOAD_A 208      ; RX descriptor buffers
+    STORE_A 182
+    LOAD_A 216
+    STORE_A 186
+    LOAD_A 224
+    STORE_A 190
+    LOAD_A 232
+    STORE_A 194
+    LOAD_A 65       ; Payload = 'A' + PID
+    LOAD_B_MEM VDSO_PID
+    ADD_A_B
+    STORE_A 200
+    LOAD_A 1        ; TX descriptor 0: destination = 1 - PID
+    SUB_A_B
+    STORE_A 164
+    LOAD_A 1        ; length 1
+    STORE_A 165
+    LOAD_A 200      ; buffer 200
+    STORE_A 166
+    LOAD_A 1        ; tx_tail = 1
+    STORE_A 161
+    LOAD_A 15       ; Syscall number for NET_TRANSMIT
+    LOAD_B 160
+    SYSCALL
+    LOAD_A 9        ; Syscall number for SET_INTERRUPT_MASK
+    LOAD_B 251      ; Unmask line 2 only
+    SYSCALL
+wait:
+    JMP wait
+packet:
+    LOAD_A 16       ; Syscall number for NET_RECEIVE
+    LOAD_B 160
+    SYSCALL
+    LOAD_A 1        ; Syscall number for PRINT_CHAR
+    LOAD_B_MEM 208
+    SYSCALL
+    HALT
@@ -0,0 +1,29 @@
+; Prints "Hello" with a single SYSCALL by batching requests on a syscall ring.
+; The ring lives at address 64: header 64-67, submissions 68-83, completions 84-99.
+start:
+    LOAD_A 1        ; PRINT_CHAR
+    STORE_A 68
+    LOAD_A 72       ; 'H'
+    STORE_A 69
+    LOAD_A 1
+    STORE_A 70
+    LOAD_A 101      ; 'e'
+    STORE_A 71
+    LOAD_A 1
+    STORE_A 72
+    LOAD_A 108      ; 'l'
+    STORE_A 73
+    LOAD_A 1
+    STORE_A 74
+    LOAD_A 108      ; 'l'
+    STORE_A 75
+    LOAD_A 1
+    STORE_A 76
+    LOAD_A 111      ; 'o'
+    STORE_A 77
+    LOAD_A 5        ; sq_tail = 5 requests queued
+    STORE_A 65
+    LOAD_A 3        ; Syscall number for SUBMIT_RING
+    LOAD_B 64       ; Ring base address
+    SYSCALL         ; B = number of completed requests
+    HALT
@@ -0,0 +1,11 @@
+; Sweep example: sums the starting A and B and the byte at 0x20, all set per machine by
+; examples/sweep.txt, and leaves the sum in A and at 0x21.
+;
+;   sweep examples/sweep.txt
+;   results sums.bin 0x20:2
+;   fleet 120 4 examples/sweep_program.asm
+ADD_A_B
+LOAD_B_MEM 32
+ADD_A_B
+STORE_A 33
+HALT
@@ -0,0 +1,6 @@
+; Prints the low byte of the instruction counter as a character, read from the vDSO
+start:
+    LOAD_B_MEM VDSO_INSTRUCTION_COUNT
+    LOAD_A 1        ; Syscall number for PRINT_CHAR
+    SYSCALL
+    HALT